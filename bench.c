@@ -0,0 +1,728 @@
+/***********************************************************
+ benchmark for wikisort
+
+ to build and run:
+ gcc -o bench.x bench.c wikisort.c -O3 -pthread
+ ./bench.x [options] > bench_output.txt
+
+ options:
+ -n 10,1000,...  array sizes (default: 10 to 1e8 in powers of ten)
+ -s 4,8,...      item sizes in bytes (default: 4,8,16,64,256)
+ -d random,...   input distributions (default: all)
+ -a wikisort,... algorithms (default: all)
+ -m bytes        skip arrays larger than this (default: 2GB)
+ -t ns           minimum time per measurement in ns (default: 1e8)
+ -b              run the search microbenchmarks instead of the sorts,
+                 -a selects the searches then
+ -g length       sort each array as back to back segments of 1 to
+                 2 * length - 1 items, -a selects the segmented sorts then
+ prints one line of comma separated values per measurement.
+ moves are the number of items written, so a swap counts as two.
+ hardware counters are read with perf_event_open() if
+ available, otherwise they are reported as -1.
+***********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "wikisort.h"
+#include "wikisort_impl.h"
+
+typedef struct algo algo_t;
+typedef struct dist dist_t;
+typedef struct counters counters_t;
+typedef struct search search_t;
+
+struct algo {
+	const char *name;
+	void (*run)(void *base, size_t size, size_t itemsz);
+};
+
+struct dist {
+	const char *name;
+	uint32_t (*key)(size_t i, size_t size);
+};
+
+struct counters {
+	int fd[3];
+	long long value[3];
+};
+
+struct search {
+	const char *name;
+	size_t (*run)(const uint32_t *array, uint32_t value, wikisort_range_t range);
+	bool last; /* looks for the end of the equal keys instead of their start */
+};
+
+static size_t ncmp; /* number of comparator calls */
+static size_t nmove; /* number of items written, if the algorithm reports them */
+static bool have_moves;
+static size_t *map; /* for wikisort_trace() and the prefixes of wikisort_prefix() */
+static char *buffer; /* for mergesort() */
+static size_t search_sink; /* the results of the searches, so they aren't optimized away */
+static size_t *offsets; /* the segments for the segmented sorts */
+static size_t nsegs;
+static struct wikisort_ctx *ctx; /* for wikisort_ctx_segmented(), with a thread per processor */
+
+static int cmp_key(
+		const void *a,
+		const void *b)
+{
+	uint32_t ka, kb;
+	ncmp++;
+	memcpy(&ka, a, sizeof(ka));
+	memcpy(&kb, b, sizeof(kb));
+	if(ka < kb)
+		return -1;
+	else if(ka > kb)
+		return 1;
+	else
+		return 0;
+}
+
+/* input distributions */
+
+static uint32_t key_random(
+		size_t i,
+		size_t size)
+{
+	(void)i;
+	(void)size;
+	return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+static uint32_t key_fewunique(
+		size_t i,
+		size_t size)
+{
+	(void)i;
+	(void)size;
+	return rand() % 16;
+}
+
+static uint32_t key_sorted(
+		size_t i,
+		size_t size)
+{
+	(void)size;
+	return i;
+}
+
+static uint32_t key_reverse(
+		size_t i,
+		size_t size)
+{
+	return size - i;
+}
+
+static uint32_t key_sawtooth(
+		size_t i,
+		size_t size)
+{
+	(void)size;
+	return i % 1000;
+}
+
+static uint32_t key_organpipe(
+		size_t i,
+		size_t size)
+{
+	return i < size / 2 ? i : size - i;
+}
+
+/* sorted, followed by a random 1% */
+static uint32_t key_randomtail(
+		size_t i,
+		size_t size)
+{
+	return i < size - size / 100 ? i : rand() % size;
+}
+
+static uint32_t key_equal(
+		size_t i,
+		size_t size)
+{
+	(void)i;
+	(void)size;
+	return 0;
+}
+
+static const dist_t dists[] = {
+	{ "random", key_random },
+	{ "fewunique", key_fewunique },
+	{ "sorted", key_sorted },
+	{ "reverse", key_reverse },
+	{ "sawtooth", key_sawtooth },
+	{ "organpipe", key_organpipe },
+	{ "randomtail", key_randomtail },
+	{ "equal", key_equal }
+};
+
+/* algorithms */
+
+static void run_wikisort(
+		void *base,
+		size_t size,
+		size_t itemsz)
+{
+	wikisort(base, size, itemsz, cmp_key);
+}
+
+static void run_wikisort_trace(
+		void *base,
+		size_t size,
+		size_t itemsz)
+{
+	wikisort_trace(base, size, itemsz, cmp_key, map);
+}
+
+/* doesn't call cmp_key(), so it reports no comparisons */
+static void run_wikisort_typed(
+		void *base,
+		size_t size,
+		size_t itemsz)
+{
+	wikisort_typed(base, size, itemsz, 0, WIKISORT_U32);
+}
+
+/* the key is its own prefix, so cmp_key() is only called for equal keys */
+static uint64_t prefix_key(
+		const void *a)
+{
+	uint32_t key;
+	memcpy(&key, a, sizeof(key));
+	return (uint64_t)key << 32;
+}
+
+static void run_wikisort_prefix(
+		void *base,
+		size_t size,
+		size_t itemsz)
+{
+	wikisort_prefix(base, size, itemsz, cmp_key, prefix_key, map);
+}
+
+/* sorts in steps of a budget of 65536 items, to show what the bounded steps cost */
+static void run_wikisort_steps(
+		void *base,
+		size_t size,
+		size_t itemsz)
+{
+	struct wikisort_job *job = wikisort_begin(base, size, itemsz, cmp_key);
+	while(wikisort_step(job, 1 << 16) < 1);
+	wikisort_finish(job);
+}
+
+static void run_qsort(
+		void *base,
+		size_t size,
+		size_t itemsz)
+{
+	qsort(base, size, itemsz, cmp_key);
+}
+
+/* top-down merge sort with a buffer of 'size' items, as the reference for a stable sort without memory constraints */
+static void mergesort_range(
+		char *array,
+		char *tmp,
+		size_t start,
+		size_t end,
+		size_t itemsz)
+{
+	size_t mid = start + (end - start) / 2, a, b, out;
+	if(end - start < 2)
+		return;
+	mergesort_range(array, tmp, start, mid, itemsz);
+	mergesort_range(array, tmp, mid, end, itemsz);
+	if(cmp_key(array + mid * itemsz, array + (mid - 1) * itemsz) >= 0)
+		return;
+
+	memcpy(tmp + start * itemsz, array + start * itemsz, (mid - start) * itemsz);
+	nmove += mid - start;
+	for(a = start, b = mid, out = start; a < mid && b < end; out++, nmove++) {
+		if(cmp_key(array + b * itemsz, tmp + a * itemsz) < 0)
+			memcpy(array + out * itemsz, array + b++ * itemsz, itemsz);
+		else
+			memcpy(array + out * itemsz, tmp + a++ * itemsz, itemsz);
+	}
+	memcpy(array + out * itemsz, tmp + a * itemsz, (mid - a) * itemsz);
+	nmove += mid - a;
+}
+
+static void run_mergesort(
+		void *base,
+		size_t size,
+		size_t itemsz)
+{
+	mergesort_range(base, buffer, 0, size, itemsz);
+}
+
+static const algo_t algos[] = {
+	{ "wikisort", run_wikisort },
+	{ "wikisort_trace", run_wikisort_trace },
+	{ "wikisort_typed", run_wikisort_typed },
+	{ "wikisort_prefix", run_wikisort_prefix },
+	{ "wikisort_steps", run_wikisort_steps },
+	{ "qsort", run_qsort },
+	{ "mergesort", run_mergesort }
+};
+
+/* segmented sorts. they sort the segments in 'offsets' on their own */
+
+static void segments_wikisort(
+		void *base,
+		size_t size,
+		size_t itemsz)
+{
+	(void)size;
+	for(size_t i = 0; i < nsegs; i++)
+		wikisort((char*)base + offsets[i] * itemsz, offsets[i + 1] - offsets[i], itemsz, cmp_key);
+}
+
+static void segments_wikisort_segmented(
+		void *base,
+		size_t size,
+		size_t itemsz)
+{
+	(void)size;
+	wikisort_segmented(base, offsets, nsegs, itemsz, cmp_key);
+}
+
+/* cmp_key() counts the comparisons of all threads without synchronizing, so they are only approximate */
+static void segments_wikisort_ctx(
+		void *base,
+		size_t size,
+		size_t itemsz)
+{
+	(void)size;
+	(void)itemsz;
+	wikisort_ctx_segmented(ctx, base, offsets, nsegs);
+}
+
+static void segments_qsort(
+		void *base,
+		size_t size,
+		size_t itemsz)
+{
+	(void)size;
+	for(size_t i = 0; i < nsegs; i++)
+		qsort((char*)base + offsets[i] * itemsz, offsets[i + 1] - offsets[i], itemsz, cmp_key);
+}
+
+static const algo_t segment_algos[] = {
+	{ "wikisort", segments_wikisort },
+	{ "wikisort_segmented", segments_wikisort_segmented },
+	{ "wikisort_ctx", segments_wikisort_ctx },
+	{ "qsort", segments_qsort }
+};
+
+/* hardware counters */
+
+#ifdef __linux__
+static int perf_open(
+		uint64_t config)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+static void counters_open(
+		counters_t *me)
+{
+#ifdef __linux__
+	me->fd[0] = perf_open(PERF_COUNT_HW_CPU_CYCLES);
+	me->fd[1] = perf_open(PERF_COUNT_HW_CACHE_MISSES);
+	me->fd[2] = perf_open(PERF_COUNT_HW_BRANCH_MISSES);
+#else
+	me->fd[0] = me->fd[1] = me->fd[2] = -1;
+#endif
+}
+
+static void counters_start(
+		counters_t *me)
+{
+	for(int i = 0; i < 3; i++) {
+		me->value[i] = -1;
+#ifdef __linux__
+		if(me->fd[i] >= 0) {
+			ioctl(me->fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(me->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+}
+
+static void counters_stop(
+		counters_t *me)
+{
+#ifdef __linux__
+	for(int i = 0; i < 3; i++) {
+		if(me->fd[i] >= 0) {
+			ioctl(me->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+			if(read(me->fd[i], &me->value[i], sizeof(me->value[i])) != sizeof(me->value[i]))
+				me->value[i] = -1;
+		}
+	}
+#endif
+}
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* parse a comma separated list of numbers, returns the number of values */
+static size_t parse_sizes(
+		const char *arg,
+		size_t *values,
+		size_t max)
+{
+	size_t n = 0;
+	while(*arg && n < max) {
+		char *end;
+		values[n++] = (size_t)strtod(arg, &end);
+		arg = *end == ',' ? end + 1 : end;
+		if(*end != ',' && *end != 0)
+			break;
+	}
+	return n;
+}
+
+/* check whether 'name' is in the comma separated list, or the list is NULL */
+static bool selected(
+		const char *list,
+		const char *name)
+{
+	size_t len = strlen(name);
+	if(!list)
+		return true;
+	for(const char *p = list; (p = strstr(p, name)); p += len)
+		if((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == 0))
+			return true;
+	return false;
+}
+
+static void fill(
+		char *array,
+		size_t size,
+		size_t itemsz,
+		const dist_t *dist)
+{
+	srand(1);
+	for(size_t i = 0; i < size; i++) {
+		uint32_t key = dist->key(i, size);
+		char *item = array + i * itemsz;
+		memset(item, 0, itemsz);
+		memcpy(item, &key, itemsz < sizeof(key) ? itemsz : sizeof(key));
+	}
+}
+
+static bool is_sorted(
+		const char *array,
+		size_t size,
+		size_t itemsz)
+{
+	for(size_t i = 1; i < size; i++)
+		if(cmp_key(array + (i - 1) * itemsz, array + i * itemsz) > 0)
+			return false;
+	return true;
+}
+
+/* split the array into segments of random lengths from 1 to 2 * 'length' - 1 */
+static void fill_segments(
+		size_t size,
+		size_t length)
+{
+	srand(2);
+	offsets[0] = 0;
+	for(nsegs = 0; offsets[nsegs] < size; nsegs++) {
+		offsets[nsegs + 1] = offsets[nsegs] + 1 + rand() % (2 * length - 1);
+		if(offsets[nsegs + 1] > size)
+			offsets[nsegs + 1] = size;
+	}
+}
+
+static bool segments_sorted(
+		const char *array,
+		size_t itemsz)
+{
+	for(size_t i = 0; i < nsegs; i++)
+		if(!is_sorted(array + offsets[i] * itemsz, offsets[i + 1] - offsets[i], itemsz))
+			return false;
+	return true;
+}
+
+/* search microbenchmarks. the searches of a generated sort are the same as those of wikisort(), */
+/* except that they compare with an inlined expression */
+
+WIKISORT_DEFINE(search_u32, uint32_t, a < b)
+
+/* the plain binary search with a branch, for comparison */
+static size_t search_plain(
+		const uint32_t *array,
+		uint32_t value,
+		wikisort_range_t range)
+{
+	size_t start = range.start, end = range.end - 1;
+	if(range.start >= range.end)
+		return range.start;
+	while(start < end) {
+		size_t mid = start + (end - start) / 2;
+		if(array[mid] < value)
+			start = mid + 1;
+		else
+			end = mid;
+	}
+	if(start == range.end - 1 && array[start] < value)
+		start++;
+	return start;
+}
+
+static size_t search_binary_first(
+		const uint32_t *array,
+		uint32_t value,
+		wikisort_range_t range)
+{
+	return search_u32_BinaryFirst(array, value, range);
+}
+
+static size_t search_binary_last(
+		const uint32_t *array,
+		uint32_t value,
+		wikisort_range_t range)
+{
+	return search_u32_BinaryLast(array, value, range);
+}
+
+/* skips ahead in 64 steps, then searches within the last step */
+static size_t search_find_forward(
+		const uint32_t *array,
+		uint32_t value,
+		wikisort_range_t range)
+{
+	return search_u32_FindFirstForward(array, value, range, 64);
+}
+
+static const search_t searches[] = {
+	{ "plain", search_plain, false },
+	{ "BinaryFirst", search_binary_first, false },
+	{ "BinaryLast", search_binary_last, true },
+	{ "FindFirstForward", search_find_forward, false }
+};
+
+/* random lookups in a sorted array which holds every key twice. prints the same columns as the sorts, */
+/* but per lookup */
+static int bench_searches(
+		const size_t *sizes,
+		size_t nsizes,
+		size_t max_bytes,
+		double min_ns,
+		const char *search_list,
+		counters_t *counters)
+{
+	size_t nvalues = 1 << 16;
+	uint32_t *values = malloc(nvalues * sizeof(*values));
+
+	for(size_t ni = 0; ni < nsizes; ni++) {
+		size_t size = sizes[ni];
+		uint32_t *array;
+		if(size < 1 || size > UINT32_MAX || size * sizeof(*array) > max_bytes)
+			continue;
+		array = malloc(size * sizeof(*array));
+		if(!array) {
+			fprintf(stderr, "out of memory for size %zu\n", size);
+			continue;
+		}
+		for(size_t i = 0; i < size; i++)
+			array[i] = i / 2;
+		srand(1);
+		for(size_t i = 0; i < nvalues; i++)
+			values[i] = (((uint64_t)rand() << 31) ^ rand()) % (size / 2 + 1);
+
+		for(size_t si = 0; si < sizeof(searches) / sizeof(*searches); si++) {
+			size_t reps = 0, sum = 0;
+			double ns = 0;
+			if(!selected(search_list, searches[si].name))
+				continue;
+
+			for(size_t i = 0; i < nvalues; i++) {
+				size_t expect = 2 * (size_t)values[i] + (searches[si].last ? 2 : 0);
+				if(searches[si].run(array, values[i], wikisort_range_new(0, size)) != (expect < size ? expect : size)) {
+					fprintf(stderr, "%s failed on size %zu\n", searches[si].name, size);
+					return 1;
+				}
+			}
+
+			counters_start(counters);
+			do {
+				double start = now_ns();
+				for(size_t i = 0; i < nvalues; i++)
+					sum += searches[si].run(array, values[i], wikisort_range_new(0, size));
+				ns += now_ns() - start;
+				reps++;
+			} while(ns < min_ns);
+			counters_stop(counters);
+
+			printf("%s,random,%zu,%zu,%zu,%.3f,-1,-1,%.3f,%.3f,%.3f\n",
+					searches[si].name, size, sizeof(*array), reps,
+					ns / reps / nvalues,
+					counters->value[0] < 0 ? -1.0 : (double)counters->value[0] / reps / nvalues,
+					counters->value[1] < 0 ? -1.0 : (double)counters->value[1] / reps / nvalues,
+					counters->value[2] < 0 ? -1.0 : (double)counters->value[2] / reps / nvalues);
+			fflush(stdout);
+			search_sink += sum;
+		}
+		free(array);
+	}
+	free(values);
+	return 0;
+}
+
+int main(
+		int argc,
+		char **argv)
+{
+	size_t sizes[64] = { 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000 };
+	size_t itemszs[64] = { 4, 8, 16, 64, 256 };
+	size_t nsizes = 8, nitemszs = 5;
+	size_t max_bytes = (size_t)2 << 30;
+	double min_ns = 1e8;
+	const char *dist_list = NULL, *algo_list = NULL;
+	const algo_t *table = algos;
+	size_t ntable = sizeof(algos) / sizeof(*algos), segment = 0;
+	counters_t counters;
+	bool search = false;
+	int opt;
+
+	while((opt = getopt(argc, argv, "n:s:d:a:m:t:bg:")) != -1) {
+		switch(opt) {
+			case 'n': nsizes = parse_sizes(optarg, sizes, 64); break;
+			case 's': nitemszs = parse_sizes(optarg, itemszs, 64); break;
+			case 'd': dist_list = optarg; break;
+			case 'a': algo_list = optarg; break;
+			case 'm': max_bytes = (size_t)strtod(optarg, NULL); break;
+			case 't': min_ns = strtod(optarg, NULL); break;
+			case 'b': search = true; break;
+			case 'g': segment = (size_t)strtod(optarg, NULL); break;
+			default:
+				fprintf(stderr, "usage: %s [-n sizes] [-s itemsizes] [-d dists] [-a algos] [-m maxbytes] [-t min_ns] [-b] [-g length]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	counters_open(&counters);
+	printf("algo,dist,size,itemsz,reps,ns_per_item,cmps_per_item,moves_per_item,cycles_per_item,cache_misses_per_item,branch_misses_per_item\n");
+	if(search)
+		return bench_searches(sizes, nsizes, max_bytes, min_ns, algo_list, &counters);
+	if(segment > 0) {
+		table = segment_algos;
+		ntable = sizeof(segment_algos) / sizeof(*segment_algos);
+	}
+
+	for(size_t si = 0; si < nitemszs; si++)
+	for(size_t ni = 0; ni < nsizes; ni++) {
+		size_t itemsz = itemszs[si], size = sizes[ni];
+		char *array, *input;
+		if(itemsz < 1 || size * itemsz > max_bytes)
+			continue;
+		array = malloc(size * itemsz);
+		input = malloc(size * itemsz);
+		map = malloc(size * sizeof(*map));
+		buffer = malloc(size * itemsz);
+		offsets = segment > 0 ? malloc((size + 1) * sizeof(*offsets)) : NULL;
+		ctx = segment > 0 ? wikisort_ctx_new(itemsz, cmp_key, sysconf(_SC_NPROCESSORS_ONLN)) : NULL;
+		if(!array || !input || !map || !buffer || (segment > 0 && (!offsets || !ctx))) {
+			fprintf(stderr, "out of memory for size %zu, itemsz %zu\n", size, itemsz);
+			free(array);
+			free(input);
+			free(map);
+			free(buffer);
+			free(offsets);
+			wikisort_ctx_free(ctx);
+			continue;
+		}
+		if(segment > 0)
+			fill_segments(size, segment);
+
+		for(size_t di = 0; di < sizeof(dists) / sizeof(*dists); di++) {
+			if(!selected(dist_list, dists[di].name))
+				continue;
+			fill(input, size, itemsz, &dists[di]);
+
+			for(size_t ai = 0; ai < ntable; ai++) {
+				size_t reps = 0, cmps;
+				double ns = 0;
+				if(!selected(algo_list, table[ai].name))
+					continue;
+
+				/* repeat small sorts until they took long enough to be measured */
+				ncmp = nmove = 0;
+				have_moves = table[ai].run == run_mergesort;
+				counters_start(&counters);
+				do {
+					double start;
+					memcpy(array, input, size * itemsz);
+					start = now_ns();
+					table[ai].run(array, size, itemsz);
+					ns += now_ns() - start;
+					reps++;
+				} while(ns < min_ns);
+				counters_stop(&counters);
+				cmps = ncmp;
+
+				if(segment > 0 ? !segments_sorted(array, itemsz) : !is_sorted(array, size, itemsz)) {
+					fprintf(stderr, "%s failed on %s, size %zu, itemsz %zu\n", table[ai].name, dists[di].name, size, itemsz);
+					return 1;
+				}
+
+				/* wikisort reports its moves through its statistics, which are collected in an extra run that isn't measured */
+				if(table[ai].run == run_wikisort || table[ai].run == run_wikisort_trace) {
+					struct wikisort_stats stats;
+					stats.timing = 0;
+					memcpy(array, input, size * itemsz);
+					wikisort_stats(array, size, itemsz, cmp_key, &stats);
+					nmove = (stats.moves + 2 * stats.swaps) * reps;
+					have_moves = true;
+				}
+
+				/* the counters include copying the input, which is the same for all algorithms */
+				printf("%s,%s,%zu,%zu,%zu,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+						table[ai].name, dists[di].name, size, itemsz, reps,
+						ns / reps / size,
+						(double)cmps / reps / size,
+						have_moves ? (double)nmove / reps / size : -1.0,
+						counters.value[0] < 0 ? -1.0 : (double)counters.value[0] / reps / size,
+						counters.value[1] < 0 ? -1.0 : (double)counters.value[1] / reps / size,
+						counters.value[2] < 0 ? -1.0 : (double)counters.value[2] / reps / size);
+				fflush(stdout);
+			}
+		}
+		free(array);
+		free(input);
+		free(map);
+		free(buffer);
+		free(offsets);
+		wikisort_ctx_free(ctx);
+	}
+	return 0;
+}
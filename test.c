@@ -2,8 +2,13 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <math.h>
 
 #include "wikisort.h"
+#include "wikisort_impl.h"
 
 typedef struct test test_t;
 
@@ -25,50 +30,826 @@ static int cmp_test(
 		return 0;
 }
 
-#define N 1927 /* total number of different v[0] values */
-#define M 9718187 /* array size */
-static int test(
-		size_t ntotal)
+/* compares v[1] as well, which gives the order of a stable sort by v[0] */
+static int cmp_stable(
+		const void *a_,
+		const void *b_)
 {
-	test_t *array = malloc(ntotal * sizeof(*array));
-	test_t *unsorted = malloc(ntotal * sizeof(*array));
-	size_t *order = malloc(ntotal * sizeof(*order));
-	size_t *expect = malloc(ntotal * sizeof(*order));
-	size_t off[N]; /* offset in expected array where v[0]==index, v[1]==0 */
-	int size[N]; /* counters for test_t.v[1] values */
-	int prev;
+	const test_t *a = a_;
+	const test_t *b = b_;
+	int cmp = cmp_test(a, b);
+	if(cmp != 0)
+		return cmp;
+	else if(a->v[1] < b->v[1])
+		return -1;
+	else if(a->v[1] > b->v[1])
+		return 1;
+	else
+		return 0;
+}
+
+/* compares v[1] only */
+static int cmp_second(
+		const void *a_,
+		const void *b_)
+{
+	const test_t *a = a_;
+	const test_t *b = b_;
+	if(a->v[1] < b->v[1])
+		return -1;
+	else if(a->v[1] > b->v[1])
+		return 1;
+	else
+		return 0;
+}
+
+WIKISORT_DEFINE(sort_test, test_t, a.v[0] < b.v[0])
+
+static void generic_trace(
+		test_t *base,
+		size_t size,
+		size_t *map)
+{
+	wikisort_trace(base, size, sizeof(test_t), cmp_test, map);
+}
+
+static int cmp_key(
+		const void *a_,
+		const void *b_,
+		void *ctx)
+{
+	const int *a = a_;
+	const int *b = b_;
+	(*(size_t*)ctx)++;
+	if(*a < *b)
+		return -1;
+	else if(*a > *b)
+		return 1;
+	else
+		return 0;
+}
+
+static void key_trace(
+		test_t *base,
+		size_t size,
+		size_t *map)
+{
+	size_t calls = 0;
+	wikisort_trace_key(base, size, sizeof(test_t), offsetof(test_t, v[0]), sizeof(int), cmp_key, &calls, map);
+	assert(calls > 0);
+}
+
+/* cmp_key() gets whole items here, whose first member is v[0] */
+static void sort_r(
+		test_t *base,
+		size_t size)
+{
+	size_t calls = 0;
+	wikisort_r(base, size, sizeof(test_t), cmp_key, &calls);
+	assert(size < 2 || calls > 0);
+}
+
+static void sort_key(
+		test_t *base,
+		size_t size)
+{
+	size_t calls = 0;
+	wikisort_key(base, size, sizeof(test_t), offsetof(test_t, v[0]), sizeof(int), cmp_key, &calls);
+	assert(size < 2 || calls > 0);
+}
+
+static void indirect_trace(
+		test_t *base,
+		size_t size,
+		size_t *map)
+{
+	wikisort_indirect(base, size, sizeof(test_t), cmp_test, map);
+}
+
+static void indirect_key_trace(
+		test_t *base,
+		size_t size,
+		size_t *map)
+{
+	size_t calls = 0;
+	void *scratch = malloc(size * WIKISORT_INDIRECT_ENTRYSZ(sizeof(int)));
+	wikisort_indirect_key(base, size, sizeof(test_t), offsetof(test_t, v[0]), sizeof(int), cmp_key, &calls, scratch, map);
+	assert(size < 2 || calls > 0);
+	free(scratch);
+}
+
+static void stats_trace(
+		test_t *base,
+		size_t size,
+		size_t *map)
+{
+	struct wikisort_stats stats;
+	stats.timing = 1;
+	wikisort_trace_stats(base, size, sizeof(test_t), cmp_test, map, &stats);
+	assert(stats.compares > 0 && stats.levels > 0 && stats.moves + stats.swaps > 0);
+}
+
+/* sort both halves, then merge them */
+static void merge_trace(
+		test_t *base,
+		size_t size,
+		size_t *map)
+{
+	size_t half = size / 2;
+	size_t *merged = malloc(size * sizeof(*merged));
+	wikisort_trace(base, half, sizeof(test_t), cmp_test, map);
+	wikisort_trace(base + half, size - half, sizeof(test_t), cmp_test, map + half);
+	for(size_t i = half; i < size; i++)
+		map[i] += half;
+	wikisort_trace_merge(base, half, size - half, sizeof(test_t), cmp_test, merged);
+	for(size_t i = 0; i < size; i++)
+		merged[i] = map[merged[i]];
+	memcpy(map, merged, size * sizeof(*map));
+	free(merged);
+}
+
+/* sort the first third and the rest, then merge them */
+static void merge(
+		test_t *base,
+		size_t size)
+{
+	size_t third = size / 3;
+	wikisort(base, third, sizeof(test_t), cmp_test);
+	wikisort(base + third, size - third, sizeof(test_t), cmp_test);
+	wikisort_merge(base, third, size - third, sizeof(test_t), cmp_test);
+}
+
+/* sort 100 pieces of the array, then merge them all at once */
+static void merge_runs_trace(
+		test_t *base,
+		size_t size,
+		size_t *map)
+{
+	size_t count = 100, piece = size / count;
+	struct wikisort_run runs[100];
+	size_t tree[2 * 100];
+	struct wikisort_origin *origin = malloc(size * sizeof(*origin));
+	test_t *out = malloc(size * sizeof(*out));
+	for(size_t i = 0; i < count; i++) {
+		size_t start = i * piece, end = i == count - 1 ? size : start + piece;
+		wikisort_trace(base + start, end - start, sizeof(test_t), cmp_test, map + start);
+		runs[i].base = base + start;
+		runs[i].size = end - start;
+	}
+	wikisort_trace_merge_runs(runs, count, sizeof(test_t), cmp_test, out, origin, tree);
+	for(size_t i = 0; i < size; i++)
+		origin[i].index = origin[i].run * piece + map[origin[i].run * piece + origin[i].index];
+	for(size_t i = 0; i < size; i++)
+		map[i] = origin[i].index;
+	memcpy(base, out, size * sizeof(*out));
+	free(origin);
+	free(out);
+}
+
+/* where stream_emit() puts the items, and what it checks their origin against */
+struct stream {
+	const struct wikisort_run *runs;
+	size_t *next; /* size: number of runs */
+	test_t *out;
+	size_t count;
+};
+
+/* every run has to be emitted in its own order, and the origin has to point at the item */
+static void stream_emit(
+		const void *item,
+		size_t run,
+		size_t index,
+		void *ctx)
+{
+	struct stream *stream = ctx;
+	assert(index == stream->next[run]++);
+	assert(memcmp(item, (const test_t*)stream->runs[run].base + index, sizeof(test_t)) == 0);
+	memcpy(stream->out + stream->count++, item, sizeof(test_t));
+}
+
+/* sort 7 pieces of the array, then stream them out merged */
+static void stream_runs(
+		test_t *base,
+		size_t size)
+{
+	size_t count = 7, piece = size / count;
+	struct wikisort_run runs[7];
+	size_t next[7] = { 0 };
+	size_t tree[2 * 7];
+	struct stream stream = { runs, next, malloc(size * sizeof(test_t)), 0 };
+	for(size_t i = 0; i < count; i++) {
+		size_t start = i * piece, end = i == count - 1 ? size : start + piece;
+		wikisort(base + start, end - start, sizeof(test_t), cmp_test);
+		runs[i].base = base + start;
+		runs[i].size = end - start;
+	}
+	wikisort_stream_runs(runs, count, sizeof(test_t), cmp_test, stream_emit, &stream, tree);
+	assert(stream.count == size);
+	memcpy(base, stream.out, size * sizeof(test_t));
+	free(stream.out);
+}
+
+static void typed_trace(
+		test_t *base,
+		size_t size,
+		size_t *map)
+{
+	wikisort_trace_typed(base, size, sizeof(test_t), offsetof(test_t, v[0]), WIKISORT_I32, map);
+}
+
+static int typed_keytype; /* the type of the keys compared by cmp_typed() */
+static size_t typed_keyoff; /* and their offset within the items */
+
+/* the order of wikisort_typed(): floats are ordered by value with -0 before +0, behind NaNs which have the sign bit set */
+/* and before the other NaNs. the tests only use one NaN of each sign, so NaNs of the same sign are equal */
+static int cmp_typed(
+		const void *a_,
+		const void *b_)
+{
+	const char *a = (const char*)a_ + typed_keyoff;
+	const char *b = (const char*)b_ + typed_keyoff;
+	uint64_t ua = 0, ub = 0;
+	int64_t ia = 0, ib = 0;
+	int32_t i32;
+	double fa, fb;
+	float f32;
+	switch(typed_keytype) {
+		case WIKISORT_U32:
+			memcpy(&ua, a, sizeof(uint32_t));
+			memcpy(&ub, b, sizeof(uint32_t));
+			return (ua > ub) - (ua < ub);
+		case WIKISORT_I32:
+			memcpy(&i32, a, sizeof(i32));
+			ia = i32;
+			memcpy(&i32, b, sizeof(i32));
+			ib = i32;
+			return (ia > ib) - (ia < ib);
+		case WIKISORT_U64:
+			memcpy(&ua, a, sizeof(uint64_t));
+			memcpy(&ub, b, sizeof(uint64_t));
+			return (ua > ub) - (ua < ub);
+		case WIKISORT_I64:
+			memcpy(&ia, a, sizeof(int64_t));
+			memcpy(&ib, b, sizeof(int64_t));
+			return (ia > ib) - (ia < ib);
+		case WIKISORT_F32:
+			memcpy(&f32, a, sizeof(f32));
+			fa = f32;
+			memcpy(&f32, b, sizeof(f32));
+			fb = f32;
+			break;
+		default:
+			memcpy(&fa, a, sizeof(fa));
+			memcpy(&fb, b, sizeof(fb));
+			break;
+	}
+	ia = isnan(fa) ? (signbit(fa) ? -1 : 1) : 0;
+	ib = isnan(fb) ? (signbit(fb) ? -1 : 1) : 0;
+	if(ia != ib)
+		return ia < ib ? -1 : 1;
+	else if(ia != 0 || fa != fb)
+		return ia != 0 ? 0 : fa < fb ? -1 : 1;
+	return (signbit(fb) != 0) - (signbit(fa) != 0);
+}
+
+/* a key of the type for wikisort_typed(), which is either random below 'spread' or, now and then, a value at the */
+/* edges of the type: the smallest and largest values, -0 and +0, infinities and NaNs of either sign */
+static void typed_key(
+		void *key,
+		int keytype,
+		int spread)
+{
+	static const double special[] = { 0.0, -0.0, INFINITY, -INFINITY, NAN, -NAN, 1e30, -1e30 };
+	int64_t value = rand() % spread - spread / 2;
+	bool edge = rand() % 8 == 0;
+	int pick = rand() % 8;
+	uint32_t u32 = pick % 2 ? UINT32_MAX : 0;
+	int32_t i32 = pick % 2 ? INT32_MAX : INT32_MIN;
+	uint64_t u64 = pick % 2 ? UINT64_MAX : 0;
+	int64_t i64 = pick % 2 ? INT64_MAX : INT64_MIN;
+	double f64 = edge ? special[pick] : value / 4.0;
+	float f32 = f64;
+	switch(keytype) {
+		case WIKISORT_U32:
+			u32 = edge ? u32 : (uint32_t)value;
+			memcpy(key, &u32, sizeof(u32));
+			break;
+		case WIKISORT_I32:
+			i32 = edge ? i32 : (int32_t)value;
+			memcpy(key, &i32, sizeof(i32));
+			break;
+		case WIKISORT_F32:
+			memcpy(key, &f32, sizeof(f32));
+			break;
+		case WIKISORT_U64:
+			u64 = edge ? u64 : (uint64_t)value << 20;
+			memcpy(key, &u64, sizeof(u64));
+			break;
+		case WIKISORT_I64:
+			i64 = edge ? i64 : value * (1 << 20);
+			memcpy(key, &i64, sizeof(i64));
+			break;
+		default:
+			memcpy(key, &f64, sizeof(f64));
+			break;
+	}
+}
+
+/* sorts items of 4, 8 and 16 bytes with each key type with wikisort_typed(), including arrays of bare keys. without a map */
+/* the typed and the SIMD merges apply. compares with what wikisort() and cmp_typed() give, and since the rest of each */
+/* item counts up, that checks stability too */
+static void typed(
+		size_t size,
+		int spread)
+{
+	char *items = malloc(size * 16), *expect = malloc(size * 16);
+	for(int keytype = WIKISORT_U32; keytype <= WIKISORT_F64; keytype++) {
+		size_t keysz = keytype >= WIKISORT_U64 ? 8 : 4;
+		for(size_t itemsz = keysz; itemsz <= 16; itemsz *= 2) {
+			size_t keyoff = itemsz == 16 ? itemsz - keysz : 0;
+			size_t seqoff = keyoff == 0 ? keysz : 0;
+			srand(1);
+			for(size_t i = 0; i < size; i++) {
+				uint32_t seq = i;
+				memset(items + i * itemsz, (int)i, itemsz);
+				if(itemsz > keysz)
+					memcpy(items + i * itemsz + seqoff, &seq, sizeof(seq));
+				typed_key(items + i * itemsz + keyoff, keytype, spread);
+			}
+			memcpy(expect, items, size * itemsz);
+			typed_keytype = keytype;
+			typed_keyoff = keyoff;
+			wikisort(expect, size, itemsz, cmp_typed);
+			wikisort_typed(items, size, itemsz, keyoff, keytype);
+			assert(memcmp(items, expect, size * itemsz) == 0);
+		}
+	}
+	free(items);
+	free(expect);
+}
+
+/* sorts by v[1] first, then by v[0] with the 32 bit map of the first sort as the seed. within equal v[0] */
+/* values, v[1] counts up in the original order, so this gives the order and the map of a single stable sort */
+static void map32_trace(
+		test_t *base,
+		size_t size,
+		size_t *map)
+{
+	uint32_t *map32 = malloc(size * sizeof(*map32));
+	uint32_t *inverse = malloc(size * sizeof(*inverse));
+	wikisort_trace_map(base, size, sizeof(test_t), cmp_second, map32, NULL, WIKISORT_MAP32);
+	wikisort_trace_map(base, size, sizeof(test_t), cmp_test, map32, inverse, WIKISORT_MAP32 | WIKISORT_MAP_SEEDED);
+	for(size_t i = 0; i < size; i++) {
+		assert(inverse[map32[i]] == i);
+		map[i] = map32[i];
+	}
+	free(map32);
+	free(inverse);
+}
+
+/* leaves ties between nearby values, which cmp_test() has to break */
+static uint64_t prefix_test(
+		const void *a_)
+{
+	const test_t *a = a_;
+	return (uint64_t)(a->v[0] / 16) << 56;
+}
+
+/* doesn't fill 'map', which holds the prefixes instead */
+static void prefix(
+		test_t *base,
+		size_t size,
+		size_t *map)
+{
+	wikisort_prefix(base, size, sizeof(test_t), cmp_test, prefix_test, map);
+}
+
+/* sorts strings made from v[0] instead, which share more bytes than a prefix holds */
+static void strings(
+		test_t *base,
+		size_t size,
+		size_t *map)
+{
+	char *pool = malloc(size * 16);
+	const char **order = malloc(size * sizeof(*order));
+	test_t *sorted = malloc(size * sizeof(*sorted));
+	for(size_t i = 0; i < size; i++) {
+		sprintf(pool + i * 16, "wikisort/%04d", base[i].v[0]);
+		order[i] = pool + i * 16;
+	}
+	wikisort_strings(order, size, map);
+	for(size_t i = 0; i < size; i++) {
+		map[i] = (order[i] - pool) / 16;
+		sorted[i] = base[map[i]];
+	}
+	memcpy(base, sorted, size * sizeof(*base));
+	free(pool);
+	free(order);
+	free(sorted);
+}
+
+/* sorts 16 segments of 600 items, followed by empty segments, on 2 threads. the full batches use up every item, */
+/* and the empty segments used to be put into one batch too many */
+static void segmented_trailing(void)
+{
+	size_t offsets[20];
+	test_t *base = malloc(16 * 600 * sizeof(*base));
+	struct wikisort_ctx *ctx = wikisort_ctx_new(sizeof(test_t), cmp_test, 2);
+	assert(ctx);
 	srand(1);
+	for(size_t i = 0; i < 16 * 600; i++) {
+		base[i].v[0] = rand() % 100;
+		base[i].v[1] = i;
+	}
+	for(size_t i = 0; i < 20; i++)
+		offsets[i] = (i < 16 ? i : 16) * 600;
+	wikisort_ctx_segmented(ctx, base, offsets, 19);
+	wikisort_ctx_free(ctx);
+	for(size_t i = 0; i < 16; i++)
+		for(size_t j = offsets[i] + 1; j < offsets[i + 1]; j++)
+			assert(cmp_stable(base + j - 1, base + j) < 0);
+	free(base);
+}
+
+/* sorts segments of 1 to 300 items on 4 threads, then merges them all at once */
+static void segmented(
+		test_t *base,
+		size_t size)
+{
+	size_t *offsets = malloc((size + 1) * sizeof(*offsets)), nsegs = 0;
+	struct wikisort_run *runs;
+	size_t *tree;
+	test_t *out = malloc(size * sizeof(*out));
+	struct wikisort_ctx *ctx = wikisort_ctx_new(sizeof(test_t), cmp_test, 4);
+	assert(ctx);
+	offsets[0] = 0;
+	for(; offsets[nsegs] < size; nsegs++) {
+		offsets[nsegs + 1] = offsets[nsegs] + nsegs % 300 + 1;
+		if(offsets[nsegs + 1] > size)
+			offsets[nsegs + 1] = size;
+	}
+	wikisort_ctx_segmented(ctx, base, offsets, nsegs);
+	wikisort_ctx_free(ctx);
+	runs = malloc(nsegs * sizeof(*runs));
+	tree = malloc(2 * nsegs * sizeof(*tree));
+	for(size_t i = 0; i < nsegs; i++) {
+		runs[i].base = base + offsets[i];
+		runs[i].size = offsets[i + 1] - offsets[i];
+	}
+	wikisort_merge_runs(runs, nsegs, sizeof(test_t), cmp_test, out, tree);
+	memcpy(base, out, size * sizeof(*out));
+	free(offsets);
+	free(runs);
+	free(tree);
+	free(out);
+}
+
+/* sorts in steps of a small budget, and the rest at once */
+static void incremental(
+		test_t *base,
+		size_t size)
+{
+	struct wikisort_job *job = wikisort_begin(base, size, sizeof(test_t), cmp_test);
+	double progress = 0;
+	assert(job);
+	for(int i = 0; i < 1000 && progress < 1; i++) {
+		double next = wikisort_step(job, 10000);
+		assert(next >= progress && next <= 1);
+		progress = next;
+	}
+	wikisort_finish(job);
+}
+
+/* cancels the sort after a few steps, which has to leave the items intact. they are sorted with cmp_stable() afterwards */
+static void incremental_cancel(
+		test_t *base,
+		size_t size)
+{
+	struct wikisort_job *job = wikisort_begin(base, size, sizeof(test_t), cmp_test);
+	assert(job);
+	for(int i = 0; i < 10; i++)
+		wikisort_step(job, 1000);
+	wikisort_cancel(job);
+	wikisort(base, size, sizeof(test_t), cmp_stable);
+}
+
+/* the items behind the first k are sorted with cmp_stable() afterwards */
+static void topk_k(
+		test_t *base,
+		size_t size,
+		size_t k)
+{
+	wikisort_topk(base, size, k, sizeof(test_t), cmp_test);
+	wikisort(base + k, size - k, sizeof(test_t), cmp_stable);
+}
+
+static void topk(
+		test_t *base,
+		size_t size)
+{
+	topk_k(base, size, size / 3);
+}
+
+static void topk_none(
+		test_t *base,
+		size_t size)
+{
+	topk_k(base, size, 0);
+}
+
+static void topk_all(
+		test_t *base,
+		size_t size)
+{
+	topk_k(base, size, size);
+}
+
+/* write the array into a new file in /tmp */
+static FILE *file_write(
+		char *path,
+		test_t *base,
+		size_t size)
+{
+	int fd = mkstemp(path);
+	FILE *file;
+	size_t count;
+	assert(fd >= 0);
+	file = fdopen(fd, "w+b");
+	count = fwrite(base, sizeof(test_t), size, file);
+	assert(count == size);
+	fflush(file);
+	return file;
+}
+
+/* read the array back from the file, and remove it */
+static void file_read(
+		FILE *file,
+		char *path,
+		test_t *base,
+		size_t size)
+{
+	size_t count;
+	rewind(file);
+	count = fread(base, sizeof(test_t), size, file);
+	assert(count == size);
+	fclose(file);
+	unlink(path);
+}
+
+/* sorts through a file, with less memory than the array needs but at least the 6 items it takes */
+static void external(
+		test_t *base,
+		size_t size)
+{
+	char path[] = "/tmp/wikisort_test.XXXXXX";
+	FILE *file = file_write(path, base, size);
+	int result = wikisort_external(path, path, sizeof(test_t), cmp_test, (size / 3 + 6) * sizeof(test_t), NULL, WIKISORT_EXTERNAL_THREADS);
+	assert(result == 0);
+	file_read(file, path, base, size);
+}
+
+/* sorts items larger than the blocks of a merge, into more runs than can be merged at once. each item starts with a */
+/* test_t, and the rest of it is filled with its v[1] */
+static void external_large(void)
+{
+	size_t itemsz = 3 << 19, count = 20;
+	char path[] = "/tmp/wikisort_test.XXXXXX";
+	char *items = malloc(count * itemsz);
+	int fd = mkstemp(path), result;
+	ssize_t done;
+	assert(items && fd >= 0);
+	srand(1);
+	for(size_t i = 0; i < count; i++) {
+		test_t *item = (test_t*)(items + i * itemsz);
+		memset(item, (int)i, itemsz);
+		item->v[0] = rand() % 4;
+		item->v[1] = i;
+	}
+	done = pwrite(fd, items, count * itemsz, 0);
+	assert(done == (ssize_t)(count * itemsz));
+	result = wikisort_external(path, path, itemsz, cmp_test, 6 * itemsz, NULL, WIKISORT_EXTERNAL_THREADS);
+	assert(result == 0);
+	memset(items, 0, count * itemsz);
+	done = pread(fd, items, count * itemsz, 0);
+	assert(done == (ssize_t)(count * itemsz));
+	for(size_t i = 0; i < count; i++) {
+		test_t *item = (test_t*)(items + i * itemsz);
+		if(i > 0)
+			assert(cmp_stable(items + (i - 1) * itemsz, item) < 0);
+		for(size_t j = sizeof(test_t); j < itemsz; j++)
+			assert(items[i * itemsz + j] == (char)item->v[1]);
+	}
+	close(fd);
+	unlink(path);
+	free(items);
+}
 
-	for(int i = 0; i < N; i++)
-		size[i] = 0;
+static void mapped_flags(
+		test_t *base,
+		size_t size,
+		int flags)
+{
+	char path[] = "/tmp/wikisort_test.XXXXXX";
+	FILE *file = file_write(path, base, size);
+	int result = wikisort_file(path, sizeof(test_t), cmp_test, flags);
+	assert(result == 0);
+	file_read(file, path, base, size);
+}
+
+static void mapped(
+		test_t *base,
+		size_t size)
+{
+	mapped_flags(base, size, 0);
+}
+
+static void mapped_tiles(
+		test_t *base,
+		size_t size)
+{
+	mapped_flags(base, size, WIKISORT_FILE_TILES | WIKISORT_FILE_SYNC);
+}
+
+static void parallel(
+		test_t *base,
+		size_t size)
+{
+	wikisort_parallel(base, size, sizeof(test_t), cmp_test, 4);
+}
+
+#define N 1927 /* total number of different v[0] values */
+#define M 9718187 /* array size */
 
+/* random v[0] values below 'nkeys' */
+static void fill_random(
+		test_t *array,
+		size_t ntotal,
+		size_t nkeys)
+{
+	for(size_t i = 0; i < ntotal; i++)
+		array[i].v[0] = rand() % nkeys;
+}
+
+/* each v[0] value below 'ntotal' once, in random order */
+static void fill_unique(
+		test_t *array,
+		size_t ntotal,
+		size_t nkeys)
+{
+	(void)nkeys;
 	for(size_t i = 0; i < ntotal; i++) {
-		size_t ridx = rand() % N;
-		array[i].v[0] = ridx;
-		array[i].v[1] = size[ridx]++;
-		unsorted[i] = array[i];
+		size_t j = rand() % (i + 1);
+		array[i].v[0] = array[j].v[0];
+		array[j].v[0] = i;
 	}
+}
+
+/* groups of 4 equal v[0] values below 'ntotal' / 4 in order, then the halves of the A+B pairs of each level of the merges */
+/* are swapped at random. if 'ntotal' is a power of two, every pair of every level is then either in order or reversed */
+static void fill_levels(
+		test_t *array,
+		size_t ntotal,
+		size_t nkeys)
+{
+	(void)nkeys;
+	for(size_t i = 0; i < ntotal; i++)
+		array[i].v[0] = i / 4;
+	for(size_t length = 4; 2 * length <= ntotal; length *= 2)
+		for(size_t start = 0; start + 2 * length <= ntotal; start += 2 * length)
+			if(rand() % 2)
+				for(size_t i = start; i < start + length; i++) {
+					int v = array[i].v[0];
+					array[i].v[0] = array[i + length].v[0];
+					array[i + length].v[0] = v;
+				}
+}
+
+/* fill the array with 'fill', and count the items with each v[0] value so far in v[1]. 'off' receives the offset in */
+/* the sorted array where each v[0] value starts */
+static void test_fill(
+		test_t *array,
+		size_t ntotal,
+		size_t nkeys,
+		void (*fill)(test_t *array, size_t ntotal, size_t nkeys),
+		size_t *off) /* size: 'nkeys' */
+{
+	int *size = calloc(nkeys, sizeof(*size)); /* counters for test_t.v[1] values */
+	srand(1);
+
+	fill(array, ntotal, nkeys);
+	for(size_t i = 0; i < ntotal; i++)
+		array[i].v[1] = size[array[i].v[0]]++;
 
 	off[0] = 0;
-	for(int i = 1; i < N; i++)
+	for(size_t i = 1; i < nkeys; i++)
 		off[i] = off[i - 1] + size[i - 1];
+	free(size);
+}
+
+/* fill the array with 'fill', sort it with 'sort_trace', and check that it's sorted stably and that the map is right */
+static void test_keys(
+		size_t ntotal,
+		size_t nkeys,
+		void (*fill)(test_t *array, size_t ntotal, size_t nkeys),
+		void (*sort_trace)(test_t *base, size_t size, size_t *map),
+		bool traced)
+{
+	test_t *array = malloc(ntotal * sizeof(*array));
+	size_t *order = malloc(ntotal * sizeof(*order));
+	size_t *expect = malloc(ntotal * sizeof(*order));
+	size_t *off = malloc(nkeys * sizeof(*off));
+
+	test_fill(array, ntotal, nkeys, fill, off);
 	for(size_t i = 0; i < ntotal; i++)
 		expect[i] = off[array[i].v[0]] + array[i].v[1];
 
-	wikisort_trace(array, ntotal, sizeof(test_t), cmp_test, order);
+	sort_trace(array, ntotal, order);
 
 	for(size_t i = 0; i < ntotal; i++) {
 		assert(off[array[i].v[0]] + array[i].v[1] == i);
-		assert(expect[order[i]] == i);
+		assert(!traced || expect[order[i]] == i);
 	}
 	free(array);
-	free(unsorted);
 	free(order);
 	free(expect);
+	free(off);
+}
+
+/* same as test_keys() for sorts without a map */
+static void test_sorted(
+		size_t ntotal,
+		size_t nkeys,
+		void (*sort)(test_t *base, size_t size))
+{
+	test_t *array = malloc(ntotal * sizeof(*array));
+	size_t *off = malloc(nkeys * sizeof(*off));
+
+	test_fill(array, ntotal, nkeys, fill_random, off);
+	sort(array, ntotal);
+	for(size_t i = 0; i < ntotal; i++)
+		assert(off[array[i].v[0]] + array[i].v[1] == i);
+	free(array);
+	free(off);
+}
+
+/* test_sorted() for empty arrays and single items, sizes around RUN_MIN (32) and PARALLEL_MIN (4096), and large arrays */
+static void test_sizes(
+		void (*sort)(test_t *base, size_t size))
+{
+	static const size_t sizes[] = { 0, 1, 2, 3, 4, 31, 32, 33, 64, 100, 4095, 4096, 8191, 8192, 8193, 100000, M };
+	for(size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++)
+		test_sorted(sizes[i], N, sort);
+}
+
+static int test(
+		size_t ntotal,
+		void (*sort_trace)(test_t *base, size_t size, size_t *map),
+		bool traced)
+{
+	test_keys(ntotal, N, fill_random, sort_trace, traced);
+	return 0;
 }
 
 int main()
 {
-	test(M);
+	test(M, generic_trace, true);
+	/* enough different values for internal buffers which are kept for all of the levels */
+	test_keys(M, M, fill_unique, generic_trace, true);
+	test_keys(M, 100000, fill_random, generic_trace, true);
+	test_keys(1 << 20, 1 << 18, fill_levels, generic_trace, true);
+	test(M, sort_test_trace, true);
+	test_sizes(sort_test);
+	test(M, key_trace, true);
+	test_sizes(sort_r);
+	test_sizes(sort_key);
+	test(M, indirect_trace, true);
+	test(M, indirect_key_trace, true);
+	test(M, stats_trace, true);
+	test_sizes(topk);
+	test_sizes(topk_none);
+	test_sizes(topk_all);
+	test(M, merge_trace, true);
+	test_sizes(merge);
+	test(M, merge_runs_trace, true);
+	test_sizes(stream_runs);
+	test(M, typed_trace, true);
+	typed(100000, 64);
+	typed(1 << 20, 1 << 24);
+	typed(1000, 1 << 24);
+	typed(31, 1 << 24);
+	typed(1, 64);
+	typed(0, 64);
+	test(M, map32_trace, true);
+	test(M, prefix, false);
+	test(M, strings, true);
+	test_sizes(external);
+	external_large();
+	test_sizes(mapped);
+	test_sizes(mapped_tiles);
+	test_sizes(parallel);
+	test_sizes(segmented);
+	segmented_trailing();
+	test_sizes(incremental);
+	test_sizes(incremental_cancel);
 }
 
@@ -0,0 +1,175 @@
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <algorithm>
+
+#include "wikisort.hpp"
+
+/* v[0] is the key, v[1] tells equal keys apart, so any difference to std::stable_sort() shows up */
+struct test {
+	int v[2];
+};
+
+static bool operator==(
+		const test &a,
+		const test &b)
+{
+	return a.v[0] == b.v[0] && a.v[1] == b.v[1];
+}
+
+static bool cmp_test(
+		const test &a,
+		const test &b)
+{
+	return a.v[0] < b.v[0];
+}
+
+static int key_test(
+		const test &a)
+{
+	return a.v[0];
+}
+
+/* too large for the cache of the sort, which then works without it */
+struct large {
+	int v[2];
+	char fill[20000];
+};
+
+/* 'nkeys' different keys in the given order: random, already sorted, reversed, or sorted with a few items swapped */
+enum order {
+	RANDOM,
+	SORTED,
+	REVERSED,
+	ALMOST
+};
+
+static std::vector<test> make(
+		std::size_t size,
+		int nkeys,
+		order ord)
+{
+	std::vector<test> array(size);
+	for(std::size_t i = 0; i < size; i++) {
+		array[i].v[0] = rand() % nkeys;
+		array[i].v[1] = i;
+	}
+	if(ord == SORTED || ord == ALMOST)
+		std::stable_sort(array.begin(), array.end(), cmp_test);
+	else if(ord == REVERSED)
+		std::stable_sort(array.begin(), array.end(), [](const test &a, const test &b) { return a.v[0] > b.v[0]; });
+	if(ord == ALMOST)
+		for(std::size_t i = 0; size > 1 && i < size / 100 + 1; i++)
+			std::swap(array[rand() % size], array[rand() % size]);
+	return array;
+}
+
+/* sort the array with each front end, and compare with std::stable_sort() */
+static void test_plain(
+		std::size_t size,
+		int nkeys,
+		order ord)
+{
+	std::vector<test> array = make(size, nkeys, ord), expect = array, sorted;
+	std::deque<test> deque(array.begin(), array.end());
+	std::vector<std::size_t> map(size);
+	std::stable_sort(expect.begin(), expect.end(), cmp_test);
+
+	sorted = array;
+	wikisort::stable_sort(sorted.begin(), sorted.end(), cmp_test);
+	assert(sorted == expect);
+
+	sorted = array;
+	wikisort::stable_sort(sorted.begin(), sorted.end(), wikisort::less(), key_test);
+	assert(sorted == expect);
+
+	sorted = array;
+	wikisort::stable_sort_trace(sorted.begin(), sorted.end(), map.data(), cmp_test);
+	assert(sorted == expect);
+	for(std::size_t i = 0; i < size; i++)
+		assert(array[map[i]] == expect[i]);
+
+	wikisort::stable_sort(deque.begin(), deque.end(), wikisort::less(), &key_test);
+	assert(std::equal(deque.begin(), deque.end(), expect.begin()));
+}
+
+/* strings which share long prefixes, so their moves and comparisons aren't trivial */
+static void test_strings(
+		std::size_t size)
+{
+	std::vector<std::string> array(size), expect, sorted;
+	std::vector<std::size_t> map(size);
+	char buf[64];
+	for(std::size_t i = 0; i < size; i++) {
+		sprintf(buf, "a long common prefix of the strings/%d", rand() % 1000);
+		array[i] = buf;
+	}
+	expect = array;
+	std::stable_sort(expect.begin(), expect.end());
+	sorted = array;
+	wikisort::stable_sort(sorted.begin(), sorted.end());
+	assert(sorted == expect);
+	sorted = array;
+	wikisort::stable_sort_trace(sorted.begin(), sorted.end(), map.data());
+	assert(sorted == expect);
+	for(std::size_t i = 0; i < size; i++)
+		assert(array[map[i]] == expect[i]);
+}
+
+/* items which can only be moved. the pointers of equal keys have to end up in the same order as with std::stable_sort() */
+static void test_unique(
+		std::size_t size)
+{
+	std::vector<std::unique_ptr<test>> array, expect;
+	for(std::size_t i = 0; i < size; i++) {
+		test item = { { rand() % 100, (int)i } };
+		array.emplace_back(new test(item));
+		expect.emplace_back(new test(item));
+	}
+	auto comp = [](const std::unique_ptr<test> &a, const std::unique_ptr<test> &b) { return a->v[0] < b->v[0]; };
+	std::stable_sort(expect.begin(), expect.end(), comp);
+	wikisort::stable_sort(array.begin(), array.end(), comp);
+	for(std::size_t i = 0; i < size; i++)
+		assert(array[i] && *array[i] == *expect[i]);
+}
+
+/* the fill of each item holds its v[1], which shows whether the items were moved as a whole */
+static void test_large(
+		std::size_t size)
+{
+	std::vector<large> array(size);
+	std::vector<std::size_t> map(size);
+	for(std::size_t i = 0; i < size; i++) {
+		array[i].v[0] = rand() % 10;
+		array[i].v[1] = i;
+		memset(array[i].fill, (int)i, sizeof(array[i].fill));
+	}
+	wikisort::stable_sort_trace(array.begin(), array.end(), map.data(), [](const large &a, const large &b) { return a.v[0] < b.v[0]; });
+	for(std::size_t i = 0; i < size; i++) {
+		assert(map[i] == (std::size_t)array[i].v[1]);
+		assert(i == 0 || array[i - 1].v[0] < array[i].v[0] ||
+				(array[i - 1].v[0] == array[i].v[0] && array[i - 1].v[1] < array[i].v[1]));
+		for(std::size_t j = 0; j < sizeof(array[i].fill); j++)
+			assert(array[i].fill[j] == (char)array[i].v[1]);
+	}
+}
+
+int main()
+{
+	static const std::size_t sizes[] = { 0, 1, 2, 7, 8, 9, 31, 32, 33, 100, 1000, 4097, 100000, 1000000 };
+	static const int nkeys[] = { 1, 4, 1927, 1 << 30 };
+	srand(1);
+	for(std::size_t size : sizes)
+		for(int n : nkeys)
+			for(order ord : { RANDOM, SORTED, REVERSED, ALMOST })
+				test_plain(size, n, ord);
+	test_strings(100000);
+	test_unique(100000);
+	test_large(3000);
+	return 0;
+}
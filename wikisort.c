@@ -17,22 +17,127 @@
 #include <time.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <errno.h>
+#ifndef WIKISORT_NO_THREADS
+#include <pthread.h>
+#endif
+#ifndef WIKISORT_NO_FILES
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+/* the sorting networks and merges of wikisort_typed() use the vector extensions and intrinsics of gcc and clang, */
+/* and pick SSE4.2 or AVX2 at runtime */
+#if !defined(WIKISORT_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD
+#include <immintrin.h>
+#endif
+
+#include "wikisort.h"
 
 #define ARRAY(IDX) (sort->array + (IDX) * sort->itemsz)
+#define CACHE(IDX) (sort->cache + (IDX) * sort->itemsz)
+
+/* default number of items in the external cache used by wikisort() and wikisort_trace(), */
+/* capped to CACHE_BYTES so large items don't blow up the stack */
+#define CACHE_SIZE 512
+#define CACHE_BYTES 16384
+
+/* rotate() follows the permutation cycles instead of block swapping if the shorter side */
+/* is smaller than ROTATE_CYCLES_BYTES, since block swaps would only move a few bytes at a time */
+#define ROTATE_CYCLES_BYTES 64
+
+/* natural runs shorter than this are extended by an insertion sort before merging them */
+#define RUN_MIN 32
+
+/* runsort() keeps the internal buffers for the remaining levels once the A subarrays are this many times as large as them. */
+/* the earlier they are pulled out, the further their values are spread over the sorted array, which makes redistributing them slow */
+#define KEEP_MIN 16
+
+/* wikisort_parallel() doesn't split the work into pieces smaller than this number of items */
+#define PARALLEL_MIN 4096
+
+/* the most tasks a wikisort_job can have pending. every split of an A+B pair leaves one pair behind and shrinks */
+/* the pairs to at most 3/4 of their size, so this is enough for any size_t */
+#define JOB_TASKS 256
+
+/* wikisort_external() reads and writes the runs it merges in blocks of at least this many bytes, if the memory allows it, */
+/* which limits how many runs are merged at once */
+#define EXTERNAL_BLOCK (1 << 20)
+
+/* wikisort_file() with WIKISORT_FILE_TILES sorts tiles of about this many bytes on their own first, which do fit into the caches */
+#define FILE_TILE (1 << 22)
 
 typedef struct sort sort_t;
 typedef struct iter iter_t;
 typedef struct range range_t;
+typedef struct level level_t;
+typedef struct pull pull_t;
+typedef struct keep keep_t;
+typedef struct stats stats_t;
 
 struct sort {
 	char *array;
 	size_t itemsz;
 	size_t size;
+	/* item_index() turns byte offsets into indices with these instead of dividing by 'itemsz' */
+	unsigned index_shift;
+	size_t index_inverse;
+	/* either 'cmp' compares whole items, or 'cmp_r' compares the keys at 'keyoff' within the items and gets 'ctx' passed. */
+	/* if neither is set, the 'keysz' bytes at 'keyoff' are compared with memcmp() */
 	int (*cmp)(const void *a, const void *b);
+	int (*cmp_r)(const void *a, const void *b, void *ctx);
+	void *ctx;
+	size_t keyoff, keysz;
+	/* WIKISORT_U32 etc. if the key at 'keyoff' is one of the types of wikisort_typed(), otherwise 0 */
+	int keytype;
+
+	/* the map holds 'mapsz' byte entries, which are either size_t or uint32_t. they start as the original indices of */
+	/* the items, unless 'seeded' is set and the caller filled them in */
+	char *map;
+	size_t mapsz;
+	bool seeded;
+	/* set by wikisort_prefix(), whose 'map' holds the key prefixes of the items instead of their original indices */
+	bool prefixed;
+	/* set by wikisort_strings(). the items are string pointers and the prefixes hold their bytes from 'depth' on, so items */
+	/* with equal prefixes compare as equal here, and are ordered by the next bytes afterwards */
+	bool strings;
+	size_t depth;
+
+	/* the comparison behind compare(), picked by compare_init() depending on the comparator and 'prefixed' */
+	int (*compare)(const sort_t *sort, const void *a, const void *b);
+
+	/* element movers, picked once per sort by mover_init() depending on 'itemsz' and on the width of the map, if any. */
+	/* 'load' copies item 'cidx' of the cache into the array */
+	void (*swap)(const sort_t *sort, char *a, char *b);
+	void (*copy)(const sort_t *sort, char *a, char *b);
+	void (*load)(const sort_t *sort, char *a, size_t cidx);
+
+	/* optional external cache, which holds 'cache_size' items. 'cachemap' holds the map entries of the cached items if 'map' is set */
+	char *cache;
+	char *cachemap;
+	size_t cache_size;
+
+	/* statistics, or NULL if they aren't collected */
+	stats_t *stats;
+};
 
-	size_t *map;
+/* while statistics are collected, the comparator and the movers of the sort are replaced by ones which count their calls */
+/* and then call the originals, which are kept in 'counted' */
+struct stats {
+	struct wikisort_stats *out;
+	sort_t counted;
 };
 
+/* add to one of the statistics of the sort, if they are collected */
+#define STATS_ADD(FIELD, N) \
+	do { \
+		if(sort->stats) \
+			sort->stats->out->FIELD += (N); \
+	} while(0)
+
 /* calculate how to scale the index value to the range within the array */
 /* the bottom-up merge sort only operates on values that are powers of two, */
 /* so scale down to that power of two, then use a fraction to scale back again */
@@ -48,6 +153,32 @@ struct range {
 	size_t end;
 };
 
+/* the A+B pairs merged by merge_level(). this is either every pair within the current level of 'iter', */
+/* or the single pair 'A' and 'B' if 'iter' is NULL. 'length' is the length of the A subarrays */
+struct level {
+	iter_t *iter;
+	range_t A, B;
+	bool done;
+	size_t length;
+	keep_t *keep;
+};
+
+/* where the values of an internal buffer were pulled out from, and to. 'range' is the A+B pair they came from */
+struct pull {
+	size_t from, to, count;
+	range_t range;
+};
+
+/* internal buffers which are kept from one level of merges to the next, and only redistributed after the last level. */
+/* they are pulled out to the start of the array, where they stay at the start of the first A subarray of each level, */
+/* and are large enough for the A subarrays of 'length' items of the last level */
+struct keep {
+	bool valid;
+	size_t length;
+	pull_t pull[2];
+	range_t buffer1, buffer2;
+};
+
 static inline size_t pow2_floor(
 		size_t x) {
 	for(size_t i = 0; i < sizeof(x) - 2; i++)
@@ -75,19 +206,37 @@ static inline size_t max(
 		return b;
 }
 
-/* copy an element from within the array */
-static inline void copy_aa(
+/* the index of the item at byte offset 'offset' of the array or the cache. the offset is a multiple of 'itemsz', so */
+/* instead of dividing by it, the power of two in 'itemsz' is shifted out and the rest is multiplied with the inverse */
+/* of its odd part modulo 2^n */
+static inline size_t item_index(
 		const sort_t *sort,
-		char *a,
-		char *b)
+		size_t offset)
 {
-	if(sort->map) {
-		size_t *map = sort->map;
-		size_t aidx = (a - sort->array) / sort->itemsz;
-		size_t bidx = (b - sort->array) / sort->itemsz;
-		map[aidx] = map[bidx];
-	}
-	memcpy(a, b, sort->itemsz);
+	return (offset >> sort->index_shift) * sort->index_inverse;
+}
+
+/* read and write entry 'idx' of the map or the cachemap. the movers don't use these, see MAP_MOVER() */
+static inline size_t map_get(
+		const sort_t *sort,
+		const char *map,
+		size_t idx)
+{
+	if(sort->mapsz == sizeof(uint32_t))
+		return ((const uint32_t*)map)[idx];
+	return ((const size_t*)map)[idx];
+}
+
+static inline void map_set(
+		const sort_t *sort,
+		char *map,
+		size_t idx,
+		size_t value)
+{
+	if(sort->mapsz == sizeof(uint32_t))
+		((uint32_t*)map)[idx] = value;
+	else
+		((size_t*)map)[idx] = value;
 }
 
 /* copy an element from the array to an external location */
@@ -97,50 +246,237 @@ static inline size_t copy_pa(
 		char *b)
 {
 	memcpy(a, b, sort->itemsz);
-	if(sort->map) {
-		size_t *map = sort->map;
-		size_t bidx = (b - sort->array) / sort->itemsz;
-		return map[bidx];
-	}
+	if(sort->map)
+		return map_get(sort, sort->map, item_index(sort, b - sort->array));
 	else
 		return 0;
 }
 
-/* copy an element from an external location into the array. note that we need the original index of the external element */
+/* copy an element from an external location into the array. note that we need the map entry of the external element */
 static inline void copy_ap(
 		const sort_t *sort,
 		char *a,
 		char *b,
 		size_t idx)
 {
-	if(sort->map) {
-		size_t *map = sort->map;
-		size_t aidx = (a - sort->array) / sort->itemsz;
-		map[aidx] = idx;
+	if(sort->map)
+		map_set(sort, sort->map, item_index(sort, a - sort->array), idx);
+	memcpy(a, b, sort->itemsz);
+}
+
+/* swap 'n' bytes between two locations which don't overlap. the fixed-size chunks are turned into vector moves by the compiler */
+static inline void swap_bytes(
+		char *a,
+		char *b,
+		size_t n)
+{
+	for(; n >= 32; n -= 32, a += 32, b += 32) {
+		char tmpa[32], tmpb[32];
+		memcpy(tmpa, a, 32);
+		memcpy(tmpb, b, 32);
+		memcpy(a, tmpb, 32);
+		memcpy(b, tmpa, 32);
+	}
+	for(; n >= 8; n -= 8, a += 8, b += 8) {
+		uint64_t tmpa, tmpb;
+		memcpy(&tmpa, a, 8);
+		memcpy(&tmpb, b, 8);
+		memcpy(a, &tmpb, 8);
+		memcpy(b, &tmpa, 8);
+	}
+	for(; n > 0; n--, a++, b++) {
+		char tmp = *a;
+		*a = *b;
+		*b = tmp;
+	}
+}
+
+/* update the map for a swap or a copy of elements within the array, and for a copy of an element from the cache into */
+/* the array. there is one set for each width of the map entries, so the movers never test 'mapsz' */
+#define MAP_MOVER(NAME, TYPE) \
+	static inline void swap_##NAME( \
+			const sort_t *sort, \
+			char *a, \
+			char *b) \
+	{ \
+		TYPE *map = (TYPE*)sort->map; \
+		size_t aidx = item_index(sort, a - sort->array); \
+		size_t bidx = item_index(sort, b - sort->array); \
+		TYPE tmp = map[aidx]; \
+		map[aidx] = map[bidx]; \
+		map[bidx] = tmp; \
+	} \
+	static inline void copy_##NAME( \
+			const sort_t *sort, \
+			char *a, \
+			char *b) \
+	{ \
+		TYPE *map = (TYPE*)sort->map; \
+		map[item_index(sort, a - sort->array)] = map[item_index(sort, b - sort->array)]; \
+	} \
+	static inline void load_##NAME( \
+			const sort_t *sort, \
+			char *a, \
+			size_t cidx) \
+	{ \
+		((TYPE*)sort->map)[item_index(sort, a - sort->array)] = ((const TYPE*)sort->cachemap)[cidx]; \
 	}
+
+MAP_MOVER(map, size_t)
+MAP_MOVER(map32, uint32_t)
+
+/* the movers of items of 'SIZE' bytes which also update a map of the given width */
+#define MOVER_MAP(NAME, SIZE, MAP) \
+	static void swap_##NAME##_##MAP( \
+			const sort_t *sort, \
+			char *a, \
+			char *b) \
+	{ \
+		swap_##MAP(sort, a, b); \
+		swap_##NAME(sort, a, b); \
+	} \
+	static void copy_##NAME##_##MAP( \
+			const sort_t *sort, \
+			char *a, \
+			char *b) \
+	{ \
+		copy_##MAP(sort, a, b); \
+		memcpy(a, b, SIZE); \
+	} \
+	static void load_##NAME##_##MAP( \
+			const sort_t *sort, \
+			char *a, \
+			size_t cidx) \
+	{ \
+		load_##MAP(sort, a, cidx); \
+		memcpy(a, CACHE(cidx), SIZE); \
+	}
+
+/* swap and copy functions for items of a fixed size, and the copy from the cache into the array, with and without */
+/* updating the map. memcpy() with a constant size compiles to plain (unaligned) loads and stores, so alignment doesn't matter here */
+#define MOVER(NAME, SIZE) \
+	static void swap_##NAME( \
+			const sort_t *sort, \
+			char *a, \
+			char *b) \
+	{ \
+		char tmpa[SIZE], tmpb[SIZE]; \
+		(void)sort; \
+		memcpy(tmpa, a, SIZE); \
+		memcpy(tmpb, b, SIZE); \
+		memcpy(a, tmpb, SIZE); \
+		memcpy(b, tmpa, SIZE); \
+	} \
+	static void copy_##NAME( \
+			const sort_t *sort, \
+			char *a, \
+			char *b) \
+	{ \
+		(void)sort; \
+		memcpy(a, b, SIZE); \
+	} \
+	static void load_##NAME( \
+			const sort_t *sort, \
+			char *a, \
+			size_t cidx) \
+	{ \
+		memcpy(a, CACHE(cidx), SIZE); \
+	} \
+	MOVER_MAP(NAME, SIZE, map) \
+	MOVER_MAP(NAME, SIZE, map32)
+
+MOVER(1, 1)
+MOVER(2, 2)
+MOVER(4, 4)
+MOVER(8, 8)
+MOVER(16, 16)
+MOVER(32, 32)
+
+/* fallback for all other item sizes */
+static void swap_any(
+		const sort_t *sort,
+		char *a,
+		char *b)
+{
+	swap_bytes(a, b, sort->itemsz);
+}
+
+static void copy_any(
+		const sort_t *sort,
+		char *a,
+		char *b)
+{
 	memcpy(a, b, sort->itemsz);
 }
 
+static void load_any(
+		const sort_t *sort,
+		char *a,
+		size_t cidx)
+{
+	memcpy(a, CACHE(cidx), sort->itemsz);
+}
+
+MOVER_MAP(any, sort->itemsz, map)
+MOVER_MAP(any, sort->itemsz, map32)
+
+/* pick the movers for this sort. must be called after 'itemsz', 'map' and 'mapsz' are set */
+static void mover_init(
+		sort_t *sort)
+{
+#define MOVER_SET(NAME) \
+		do { \
+			sort->swap = swap_##NAME; \
+			sort->copy = copy_##NAME; \
+			sort->load = load_##NAME; \
+		} while(0)
+#define MOVER_SELECT(NAME) \
+		do { \
+			if(!sort->map) \
+				MOVER_SET(NAME); \
+			else if(sort->mapsz == sizeof(uint32_t)) \
+				MOVER_SET(NAME##_map32); \
+			else \
+				MOVER_SET(NAME##_map); \
+		} while(0)
+	switch(sort->itemsz) {
+		case 1: MOVER_SELECT(1); break;
+		case 2: MOVER_SELECT(2); break;
+		case 4: MOVER_SELECT(4); break;
+		case 8: MOVER_SELECT(8); break;
+		case 16: MOVER_SELECT(16); break;
+		case 32: MOVER_SELECT(32); break;
+		default: MOVER_SELECT(any); break;
+	}
+#undef MOVER_SELECT
+#undef MOVER_SET
+}
+
+/* copy an element from within the array */
+static inline void copy_aa(
+		const sort_t *sort,
+		char *a,
+		char *b)
+{
+	sort->copy(sort, a, b);
+}
+
+/* copy an element from the cache into the array */
+static inline void copy_ac(
+		const sort_t *sort,
+		char *a,
+		size_t cidx)
+{
+	sort->load(sort, a, cidx);
+}
+
 /* swap two elements in the array */
 static inline void swap_aa(
 		const sort_t *sort,
 		char *a,
 		char *b)
 {
-	register size_t itemsz = sort->itemsz;
-	if(sort->map) {
-		size_t *map = sort->map;
-		size_t aidx = (a - sort->array) / itemsz;
-		size_t bidx = (b - sort->array) / itemsz;
-		size_t tmp = map[aidx];
-		map[aidx] = map[bidx];
-		map[bidx] = tmp;
-	}
-	for(size_t i = 0; i < itemsz; i++) {
-		unsigned char tmp = *a;
-		*a++ = *b;
-		*b++ = tmp;
-	}
+	sort->swap(sort, a, b);
 }
 
 /* swap a series of values in the array */
@@ -150,11 +486,26 @@ static inline void blockswap_aa(
 		char *b,
 		size_t n)
 {
-	for(size_t i = 0; i < n; i++) {
-		swap_aa(sort, a, b);
-		a += sort->itemsz;
-		b += sort->itemsz;
+	size_t bytes = n * sort->itemsz;
+	size_t dist = a < b ? (size_t)(b - a) : (size_t)(a - b);
+	if(dist < bytes) {
+		/* the two series overlap, so swap them one element after the other */
+		for(size_t i = 0; i < n; i++) {
+			swap_aa(sort, a, b);
+			a += sort->itemsz;
+			b += sort->itemsz;
+		}
+		return;
+	}
+	
+	/* otherwise swap both series, and their part of the map, in one pass each */
+	STATS_ADD(swaps, n);
+	if(sort->map) {
+		size_t aidx = item_index(sort, a - sort->array);
+		size_t bidx = item_index(sort, b - sort->array);
+		swap_bytes(sort->map + aidx * sort->mapsz, sort->map + bidx * sort->mapsz, n * sort->mapsz);
 	}
+	swap_bytes(a, b, bytes);
 }
 
 /* this is from http://www.codecodex.com/wiki/Calculate_an_integer_square_root */
@@ -254,27 +605,350 @@ static iter_t iter_new(
 	return me;
 }
 
+static inline level_t level_new(
+		iter_t *iter)
+{
+	level_t me;
+	me.iter = iter;
+	me.length = iter_length(iter);
+	me.keep = NULL;
+	return me;
+}
+
+static inline level_t level_pair(
+		range_t A,
+		range_t B)
+{
+	level_t me;
+	me.iter = NULL;
+	me.A = A;
+	me.B = B;
+	me.length = range_length(A);
+	me.keep = NULL;
+	return me;
+}
+
+static inline void level_begin(
+		level_t *me)
+{
+	if(me->iter)
+		iter_begin(me->iter);
+	else
+		me->done = false;
+}
+
+/* get the next A+B pair, returns false if there are no more pairs */
+static inline bool level_next(
+		level_t *me,
+		range_t *A,
+		range_t *B)
+{
+	if(me->iter) {
+		if(iter_finished(me->iter))
+			return false;
+		*A = iter_nextRange(me->iter);
+		*B = iter_nextRange(me->iter);
+		return true;
+	}
+	else if(me->done)
+		return false;
+	*A = me->A;
+	*B = me->B;
+	me->done = true;
+	return true;
+}
+
+/* the bytes of 's' from 'depth' on, as many as fit into a size_t, with the first one in the highest bits. the lowest */
+/* byte is 0 if the string ends within them */
+static inline size_t string_prefix(
+		const char *s,
+		size_t depth)
+{
+	size_t prefix = 0;
+	s += depth;
+	for(size_t i = 0; i < sizeof(size_t) && s[i]; i++)
+		prefix |= (size_t)(unsigned char)s[i] << (sizeof(size_t) - 1 - i) * CHAR_BIT;
+	return prefix;
+}
+
+/* get the prefix of an item in the array or the cache for wikisort_prefix(), which moves in lockstep with the item just */
+/* like its original index in the map would. for items anywhere else, like the temporary copies of InsertionSort(), the */
+/* prefix of a string is read from the string itself, and false is returned otherwise. the prefixes are always size_t */
+static inline bool prefix_get(
+		const sort_t *sort,
+		const void *item,
+		size_t *prefix)
+{
+	uintptr_t at = (uintptr_t)item;
+	if(at - (uintptr_t)sort->array < sort->size * sort->itemsz) {
+		*prefix = ((const size_t*)sort->map)[item_index(sort, at - (uintptr_t)sort->array)];
+		return true;
+	}
+	if(at - (uintptr_t)sort->cache < sort->cache_size * sort->itemsz) {
+		*prefix = ((const size_t*)sort->cachemap)[item_index(sort, at - (uintptr_t)sort->cache)];
+		return true;
+	}
+	if(sort->strings) {
+		*prefix = string_prefix(*(const char**)item, sort->depth);
+		return true;
+	}
+	return false;
+}
+
+/* the comparisons of compare(), for whole items, for keys within the items with or without a comparator, */
+/* and for items with prefixes */
+static int compare_cmp(
+		const sort_t *sort,
+		const void *a,
+		const void *b)
+{
+	return sort->cmp(a, b);
+}
+
+static int compare_key(
+		const sort_t *sort,
+		const void *a,
+		const void *b)
+{
+	return sort->cmp_r((const char*)a + sort->keyoff, (const char*)b + sort->keyoff, sort->ctx);
+}
+
+static int compare_bytes(
+		const sort_t *sort,
+		const void *a,
+		const void *b)
+{
+	return memcmp((const char*)a + sort->keyoff, (const char*)b + sort->keyoff, sort->keysz);
+}
+
+/* items with different prefixes are ordered by them, without calling the comparator. strings always have a prefix, */
+/* and wikisort_prefix() always has 'cmp' */
+static int compare_prefix(
+		const sort_t *sort,
+		const void *a,
+		const void *b)
+{
+	size_t prefix_a, prefix_b;
+	if(prefix_get(sort, a, &prefix_a) && prefix_get(sort, b, &prefix_b)) {
+		if(prefix_a != prefix_b)
+			return prefix_a < prefix_b ? -1 : 1;
+		else if(sort->strings)
+			return 0;
+	}
+	return sort->cmp(a, b);
+}
+
+/* pick the comparison for this sort. must be called after the comparator and 'prefixed' are set */
+static void compare_init(
+		sort_t *sort)
+{
+	if(sort->prefixed)
+		sort->compare = compare_prefix;
+	else if(sort->cmp)
+		sort->compare = compare_cmp;
+	else if(sort->cmp_r)
+		sort->compare = compare_key;
+	else
+		sort->compare = compare_bytes;
+}
+
+/* compare two items */
+static inline int compare(
+		const sort_t *sort,
+		const void *a,
+		const void *b)
+{
+	return sort->compare(sort, a, b);
+}
+
+/* the key of wikisort_typed() as an unsigned integer of the same order: the sign bit of integers is flipped, */
+/* and floats get all their bits flipped if they are negative or just the sign bit otherwise */
+static inline uint64_t key_bits(
+		int keytype,
+		const void *key)
+{
+	uint32_t k32;
+	uint64_t k64;
+	switch(keytype) {
+		case WIKISORT_U32:
+			memcpy(&k32, key, sizeof(k32));
+			return k32;
+		case WIKISORT_I32:
+			memcpy(&k32, key, sizeof(k32));
+			return k32 ^ UINT32_C(0x80000000);
+		case WIKISORT_F32:
+			memcpy(&k32, key, sizeof(k32));
+			return k32 & UINT32_C(0x80000000) ? ~k32 : k32 | UINT32_C(0x80000000);
+		case WIKISORT_U64:
+			memcpy(&k64, key, sizeof(k64));
+			return k64;
+		case WIKISORT_I64:
+			memcpy(&k64, key, sizeof(k64));
+			return k64 ^ UINT64_C(0x8000000000000000);
+		default:
+			memcpy(&k64, key, sizeof(k64));
+			return k64 & UINT64_C(0x8000000000000000) ? ~k64 : k64 | UINT64_C(0x8000000000000000);
+	}
+}
+
+/* turn the result of key_bits() back into the key */
+static inline void key_unbits(
+		int keytype,
+		void *key,
+		uint64_t bits)
+{
+	uint32_t k32 = (uint32_t)bits;
+	switch(keytype) {
+		case WIKISORT_U32:
+			memcpy(key, &k32, sizeof(k32));
+			break;
+		case WIKISORT_I32:
+			k32 ^= UINT32_C(0x80000000);
+			memcpy(key, &k32, sizeof(k32));
+			break;
+		case WIKISORT_F32:
+			k32 = k32 & UINT32_C(0x80000000) ? k32 ^ UINT32_C(0x80000000) : ~k32;
+			memcpy(key, &k32, sizeof(k32));
+			break;
+		case WIKISORT_U64:
+			memcpy(key, &bits, sizeof(bits));
+			break;
+		case WIKISORT_I64:
+			bits ^= UINT64_C(0x8000000000000000);
+			memcpy(key, &bits, sizeof(bits));
+			break;
+		default:
+			bits = bits & UINT64_C(0x8000000000000000) ? bits ^ UINT64_C(0x8000000000000000) : ~bits;
+			memcpy(key, &bits, sizeof(bits));
+			break;
+	}
+}
+
+/* comparators for the keys of wikisort_typed(), indexed by the key type */
+#define KEY_COMPARE(TYPE) \
+	static int compare_##TYPE( \
+			const void *a, \
+			const void *b, \
+			void *ctx) \
+	{ \
+		uint64_t ka = key_bits(WIKISORT_##TYPE, a); \
+		uint64_t kb = key_bits(WIKISORT_##TYPE, b); \
+		(void)ctx; \
+		return (ka > kb) - (ka < kb); \
+	}
+
+KEY_COMPARE(U32)
+KEY_COMPARE(I32)
+KEY_COMPARE(F32)
+KEY_COMPARE(U64)
+KEY_COMPARE(I64)
+KEY_COMPARE(F64)
+#undef KEY_COMPARE
+
+static int (*const key_compare[])(const void *a, const void *b, void *ctx) = {
+	NULL, compare_U32, compare_I32, compare_F32, compare_U64, compare_I64, compare_F64
+};
+
+/* comparator and movers which count their calls while statistics are collected */
+static int compare_stats(
+		const void *a,
+		const void *b,
+		void *ctx)
+{
+	stats_t *stats = ctx;
+	stats->out->compares++;
+	return compare(&stats->counted, a, b);
+}
+
+static void swap_stats(
+		const sort_t *sort,
+		char *a,
+		char *b)
+{
+	sort->stats->out->swaps++;
+	sort->stats->counted.swap(sort, a, b);
+}
+
+static void copy_stats(
+		const sort_t *sort,
+		char *a,
+		char *b)
+{
+	sort->stats->out->moves++;
+	sort->stats->counted.copy(sort, a, b);
+}
+
+/* clear the statistics and install the counting comparator and movers. must be called after mover_init() */
+static void stats_init(
+		sort_t *sort)
+{
+	struct wikisort_stats *out = sort->stats->out;
+	int timing = out->timing;
+	memset(out, 0, sizeof(*out));
+	out->timing = timing;
+	
+	sort->stats->counted = *sort;
+	sort->cmp = NULL;
+	sort->cmp_r = compare_stats;
+	sort->ctx = sort->stats;
+	sort->keyoff = 0;
+	sort->compare = compare_key;
+	sort->swap = swap_stats;
+	sort->copy = copy_stats;
+}
+
+/* processor time in seconds, if the phases of the sort are timed */
+static double stats_clock(
+		const sort_t *sort)
+{
+	if(!sort->stats || !sort->stats->out->timing)
+		return 0;
+	return (double)clock() / CLOCKS_PER_SEC;
+}
+
+/* the statistics for merges where A has 'length' items, or NULL if they aren't collected */
+static struct wikisort_stats_level *stats_level(
+		const sort_t *sort,
+		size_t length)
+{
+	size_t index = 0;
+	if(!sort->stats)
+		return NULL;
+	while(length >>= 1)
+		index++;
+	return &sort->stats->out->level[min(index, WIKISORT_STATS_LEVELS - 1)];
+}
+
 /* toolbox functions used by the sorter */
 
+/* hint that the item at 'p' will be needed soon */
+#ifdef __GNUC__
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void)(p))
+#endif
+
+/* the binary searches halve the range without a branch, so a mispredicted comparison doesn't stall them. */
+/* the middles of both halves are fetched while the current middle is compared, which hides most cache misses */
+/* of the far apart items in large ranges */
+
 /* find the index of the first value within the range that is equal to array[index] */
 static size_t BinaryFirst(
 		const sort_t *sort,
 		const void *value,
 		range_t range)
 {
-	size_t start = range.start, end = range.end - 1;
-	if(range.start >= range.end)
+	size_t start = range.start, length = range_length(range);
+	if(length == 0)
 		return range.start;
-	while(start < end) {
-		size_t mid = start + (end - start) / 2;
-		if(sort->cmp(ARRAY(mid), value) < 0)
-			start = mid + 1;
-		else
-			end = mid;
+	while(length > 1) {
+		size_t half = length / 2;
+		PREFETCH(ARRAY(start + half / 2));
+		PREFETCH(ARRAY(start + half + half / 2));
+		start = compare(sort, ARRAY(start + half), value) < 0 ? start + half : start;
+		length -= half;
 	}
-	if(start == range.end - 1 && sort->cmp(ARRAY(start), value) < 0)
-		start++;
-	return start;
+	return start + (compare(sort, ARRAY(start), value) < 0);
 }
 
 /* find the index of the last value within the range that is equal to array[index], plus 1 */
@@ -283,19 +957,17 @@ static size_t BinaryLast(
 		const void *value,
 		range_t range)
 {
-	size_t start = range.start, end = range.end - 1;
-	if(range.start >= range.end)
+	size_t start = range.start, length = range_length(range);
+	if(length == 0)
 		return range.end;
-	while(start < end) {
-		size_t mid = start + (end - start) / 2;
-		if(sort->cmp(value, ARRAY(mid)) >= 0)
-			start = mid + 1;
-		else
-			end = mid;
+	while(length > 1) {
+		size_t half = length / 2;
+		PREFETCH(ARRAY(start + half / 2));
+		PREFETCH(ARRAY(start + half + half / 2));
+		start = compare(sort, value, ARRAY(start + half)) >= 0 ? start + half : start;
+		length -= half;
 	}
-	if(start == range.end - 1 && sort->cmp(value, ARRAY(start)) >= 0)
-		start++;
-	return start;
+	return start + (compare(sort, value, ARRAY(start)) >= 0);
 }
 
 /* combine a linear search with a binary search to reduce the number of comparisons in situations */
@@ -311,7 +983,7 @@ static size_t FindFirstForward(
 		return range.start;
 	skip = max(range_length(range) / unique, 1);
 	
-	for(index = range.start + skip; sort->cmp(ARRAY(index - 1), value) < 0; index += skip)
+	for(index = range.start + skip; compare(sort, ARRAY(index - 1), value) < 0; index += skip)
 		if(index >= range.end - skip)
 			return BinaryFirst(sort, value, range_new(index, range.end));
 	
@@ -329,7 +1001,7 @@ static size_t FindLastForward(
 		return range.start;
 	skip = max(range_length(range) / unique, 1);
 	
-	for(index = range.start + skip; sort->cmp(value, ARRAY(index - 1)) >= 0; index += skip)
+	for(index = range.start + skip; compare(sort, value, ARRAY(index - 1)) >= 0; index += skip)
 		if(index >= range.end - skip)
 			return BinaryLast(sort, value, range_new(index, range.end));
 	
@@ -347,7 +1019,7 @@ static size_t FindFirstBackward(
 		return range.start;
 	skip = max(range_length(range) / unique, 1);
 	
-	for(index = range.end - skip; index > range.start && sort->cmp(ARRAY(index - 1), value) >= 0; index -= skip)
+	for(index = range.end - skip; index > range.start && compare(sort, ARRAY(index - 1), value) >= 0; index -= skip)
 		if(index < range.start + skip)
 			return BinaryFirst(sort, value, range_new(range.start, index));
 	
@@ -365,7 +1037,7 @@ static size_t FindLastBackward(
 		return range.start;
 	skip = max(range_length(range) / unique, 1);
 	
-	for(index = range.end - skip; index > range.start && sort->cmp(value, ARRAY(index - 1)) < 0; index -= skip)
+	for(index = range.end - skip; index > range.start && compare(sort, value, ARRAY(index - 1)) < 0; index -= skip)
 		if(index < range.start + skip)
 			return BinaryLast(sort, value, range_new(range.start, index));
 	
@@ -374,17 +1046,19 @@ static size_t FindLastBackward(
 
 /* n^2 sorting algorithm used to sort tiny chunks of the full array */
 static void InsertionSort(
-		sort_t *sort,
+		const sort_t *sort,
 		range_t range)
 {
 	char *tmp = alloca(sort->itemsz);
 	size_t i, j;
 	for(i = range.start + 1; i < range.end; i++) {
 		size_t tmpidx = copy_pa(sort, tmp, ARRAY(i));
-		for(j = i; j > range.start && sort->cmp(tmp, ARRAY(j - 1)) < 0; j--)
+		for(j = i; j > range.start && compare(sort, tmp, ARRAY(j - 1)) < 0; j--)
 			copy_aa(sort, ARRAY(j), ARRAY(j - 1));
 		copy_ap(sort, ARRAY(j), tmp, tmpidx);
 	}
+	if(range_length(range) > 1)
+		STATS_ADD(moves, 2 * (range_length(range) - 1));
 }
 
 /* reverse a range of values within the array */
@@ -397,49 +1071,456 @@ static void reverse(
 		swap_aa(sort, ARRAY(range.start + index - 1), ARRAY(range.end - index));
 }
 
-/* rotate the values in an array ([0 1 2 3] becomes [1 2 3 0] if we rotate by 1) */
-/* this assumes that 0 <= amount <= range.length() */
-static void rotate(
+/* copy a range of values from the array into the cache */
+static inline void cache_store(
 		const sort_t *sort,
-		size_t amount,
 		range_t range)
 {
-	size_t split;
-	range_t range1, range2;
-	if(range_length(range) == 0)
+	size_t len = range_length(range);
+	if(len == 0)
 		return;
-	
-	split = range.start + amount;
-	range1 = range_new(range.start, split);
-	range2 = range_new(split, range.end);
-	
-	reverse(sort, range1);
-	reverse(sort, range2);
-	reverse(sort, range);
+	STATS_ADD(moves, len);
+	memcpy(sort->cache, ARRAY(range.start), len * sort->itemsz);
+	if(sort->map)
+		memcpy(sort->cachemap, sort->map + range.start * sort->mapsz, len * sort->mapsz);
 }
 
-/* merge operation using an internal buffer */
-static void MergeInternal(
+/* copy a range of values from the cache back into the array */
+static inline void cache_load(
 		const sort_t *sort,
-		range_t A,
-		range_t B,
-		range_t buffer)
+		size_t start,
+		size_t len)
 {
-	/* whenever we find a value to add to the final array, swap it with the value that's already in that spot */
-	/* when this algorithm is finished, 'buffer' will contain its original contents, but in a different order */
-	register size_t itemsz = sort->itemsz;
-	size_t A_count = 0, B_count = 0;
-	size_t A_len = range_length(A);
-	size_t B_len = range_length(B);
-	char *pa = sort->array + A.start * itemsz;
-	char *pbuf = sort->array + buffer.start * itemsz;
+	if(len == 0)
+		return;
+	STATS_ADD(moves, len);
+	memcpy(ARRAY(start), sort->cache, len * sort->itemsz);
+	if(sort->map)
+		memcpy(sort->map + start * sort->mapsz, sort->cachemap, len * sort->mapsz);
+}
+
+/* move a range of values within the array, the source and destination may overlap */
+static inline void move_aa(
+		const sort_t *sort,
+		size_t to,
+		size_t from,
+		size_t len)
+{
+	STATS_ADD(moves, len);
+	memmove(ARRAY(to), ARRAY(from), len * sort->itemsz);
+	if(sort->map)
+		memmove(sort->map + to * sort->mapsz, sort->map + from * sort->mapsz, len * sort->mapsz);
+}
+
+static inline size_t gcd(
+		size_t a,
+		size_t b)
+{
+	while(b != 0) {
+		size_t tmp = a % b;
+		a = b;
+		b = tmp;
+	}
+	return a;
+}
+
+/* rotate by following the cycles of the permutation, which moves each item exactly once, */
+/* but one item at a time, so it's only worth it if one of the sides is tiny */
+static void rotate_cycles(
+		const sort_t *sort,
+		size_t amount,
+		range_t range)
+{
+	char *tmp = alloca(sort->itemsz);
+	size_t length = range_length(range);
+	size_t cycles = gcd(amount, length);
 	
-	if(B_len > 0 && A_len > 0) {
-		char *pb = sort->array + B.start * itemsz;
+	for(size_t leader = 0; leader < cycles; leader++) {
+		size_t index = leader, next;
+		size_t tmpidx = copy_pa(sort, tmp, ARRAY(range.start + leader));
 		for(;;) {
-			if(sort->cmp(pb, pbuf) >= 0) {
-				swap_aa(sort, pa, pbuf);
-				pa += itemsz;
+			next = index + amount;
+			if(next >= length)
+				next -= length;
+			if(next == leader)
+				break;
+			copy_aa(sort, ARRAY(range.start + index), ARRAY(range.start + next));
+			index = next;
+		}
+		copy_ap(sort, ARRAY(range.start + index), tmp, tmpidx);
+	}
+	STATS_ADD(moves, 2 * cycles);
+}
+
+/* rotate with the Gries-Mills algorithm, which repeatedly block swaps the shorter side into place */
+static void rotate_blocks(
+		const sort_t *sort,
+		size_t amount,
+		range_t range)
+{
+	size_t split = range.start + amount;
+	size_t left = amount, right = range.end - split;
+	
+	while(left != right) {
+		if(left < right) {
+			blockswap_aa(sort, ARRAY(split - left), ARRAY(split + right - left), left);
+			right -= left;
+		}
+		else {
+			blockswap_aa(sort, ARRAY(split - left), ARRAY(split), right);
+			left -= right;
+		}
+	}
+	blockswap_aa(sort, ARRAY(split - left), ARRAY(split), left);
+}
+
+/* rotate the values in an array ([0 1 2 3] becomes [1 2 3 0] if we rotate by 1) */
+/* this assumes that 0 <= amount <= range.length() */
+/* pass cache_size = 0 if the cache is in use and must not be touched */
+static void rotate(
+		const sort_t *sort,
+		size_t amount,
+		range_t range,
+		size_t cache_size)
+{
+	size_t left = amount, right = range_length(range) - amount;
+	if(left == 0 || right == 0)
+		return;
+	STATS_ADD(rotations, 1);
+	STATS_ADD(rotated, left + right);
+	
+	if(left <= right && left <= cache_size) {
+		/* the left side fits into the cache, so move it out of the way and shift the right side over */
+		cache_store(sort, range_new(range.start, range.start + left));
+		move_aa(sort, range.start, range.start + left, right);
+		cache_load(sort, range.start + right, left);
+	}
+	else if(right <= cache_size) {
+		cache_store(sort, range_new(range.start + left, range.end));
+		move_aa(sort, range.end - left, range.start, left);
+		cache_load(sort, range.start, right);
+	}
+	else if(min(left, right) * sort->itemsz < ROTATE_CYCLES_BYTES)
+		rotate_cycles(sort, amount, range);
+	else
+		rotate_blocks(sort, amount, range);
+}
+
+/* the merges of items with a typed key. the comparison is inlined and the item picked without a branch, */
+/* which both only pays off if the item size is a constant as well, so these are instantiated for each key type */
+/* and the usual sizes of bare keys and key+payload pairs */
+static inline __attribute__((always_inline)) void merge_external_typed(
+		const sort_t *sort,
+		range_t A,
+		range_t B,
+		int keytype,
+		size_t itemsz)
+{
+	const char *pc = sort->cache, *pc_last = sort->cache + range_length(A) * itemsz;
+	const char *pb = sort->array + B.start * itemsz, *pb_last = sort->array + B.end * itemsz;
+	char *pinsert = sort->array + A.start * itemsz;
+	size_t keyoff = sort->keyoff;
+
+	while(pc < pc_last && pb < pb_last) {
+		bool from_b = key_bits(keytype, pb + keyoff) < key_bits(keytype, pc + keyoff);
+		memcpy(pinsert, from_b ? pb : pc, itemsz);
+		pinsert += itemsz;
+		pb += from_b ? itemsz : 0;
+		pc += from_b ? 0 : itemsz;
+	}
+	memcpy(pinsert, pc, pc_last - pc);
+}
+
+static inline __attribute__((always_inline)) void merge_internal_typed(
+		const sort_t *sort,
+		range_t A,
+		range_t B,
+		range_t buffer,
+		int keytype,
+		size_t itemsz)
+{
+	char *pbuf = sort->array + buffer.start * itemsz, *pbuf_last = sort->array + (buffer.start + range_length(A)) * itemsz;
+	char *pb = sort->array + B.start * itemsz, *pb_last = sort->array + B.end * itemsz;
+	char *pinsert = sort->array + A.start * itemsz;
+	size_t keyoff = sort->keyoff;
+	char tmp[16];
+
+	while(pbuf < pbuf_last && pb < pb_last) {
+		bool from_b = key_bits(keytype, pb + keyoff) < key_bits(keytype, pbuf + keyoff);
+		char *from = from_b ? pb : pbuf;
+		memcpy(tmp, pinsert, itemsz);
+		memcpy(pinsert, from, itemsz);
+		memcpy(from, tmp, itemsz);
+		pinsert += itemsz;
+		pb += from_b ? itemsz : 0;
+		pbuf += from_b ? 0 : itemsz;
+	}
+	for(; pbuf < pbuf_last; pbuf += itemsz, pinsert += itemsz) {
+		memcpy(tmp, pinsert, itemsz);
+		memcpy(pinsert, pbuf, itemsz);
+		memcpy(pbuf, tmp, itemsz);
+	}
+}
+
+#ifdef SIMD
+/* turn 8 keys of 32 bits or 4 keys of 64 bits into signed integers of the same order, and back again */
+__attribute__((target("avx2")))
+static inline __m256i simd_order32(
+		int keytype,
+		__m256i x)
+{
+	if(keytype == WIKISORT_U32)
+		return _mm256_xor_si256(x, _mm256_set1_epi32(INT32_MIN));
+	else if(keytype == WIKISORT_F32)
+		return _mm256_xor_si256(x, _mm256_and_si256(_mm256_srai_epi32(x, 31), _mm256_set1_epi32(INT32_MAX)));
+	return x;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i simd_order64(
+		int keytype,
+		__m256i x)
+{
+	if(keytype == WIKISORT_U64)
+		return _mm256_xor_si256(x, _mm256_set1_epi64x(INT64_MIN));
+	else if(keytype == WIKISORT_F64)
+		return _mm256_xor_si256(x, _mm256_and_si256(_mm256_cmpgt_epi64(_mm256_setzero_si256(), x), _mm256_set1_epi64x(INT64_MAX)));
+	return x;
+}
+
+/* bitonic merge of the two sorted vectors 'a' and 'b', which leaves the smaller half in 'a' and the larger half in 'b' */
+__attribute__((target("avx2")))
+static inline void simd_merge32(
+		__m256i *a,
+		__m256i *b)
+{
+	__m256i lo, hi, swap;
+	__m256i rev = _mm256_permutevar8x32_epi32(*b, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+	__m256i v[2];
+	v[0] = _mm256_min_epi32(*a, rev);
+	v[1] = _mm256_max_epi32(*a, rev);
+	for(int i = 0; i < 2; i++) {
+		swap = _mm256_permute2x128_si256(v[i], v[i], 1);
+		lo = _mm256_min_epi32(v[i], swap);
+		hi = _mm256_max_epi32(v[i], swap);
+		v[i] = _mm256_blend_epi32(lo, hi, 0xf0);
+		swap = _mm256_shuffle_epi32(v[i], _MM_SHUFFLE(1, 0, 3, 2));
+		lo = _mm256_min_epi32(v[i], swap);
+		hi = _mm256_max_epi32(v[i], swap);
+		v[i] = _mm256_blend_epi32(lo, hi, 0xcc);
+		swap = _mm256_shuffle_epi32(v[i], _MM_SHUFFLE(2, 3, 0, 1));
+		lo = _mm256_min_epi32(v[i], swap);
+		hi = _mm256_max_epi32(v[i], swap);
+		v[i] = _mm256_blend_epi32(lo, hi, 0xaa);
+	}
+	*a = v[0];
+	*b = v[1];
+}
+
+__attribute__((target("avx2")))
+static inline void simd_merge64(
+		__m256i *a,
+		__m256i *b)
+{
+	__m256i lo, hi, swap, gt;
+	__m256i rev = _mm256_permute4x64_epi64(*b, _MM_SHUFFLE(0, 1, 2, 3));
+	__m256i v[2];
+	gt = _mm256_cmpgt_epi64(*a, rev);
+	v[0] = _mm256_blendv_epi8(*a, rev, gt);
+	v[1] = _mm256_blendv_epi8(rev, *a, gt);
+	for(int i = 0; i < 2; i++) {
+		swap = _mm256_permute4x64_epi64(v[i], _MM_SHUFFLE(1, 0, 3, 2));
+		gt = _mm256_cmpgt_epi64(v[i], swap);
+		lo = _mm256_blendv_epi8(v[i], swap, gt);
+		hi = _mm256_blendv_epi8(swap, v[i], gt);
+		v[i] = _mm256_blend_epi32(lo, hi, 0xf0);
+		swap = _mm256_shuffle_epi32(v[i], _MM_SHUFFLE(1, 0, 3, 2));
+		gt = _mm256_cmpgt_epi64(v[i], swap);
+		lo = _mm256_blendv_epi8(v[i], swap, gt);
+		hi = _mm256_blendv_epi8(swap, v[i], gt);
+		v[i] = _mm256_blend_epi32(lo, hi, 0xcc);
+	}
+	*a = v[0];
+	*b = v[1];
+}
+
+/* merge A from the cache with B into the array, for bare keys of 32 or 64 bits. equal keys are indistinguishable then, */
+/* so the bitonic merge is as good as a stable one. the vectors are merged for as long as both sides have enough keys */
+/* left, the rest is merged one key at a time */
+#define MERGE_SIMD(BITS, LANES) \
+	__attribute__((target("avx2"))) \
+	static void merge_simd##BITS( \
+			const sort_t *sort, \
+			range_t A, \
+			range_t B) \
+	{ \
+		int keytype = sort->keytype; \
+		const char *pc = sort->cache, *pc_last = sort->cache + range_length(A) * (BITS / 8); \
+		const char *pb = ARRAY(B.start), *pb_last = ARRAY(B.end); \
+		char *pinsert = ARRAY(A.start); \
+		char pending[BITS / 8 * LANES]; \
+		const char *pp = pending, *pp_last = pending; \
+		 \
+		if(range_length(A) >= LANES && range_length(B) >= LANES) { \
+			__m256i va = simd_order##BITS(keytype, _mm256_loadu_si256((const __m256i*)pc)); \
+			__m256i vb = simd_order##BITS(keytype, _mm256_loadu_si256((const __m256i*)pb)); \
+			pc += sizeof(va); \
+			pb += sizeof(vb); \
+			for(;;) { \
+				simd_merge##BITS(&va, &vb); \
+				_mm256_storeu_si256((__m256i*)pinsert, simd_order##BITS(keytype, va)); \
+				pinsert += sizeof(va); \
+				if(pc_last - pc < (ptrdiff_t)sizeof(va) || pb_last - pb < (ptrdiff_t)sizeof(vb)) \
+					break; \
+				if(key_bits(keytype, pc) <= key_bits(keytype, pb)) { \
+					va = simd_order##BITS(keytype, _mm256_loadu_si256((const __m256i*)pc)); \
+					pc += sizeof(va); \
+				} \
+				else { \
+					va = simd_order##BITS(keytype, _mm256_loadu_si256((const __m256i*)pb)); \
+					pb += sizeof(va); \
+				} \
+			} \
+			_mm256_storeu_si256((__m256i*)pending, simd_order##BITS(keytype, vb)); \
+			pp_last = pending + sizeof(vb); \
+		} \
+		 \
+		/* merge what's left of the three sorted sequences */ \
+		while(pc < pc_last || pb < pb_last || pp < pp_last) { \
+			const char **from = pc < pc_last ? &pc : pb < pb_last ? &pb : &pp; \
+			if(pb < pb_last && key_bits(keytype, pb) < key_bits(keytype, *from)) \
+				from = &pb; \
+			if(pp < pp_last && key_bits(keytype, pp) < key_bits(keytype, *from)) \
+				from = &pp; \
+			memcpy(pinsert, *from, BITS / 8); \
+			pinsert += BITS / 8; \
+			*from += BITS / 8; \
+		} \
+	}
+
+MERGE_SIMD(32, 8)
+MERGE_SIMD(64, 4)
+#undef MERGE_SIMD
+#endif
+
+/* merge A and B with the typed merges if they apply, either from the cache or with the internal buffer 'buffer' */
+/* if it isn't empty. returns false if they don't apply, which is always the case while a map or statistics are kept */
+static bool merge_typed(
+		const sort_t *sort,
+		range_t A,
+		range_t B,
+		range_t buffer)
+{
+	bool internal = range_length(buffer) > 0;
+	if(!sort->keytype || sort->map || sort->stats || sort->itemsz > 16)
+		return false;
+
+#ifdef SIMD
+	if(!internal && sort->itemsz == sort->keysz && __builtin_cpu_supports("avx2")) {
+		if(sort->keysz == 4)
+			merge_simd32(sort, A, B);
+		else
+			merge_simd64(sort, A, B);
+		return true;
+	}
+#endif
+
+#define MERGE_TYPED(KEYTYPE, ITEMSZ) \
+	case KEYTYPE * 32 + ITEMSZ: \
+		if(internal) \
+			merge_internal_typed(sort, A, B, buffer, KEYTYPE, ITEMSZ); \
+		else \
+			merge_external_typed(sort, A, B, KEYTYPE, ITEMSZ); \
+		return true
+
+	switch(sort->keytype * 32 + sort->itemsz) {
+		MERGE_TYPED(WIKISORT_U32, 4);
+		MERGE_TYPED(WIKISORT_U32, 8);
+		MERGE_TYPED(WIKISORT_U32, 16);
+		MERGE_TYPED(WIKISORT_I32, 4);
+		MERGE_TYPED(WIKISORT_I32, 8);
+		MERGE_TYPED(WIKISORT_I32, 16);
+		MERGE_TYPED(WIKISORT_F32, 4);
+		MERGE_TYPED(WIKISORT_F32, 8);
+		MERGE_TYPED(WIKISORT_F32, 16);
+		MERGE_TYPED(WIKISORT_U64, 8);
+		MERGE_TYPED(WIKISORT_U64, 16);
+		MERGE_TYPED(WIKISORT_I64, 8);
+		MERGE_TYPED(WIKISORT_I64, 16);
+		MERGE_TYPED(WIKISORT_F64, 8);
+		MERGE_TYPED(WIKISORT_F64, 16);
+		default:
+			return false;
+	}
+#undef MERGE_TYPED
+}
+
+/* merge operation using an external buffer */
+static void MergeExternal(
+		const sort_t *sort,
+		range_t A,
+		range_t B)
+{
+	/* A fits into the cache, so use that instead of the internal buffer */
+	register size_t itemsz = sort->itemsz;
+	size_t A_index = 0, A_last = range_length(A);
+	char *pb = sort->array + B.start * itemsz;
+	char *pb_last = sort->array + B.end * itemsz;
+	char *pinsert = sort->array + A.start * itemsz;
+	
+	if(merge_typed(sort, A, B, range_new(0, 0)))
+		return;
+	
+	if(range_length(B) > 0 && range_length(A) > 0) {
+		for(;;) {
+			if(compare(sort, pb, CACHE(A_index)) >= 0) {
+				copy_ac(sort, pinsert, A_index);
+				A_index++;
+				pinsert += itemsz;
+				if(A_index == A_last)
+					break;
+			}
+			else {
+				copy_aa(sort, pinsert, pb);
+				pb += itemsz;
+				pinsert += itemsz;
+				if(pb == pb_last)
+					break;
+			}
+		}
+	}
+	
+	/* copy the remainder of A into the final array */
+	for(; A_index < A_last; A_index++, pinsert += itemsz)
+		copy_ac(sort, pinsert, A_index);
+	STATS_ADD(moves, A_last);
+}
+
+/* merge operation using an internal buffer */
+static void MergeInternal(
+		const sort_t *sort,
+		range_t A,
+		range_t B,
+		range_t buffer)
+{
+	/* whenever we find a value to add to the final array, swap it with the value that's already in that spot */
+	/* when this algorithm is finished, 'buffer' will contain its original contents, but in a different order */
+	register size_t itemsz = sort->itemsz;
+	size_t A_count = 0, B_count = 0;
+	size_t A_len = range_length(A);
+	size_t B_len = range_length(B);
+	char *pa = sort->array + A.start * itemsz;
+	char *pbuf = sort->array + buffer.start * itemsz;
+	
+	if(merge_typed(sort, A, B, buffer))
+		return;
+	
+	if(B_len > 0 && A_len > 0) {
+		char *pb = sort->array + B.start * itemsz;
+		for(;;) {
+			if(compare(sort, pb, pbuf) >= 0) {
+				swap_aa(sort, pa, pbuf);
+				pa += itemsz;
 				pbuf += itemsz;
 				A_count++;
 				if(A_count >= A_len)
@@ -462,7 +1543,7 @@ static void MergeInternal(
 
 /* merge operation without a buffer */
 static void MergeInPlace(
-		sort_t *sort,
+		const sort_t *sort,
 		range_t A,
 		range_t B)
 {
@@ -495,7 +1576,7 @@ static void MergeInPlace(
 		
 		/* rotate A into place */
 		size_t amount = mid - A.end;
-		rotate(sort, range_length(A), range_new(A.start, mid));
+		rotate(sort, range_length(A), range_new(A.start, mid), sort->cache_size);
 		if(B.end == mid)
 			break;
 		
@@ -507,501 +1588,2987 @@ static void MergeInPlace(
 	}
 }
 
-static void runsort(
-		sort_t *sort)
-{
 #define CMP(A, B) \
-	sort->cmp(ARRAY(A), ARRAY(B))
+	compare(sort, ARRAY(A), ARRAY(B))
 
-	iter_t iter;
+/* count an A+B pair in the statistics of the current level, if they are collected */
+#define STATS_PAIR(FIELD) \
+	do { \
+		if(level_stats) \
+			level_stats->FIELD++; \
+	} while(0)
 
-	/* if the array is of size 0, 1, 2, or 3, just sort them like so: */
-	if(sort->size < 4) {
-		if(sort->size == 3) {
-			/* hard-coded insertion sort */
-			if(CMP(1, 0) < 0)
-				swap_aa(sort, ARRAY(0), ARRAY(1));
-			if(CMP(2, 1) < 0) {
-				swap_aa(sort, ARRAY(1), ARRAY(2));
-				if(CMP(1, 0) < 0)
-					swap_aa(sort, ARRAY(0), ARRAY(1));
+/* check whether none of the A+B pairs of a level needs a merge, because each of them is either in order or in reverse order */
+static bool level_trivial(
+		const sort_t *sort,
+		level_t *level)
+{
+	range_t A, B;
+	for(level_begin(level); level_next(level, &A, &B);)
+		if(CMP(B.start, A.end - 1) < 0 && CMP(B.end - 1, A.start) >= 0)
+			return false;
+	return true;
+}
+
+/* pull out the two ranges so we can use them as internal buffers */
+static void pull_buffers(
+		const sort_t *sort,
+		pull_t *pull) /* size: 2 */
+{
+	size_t index, count;
+	for(size_t pull_index = 0; pull_index < 2; pull_index++) {
+		range_t range;
+		size_t length = pull[pull_index].count;
+		
+		if(pull[pull_index].to < pull[pull_index].from) {
+			/* we're pulling the values out to the left, which means the start of an A subarray */
+			index = pull[pull_index].from;
+			for(count = 1; count < length; count++) {
+				index = FindFirstBackward(sort, ARRAY(index - 1), range_new(pull[pull_index].to, pull[pull_index].from - (count - 1)), length - count);
+				range = range_new(index + 1, pull[pull_index].from + 1);
+				rotate(sort, range_length(range) - count, range, sort->cache_size);
+				pull[pull_index].from = index + count;
+			}
+		} else if(pull[pull_index].to > pull[pull_index].from) {
+			/* we're pulling values out to the right, which means the end of a B subarray */
+			index = pull[pull_index].from + 1;
+			for(count = 1; count < length; count++) {
+				index = FindLastForward(sort, ARRAY(index), range_new(index, pull[pull_index].to), length - count);
+				range = range_new(pull[pull_index].from, index - 1);
+				rotate(sort, count, range, sort->cache_size);
+				pull[pull_index].from = index - 1 - count;
 			}
 		}
-		else if(sort->size == 2) {
-			/* swap the items if they're out of order */
-			if(CMP(1, 0) < 0)
-				swap_aa(sort, ARRAY(0), ARRAY(1));
-		}
-		return;
 	}
+}
 
-	/* sort groups of 4-8 items at a time using an unstable sorting network, */
-	/* but keep track of the original item orders to force it to be stable */
-	/* http://pages.ripco.net/~jgamble/nw.html */
-#define SWAPIF(X, Y) \
-		do { \
-			int cmp = CMP(range.start + X, range.start + Y); \
-			if(cmp > 0 || (order[X] > order[Y] && cmp >= 0)) { \
-				uint8_t tmp = order[X]; \
-				order[X] = order[Y]; \
-				order[Y] = tmp; \
-				swap_aa(sort, ARRAY(range.start + X), ARRAY(range.start + Y)); \
-			} \
-		} while(0)
-	iter = iter_new(sort->size, 4);
-	for(iter_begin(&iter); !iter_finished(&iter);) {
-		uint8_t order[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
-		range_t range = iter_nextRange(&iter);
+/* put the values of the internal buffers back where they belong */
+static void redistribute_buffers(
+		const sort_t *sort,
+		const pull_t *pull, /* size: 2 */
+		range_t buffer2)
+{
+	size_t index;
 	
-		if(range_length(range) == 8) {
-			SWAPIF(0, 1); SWAPIF(2, 3); SWAPIF(4, 5); SWAPIF(6, 7);
-			SWAPIF(0, 2); SWAPIF(1, 3); SWAPIF(4, 6); SWAPIF(5, 7);
-			SWAPIF(1, 2); SWAPIF(5, 6); SWAPIF(0, 4); SWAPIF(3, 7);
-			SWAPIF(1, 5); SWAPIF(2, 6);
-			SWAPIF(1, 4); SWAPIF(3, 6);
-			SWAPIF(2, 4); SWAPIF(3, 5);
-			SWAPIF(3, 4);
-			
-		}
-		else if(range_length(range) == 7) {
-			SWAPIF(1, 2); SWAPIF(3, 4); SWAPIF(5, 6);
-			SWAPIF(0, 2); SWAPIF(3, 5); SWAPIF(4, 6);
-			SWAPIF(0, 1); SWAPIF(4, 5); SWAPIF(2, 6);
-			SWAPIF(0, 4); SWAPIF(1, 5);
-			SWAPIF(0, 3); SWAPIF(2, 5);
-			SWAPIF(1, 3); SWAPIF(2, 4);
-			SWAPIF(2, 3);
-			
-		}
-		else if(range_length(range) == 6) {
-			SWAPIF(1, 2); SWAPIF(4, 5);
-			SWAPIF(0, 2); SWAPIF(3, 5);
-			SWAPIF(0, 1); SWAPIF(3, 4); SWAPIF(2, 5);
-			SWAPIF(0, 3); SWAPIF(1, 4);
-			SWAPIF(2, 4); SWAPIF(1, 3);
-			SWAPIF(2, 3);
-			
-		}
-		else if(range_length(range) == 5) {
-			SWAPIF(0, 1); SWAPIF(3, 4);
-			SWAPIF(2, 4);
-			SWAPIF(2, 3); SWAPIF(1, 4);
-			SWAPIF(0, 3);
-			SWAPIF(0, 2); SWAPIF(1, 3);
-			SWAPIF(1, 2);
-			
+	/* when we're finished with the merges we should have the one or two internal buffers left over, where the second buffer is all jumbled up */
+	/* insertion sort the second buffer, then redistribute the buffers back into the array using the opposite process used for creating the buffer */
+	
+	/* while an unstable sort like quicksort could be applied here, in benchmarks it was consistently slightly slower than a simple insertion sort, */
+	/* even for tens of millions of items. this may be because insertion sort is quite fast when the data is already somewhat sorted, like it is here */
+	InsertionSort(sort, buffer2);
+	
+	for(size_t pull_index = 0; pull_index < 2; pull_index++) {
+		size_t amount, unique = pull[pull_index].count * 2;
+		if(pull[pull_index].from > pull[pull_index].to) {
+			/* the values were pulled out to the left, so redistribute them back to the right */
+			range_t buffer = range_new(pull[pull_index].range.start, pull[pull_index].range.start + pull[pull_index].count);
+			while(range_length(buffer) > 0) {
+				index = FindFirstForward(sort, ARRAY(buffer.start), range_new(buffer.end, pull[pull_index].range.end), unique);
+				amount = index - buffer.end;
+				rotate(sort, range_length(buffer), range_new(buffer.start, index), sort->cache_size);
+				buffer.start += (amount + 1);
+				buffer.end += amount;
+				unique -= 2;
+			}
 		}
-		else if(range_length(range) == 4) {
-			SWAPIF(0, 1); SWAPIF(2, 3);
-			SWAPIF(0, 2); SWAPIF(1, 3);
-			SWAPIF(1, 2);
+		else if(pull[pull_index].from < pull[pull_index].to) {
+			/* the values were pulled out to the right, so redistribute them back to the left */
+			range_t buffer = range_new(pull[pull_index].range.end - pull[pull_index].count, pull[pull_index].range.end);
+			while(range_length(buffer) > 0) {
+				index = FindLastBackward(sort, ARRAY(buffer.end - 1), range_new(pull[pull_index].range.start, buffer.start), unique);
+				amount = buffer.start - index;
+				rotate(sort, amount, range_new(index, buffer.end), sort->cache_size);
+				buffer.start -= amount;
+				buffer.end -= (amount + 1);
+				unique -= 2;
+			}
 		}
 	}
-	if(sort->size < 8)
-		return;
+}
 
-	for(;;) {
-		/* this is where the in-place merge logic starts!
-		 1. pull out two internal buffers each containing √A unique values
-			1a. adjust block_size and buffer_size if we couldn't find enough unique values
-		 2. loop over the A and B subarrays within this level of the merge sort
-		 3. break A and B into blocks of size 'block_size'
-		 4. "tag" each of the A blocks with values from the first internal buffer
-		 5. roll the A blocks through the B blocks and drop/rotate them where they belong
-		 6. merge each A block with any B values that follow, using the cache or the second internal buffer
-		 7. sort the second internal buffer if it exists
-		 8. redistribute the two internal buffers back into the array */
-		
-		size_t block_size = isqrt(iter_length(&iter));
-		size_t buffer_size = iter_length(&iter)/block_size + 1;
-		
-		/* as an optimization, we really only need to pull out the internal buffers once for each level of merges */
-		/* after that we can reuse the same buffers over and over, then redistribute it when we're finished with this level */
-		range_t buffer1, buffer2, A, B;
-		bool find_separately;
-		size_t index, last, count, find, start, pull_index = 0;
-		struct {
-			size_t from, to, count;
-			range_t range;
-		} pull[2];
-
-		pull[0].from = pull[0].to = pull[0].count = 0; pull[0].range = range_new(0, 0);
-		pull[1].from = pull[1].to = pull[1].count = 0; pull[1].range = range_new(0, 0);
-		
-		buffer1 = range_new(0, 0);
-		buffer2 = range_new(0, 0);
-		
-		/* find two internal buffers of size 'buffer_size' each */
-		find = buffer_size + buffer_size;
-		find_separately = false;
-		
-		if(find > iter_length(&iter)) {
-			/* we can't fit both buffers into the same A or B subarray, so find two buffers separately */
-			find = buffer_size;
-			find_separately = true;
+/* merge each A+B pair of a level */
+static void merge_level(
+		const sort_t *sort,
+		level_t *level)
+{
+	range_t A, B;
+	struct wikisort_stats_level *level_stats = stats_level(sort, level->length);
+	double time = stats_clock(sort), now;
+	
+	if(level_stats) {
+		level_stats->merges++;
+		level_stats->length = level->length;
+		sort->stats->out->levels++;
+	}
+	
+	if(level->length < sort->cache_size || (!(level->keep && level->keep->valid) && level_trivial(sort, level))) {
+		/* if every A and B block will fit into the cache, use a special branch specifically for merging with the cache */
+		/* (we use < rather than <= since the block size might be one more than the level length) */
+		/* the same branch takes care of levels where no pair needs a merge, without pulling out any internal buffers */
+		for(level_begin(level); level_next(level, &A, &B);) {
+			if(CMP(B.end - 1, A.start) < 0) {
+				/* the two ranges are in reverse order, so a simple rotation should fix it */
+				rotate(sort, range_length(A), range_new(A.start, B.end), sort->cache_size);
+				STATS_PAIR(rotated);
+			}
+			else if(CMP(B.start, A.end - 1) < 0) {
+				/* these two ranges weren't already in order, so merge them into the cache */
+				cache_store(sort, A);
+				MergeExternal(sort, A, B);
+				STATS_PAIR(merged_external);
+			}
+			else
+				STATS_PAIR(skipped);
 		}
-		
-		/* we need to find either a single contiguous space containing 2√A unique values (which will be split up into two buffers of size √A each), */
-		/* or we need to find one buffer of < 2√A unique values, and a second buffer of √A unique values, */
-		/* OR if we couldn't find that many unique values, we need the largest possible buffer we can get */
-		
-		/* in the case where it couldn't find a single buffer of at least √A unique values, */
-		/* all of the Merge steps must be replaced by a different merge algorithm (MergeInPlace) */
-		for(iter_begin(&iter); !iter_finished(&iter);) {
-			A = iter_nextRange(&iter);
-			B = iter_nextRange(&iter);
-			
-			/* just store information about where the values will be pulled from and to, */
-			/* as well as how many values there are, to create the two internal buffers */
+		if(level_stats)
+			level_stats->merge_time += stats_clock(sort) - time;
+		return;
+	}
+	
+	/* this is where the in-place merge logic starts!
+	 1. pull out two internal buffers each containing √A unique values
+		1a. adjust block_size and buffer_size if we couldn't find enough unique values
+	 2. loop over the A and B subarrays within this level of the merge sort
+	 3. break A and B into blocks of size 'block_size'
+	 4. "tag" each of the A blocks with values from the first internal buffer
+	 5. roll the A blocks through the B blocks and drop/rotate them where they belong
+	 6. merge each A block with any B values that follow, using the cache or the second internal buffer
+	 7. sort the second internal buffer if it exists
+	 8. redistribute the two internal buffers back into the array */
+	
+	size_t block_size = isqrt(level->length);
+	size_t buffer_size = level->length/block_size + 1;
+	
+	/* as an optimization, we really only need to pull out the internal buffers once for each level of merges */
+	/* after that we can reuse the same buffers over and over, then redistribute it when we're finished with this level. */
+	/* runsort() goes further and keeps the buffers for all of the following levels if they are large enough */
+	range_t buffer1, buffer2;
+	keep_t *keep = level->keep;
+	bool find_separately, kept = keep && keep->valid, found = kept;
+	size_t index, last, count, find, start, pull_index = 0, keep_buffer = 0;
+	pull_t pull[2];
+
+	pull[0].from = pull[0].to = pull[0].count = 0; pull[0].range = range_new(0, 0);
+	pull[1].from = pull[1].to = pull[1].count = 0; pull[1].range = range_new(0, 0);
+	
+	buffer1 = range_new(0, 0);
+	buffer2 = range_new(0, 0);
+	
+	/* just store information about where the values will be pulled from and to, */
+	/* as well as how many values there are, to create the two internal buffers */
 #define PULL(_to) \
-		pull[pull_index].range = range_new(A.start, B.end); \
-		pull[pull_index].count = count; \
-		pull[pull_index].from = index; \
-		pull[pull_index].to = _to
-			
-			/* check A for the number of unique values we need to fill an internal buffer */
-			/* these values will be pulled out to the start of A */
+	pull[pull_index].range = range_new(A.start, B.end); \
+	pull[pull_index].count = count; \
+	pull[pull_index].from = index; \
+	pull[pull_index].to = _to
+	
+	if(kept) {
+		/* the kept buffers are still at the start of the array, which is the start of the first A subarray of this level too */
+		level_begin(level);
+		level_next(level, &A, &B);
+		pull[0] = keep->pull[0];
+		pull[0].range = range_new(A.start, B.end);
+	}
+	else if(keep) {
+		/* try to find enough unique values for the buffers of the last level in the first A subarray, so they can be kept */
+		keep_buffer = keep->length / isqrt(keep->length) + 1;
+		find = isqrt(keep->length) <= sort->cache_size ? keep_buffer : keep_buffer + keep_buffer;
+		level_begin(level);
+		level_next(level, &A, &B);
+		if(range_length(A) >= KEEP_MIN * find) {
 			for(last = A.start, count = 1; count < find; last = index, count++) {
 				index = FindLastForward(sort, ARRAY(last), range_new(last + 1, A.end), find - count);
 				if(index == A.end)
 					break;
 			}
 			index = last;
-
-			
-			if(count >= buffer_size) {
-				/* keep track of the range within the array where we'll need to "pull out" these values to create the internal buffer */
-				PULL(A.start);
-				pull_index = 1;
-				
-				if(count == buffer_size + buffer_size) {
-					/* we were able to find a single contiguous section containing 2√A unique values, */
-					/* so this section can be used to contain both of the internal buffers we'll need */
-					buffer1 = range_new(A.start, A.start + buffer_size);
-					buffer2 = range_new(A.start + buffer_size, A.start + count);
-					break;
-				}
-				else if(find == buffer_size + buffer_size) {
-					/* we found a buffer that contains at least √A unique values, but did not contain the full 2√A unique values, */
-					/* so we still need to find a second separate buffer of at least √A unique values */
-					buffer1 = range_new(A.start, A.start + count);
-					find = buffer_size;
-				}
-				else if(find_separately) {
-					/* found one buffer, but now find the other one */
-					buffer1 = range_new(A.start, A.start + count);
-					find_separately = false;
-				}
-				else {
-					/* we found a second buffer in an 'A' subarray containing √A unique values, so we're done! */
-					buffer2 = range_new(A.start, A.start + count);
-					break;
-				}
-			}
-			else if(pull_index == 0 && count > range_length(buffer1)) {
-				/* keep track of the largest buffer we were able to find */
-				buffer1 = range_new(A.start, A.start + count);
+			if(count == find) {
 				PULL(A.start);
+				found = true;
 			}
-			
-			/* check B for the number of unique values we need to fill an internal buffer */
-			/* these values will be pulled out to the end of B */
-			for(last = B.end - 1, count = 1; count < find; last = index - 1, count++) {
-				index = FindFirstBackward(sort, ARRAY(last), range_new(B.start, last), find - count);
-				if(index == B.start) break;
-			}
-			index = last;
-			
-			if(count >= buffer_size) {
-				/* keep track of the range within the array where we'll need to "pull out" these values to create the internal buffer */
-				PULL(B.end);
-				pull_index = 1;
-				
-				if(count == buffer_size + buffer_size) {
-					/* we were able to find a single contiguous section containing 2√A unique values, */
-					/* so this section can be used to contain both of the internal buffers we'll need */
-					buffer1 = range_new(B.end - count, B.end - buffer_size);
-					buffer2 = range_new(B.end - buffer_size, B.end);
-					break;
-				}
-				else if(find == buffer_size + buffer_size) {
-					/* we found a buffer that contains at least √A unique values, but did not contain the full 2√A unique values, */
-					/* so we still need to find a second separate buffer of at least √A unique values */
-					buffer1 = range_new(B.end - count, B.end);
-					find = buffer_size;
-				}
-				else if(find_separately) {
-					/* found one buffer, but now find the other one */
-					buffer1 = range_new(B.end - count, B.end);
-					find_separately = false;
-				}
-				else {
-					/* buffer2 will be pulled out from a 'B' subarray, so if the first buffer was pulled out from the corresponding 'A' subarray, */
-					/* we need to adjust the end point for that A subarray so it knows to stop redistributing its values before reaching buffer2 */
-					if(pull[0].range.start == A.start) pull[0].range.end -= pull[1].count;
-					
-					/* we found a second buffer in an 'B' subarray containing √A unique values, so we're done! */
-					buffer2 = range_new(B.end - count, B.end);
-					break;
-				}
-			}
-			else if(pull_index == 0 && count > range_length(buffer1)) {
-				/* keep track of the largest buffer we were able to find */
-				buffer1 = range_new(B.end - count, B.end);
-				PULL(B.end);
-			}
 		}
+	}
+	
+	/* find two internal buffers of size 'buffer_size' each */
+	find = buffer_size + buffer_size;
+	find_separately = false;
+	
+	if(block_size <= sort->cache_size) {
+		/* if every A block fits into the cache then we won't need the second internal buffer, */
+		/* so we really only need to find 'buffer_size' unique values */
+		find = buffer_size;
+	}
+	else if(find > level->length) {
+		/* we can't fit both buffers into the same A or B subarray, so find two buffers separately */
+		find = buffer_size;
+		find_separately = true;
+	}
+	
+	/* we need to find either a single contiguous space containing 2√A unique values (which will be split up into two buffers of size √A each), */
+	/* or we need to find one buffer of < 2√A unique values, and a second buffer of √A unique values, */
+	/* OR if we couldn't find that many unique values, we need the largest possible buffer we can get */
+	
+	/* in the case where it couldn't find a single buffer of at least √A unique values, */
+	/* all of the Merge steps must be replaced by a different merge algorithm (MergeInPlace) */
+	for(level_begin(level); !found && level_next(level, &A, &B);) {
+		
+		/* check A for the number of unique values we need to fill an internal buffer */
+		/* these values will be pulled out to the start of A */
+		for(last = A.start, count = 1; count < find; last = index, count++) {
+			index = FindLastForward(sort, ARRAY(last), range_new(last + 1, A.end), find - count);
+			if(index == A.end)
+				break;
+		}
+		index = last;
+
 		
-		/* pull out the two ranges so we can use them as internal buffers */
-		for(pull_index = 0; pull_index < 2; pull_index++) {
-			range_t range;
-			size_t length = pull[pull_index].count;
+		if(count >= buffer_size) {
+			/* keep track of the range within the array where we'll need to "pull out" these values to create the internal buffer */
+			PULL(A.start);
+			pull_index = 1;
 			
-			if(pull[pull_index].to < pull[pull_index].from) {
-				/* we're pulling the values out to the left, which means the start of an A subarray */
-				index = pull[pull_index].from;
-				for(count = 1; count < length; count++) {
-					index = FindFirstBackward(sort, ARRAY(index - 1), range_new(pull[pull_index].to, pull[pull_index].from - (count - 1)), length - count);
-					range = range_new(index + 1, pull[pull_index].from + 1);
-					rotate(sort, range_length(range) - count, range);
-					pull[pull_index].from = index + count;
-				}
-			} else if(pull[pull_index].to > pull[pull_index].from) {
-				/* we're pulling values out to the right, which means the end of a B subarray */
-				index = pull[pull_index].from + 1;
-				for(count = 1; count < length; count++) {
-					index = FindLastForward(sort, ARRAY(index), range_new(index, pull[pull_index].to), length - count);
-					range = range_new(pull[pull_index].from, index - 1);
-					rotate(sort, count, range);
-					pull[pull_index].from = index - 1 - count;
-				}
+			if(count == buffer_size + buffer_size) {
+				/* we were able to find a single contiguous section containing 2√A unique values, */
+				/* so this section can be used to contain both of the internal buffers we'll need */
+				buffer1 = range_new(A.start, A.start + buffer_size);
+				buffer2 = range_new(A.start + buffer_size, A.start + count);
+				break;
+			}
+			else if(find == buffer_size + buffer_size) {
+				/* we found a buffer that contains at least √A unique values, but did not contain the full 2√A unique values, */
+				/* so we still need to find a second separate buffer of at least √A unique values */
+				buffer1 = range_new(A.start, A.start + count);
+				find = buffer_size;
+			}
+			else if(block_size <= sort->cache_size) {
+				/* we found the first and only internal buffer that we need, so we're done! */
+				buffer1 = range_new(A.start, A.start + count);
+				break;
+			}
+			else if(find_separately) {
+				/* found one buffer, but now find the other one */
+				buffer1 = range_new(A.start, A.start + count);
+				find_separately = false;
+			}
+			else {
+				/* we found a second buffer in an 'A' subarray containing √A unique values, so we're done! */
+				buffer2 = range_new(A.start, A.start + count);
+				break;
 			}
 		}
+		else if(pull_index == 0 && count > range_length(buffer1)) {
+			/* keep track of the largest buffer we were able to find */
+			buffer1 = range_new(A.start, A.start + count);
+			PULL(A.start);
+		}
 		
-		/* adjust block_size and buffer_size based on the values we were able to pull out */
-		buffer_size = range_length(buffer1);
-		block_size = iter_length(&iter) / buffer_size + 1;
-		
-		/* the first buffer NEEDS to be large enough to tag each of the evenly sized A blocks, */
-		/* so this was originally here to test the math for adjusting block_size above */
-		/* assert((iter_length(&iterator) + 1)/block_size <= buffer_size); */
+		/* check B for the number of unique values we need to fill an internal buffer */
+		/* these values will be pulled out to the end of B */
+		for(last = B.end - 1, count = 1; count < find; last = index - 1, count++) {
+			index = FindFirstBackward(sort, ARRAY(last), range_new(B.start, last), find - count);
+			if(index == B.start) break;
+		}
+		index = last;
 		
-		/* now that the two internal buffers have been created, it's time to merge each A+B combination at this level of the merge sort! */
-		for(iter_begin(&iter); !iter_finished(&iter);) {
-			A = iter_nextRange(&iter);
-			B = iter_nextRange(&iter);
+		if(count >= buffer_size) {
+			/* keep track of the range within the array where we'll need to "pull out" these values to create the internal buffer */
+			PULL(B.end);
+			pull_index = 1;
 			
-			/* remove any parts of A or B that are being used by the internal buffers */
-			start = A.start;
-			if(start == pull[0].range.start) {
-				if(pull[0].from > pull[0].to) {
-					A.start += pull[0].count;
-					
-					/* if the internal buffer takes up the entire A or B subarray, then there's nothing to merge */
-					/* this only happens for very small subarrays, like √4 = 2, 2 * (2 internal buffers) = 4, */
-					/* which also only happens when cache_size is small or 0 since it'd otherwise use MergeExternal */
-					if(range_length(A) == 0) continue;
-				} else if(pull[0].from < pull[0].to) {
-					B.end -= pull[0].count;
-					if(range_length(B) == 0) continue;
-				}
+			if(count == buffer_size + buffer_size) {
+				/* we were able to find a single contiguous section containing 2√A unique values, */
+				/* so this section can be used to contain both of the internal buffers we'll need */
+				buffer1 = range_new(B.end - count, B.end - buffer_size);
+				buffer2 = range_new(B.end - buffer_size, B.end);
+				break;
 			}
-			if(start == pull[1].range.start) {
-				if(pull[1].from > pull[1].to) {
-					A.start += pull[1].count;
-					if(range_length(A) == 0) continue;
-				} else if(pull[1].from < pull[1].to) {
-					B.end -= pull[1].count;
-					if(range_length(B) == 0) continue;
-				}
+			else if(find == buffer_size + buffer_size) {
+				/* we found a buffer that contains at least √A unique values, but did not contain the full 2√A unique values, */
+				/* so we still need to find a second separate buffer of at least √A unique values */
+				buffer1 = range_new(B.end - count, B.end);
+				find = buffer_size;
 			}
-			
-			if(CMP(B.end - 1, A.start) < 0) {
-				/* the two ranges are in reverse order, so a simple rotation should fix it */
-				rotate(sort, range_length(A), range_new(A.start, B.end));
+			else if(block_size <= sort->cache_size) {
+				/* we found the first and only internal buffer that we need, so we're done! */
+				buffer1 = range_new(B.end - count, B.end);
+				break;
 			}
-			else if(CMP(A.end, A.end - 1) < 0) {
-				/* these two ranges weren't already in order, so we'll need to merge them! */
-				range_t blockA, firstA, lastA, lastB, blockB;
-				size_t indexA, findA;
-				
-				/* break the remainder of A into blocks. firstA is the uneven-sized first A block */
-				blockA = range_new(A.start, A.end);
-				firstA = range_new(A.start, A.start + range_length(blockA) % block_size);
-				
-				/* swap the first value of each A block with the value in buffer1 */
-				for(indexA = buffer1.start, index = firstA.end; index < blockA.end; indexA++, index += block_size) 
-					swap_aa(sort, ARRAY(indexA), ARRAY(index));
-				
-				/* start rolling the A blocks through the B blocks! */
-				/* whenever we leave an A block behind, we'll need to merge the previous A block with any B blocks that follow it, so track that information as well */
-				lastA = firstA;
-				lastB = range_new(0, 0);
-				blockB = range_new(B.start, B.start + min(block_size, range_length(B)));
-				blockA.start += range_length(firstA);
-				indexA = buffer1.start;
+			else if(find_separately) {
+				/* found one buffer, but now find the other one */
+				buffer1 = range_new(B.end - count, B.end);
+				find_separately = false;
+			}
+			else {
+				/* buffer2 will be pulled out from a 'B' subarray, so if the first buffer was pulled out from the corresponding 'A' subarray, */
+				/* we need to adjust the end point for that A subarray so it knows to stop redistributing its values before reaching buffer2 */
+				if(pull[0].range.start == A.start) pull[0].range.end -= pull[1].count;
 				
-				/* if the first unevenly sized A block fits into the cache, copy it there for when we go to Merge it */
-				/* otherwise, if the second buffer is available, block swap the contents into that */
-				if(range_length(buffer2) > 0)
-					blockswap_aa(sort, ARRAY(lastA.start), ARRAY(buffer2.start), range_length(lastA));
+				/* we found a second buffer in an 'B' subarray containing √A unique values, so we're done! */
+				buffer2 = range_new(B.end - count, B.end);
+				break;
+			}
+		}
+		else if(pull_index == 0 && count > range_length(buffer1)) {
+			/* keep track of the largest buffer we were able to find */
+			buffer1 = range_new(B.end - count, B.end);
+			PULL(B.end);
+		}
+	}
+	
+	/* pull out the two ranges so we can use them as internal buffers, unless they were kept from the previous level */
+	if(!kept)
+		pull_buffers(sort, pull);
+	
+	if(found) {
+		/* the kept buffers are larger than this level needs, so only use the start of each */
+		if(!kept) {
+			keep->buffer1 = range_new(pull[0].to, pull[0].to + keep_buffer);
+			keep->buffer2 = range_new(pull[0].to + keep_buffer, pull[0].to + pull[0].count);
+			keep->valid = true;
+		}
+		keep->pull[0] = pull[0];
+		keep->pull[1] = pull[1];
+		buffer1 = range_new(keep->buffer1.start, keep->buffer1.start + min(buffer_size, range_length(keep->buffer1)));
+		if(block_size > sort->cache_size)
+			buffer2 = range_new(keep->buffer2.start, keep->buffer2.start + min(buffer_size, range_length(keep->buffer2)));
+	}
+	
+	/* adjust block_size and buffer_size based on the values we were able to pull out */
+	buffer_size = range_length(buffer1);
+	block_size = level->length / buffer_size + 1;
+	
+	/* the first buffer NEEDS to be large enough to tag each of the evenly sized A blocks, */
+	/* so this was originally here to test the math for adjusting block_size above */
+	/* assert((level->length + 1)/block_size <= buffer_size); */
+	
+	if(level_stats) {
+		level_stats->block_size = block_size;
+		level_stats->buffer1 = range_length(buffer1);
+		level_stats->buffer2 = range_length(buffer2);
+		now = stats_clock(sort);
+		level_stats->pull_time += now - time;
+		time = now;
+	}
+	
+	/* now that the two internal buffers have been created, it's time to merge each A+B combination at this level of the merge sort! */
+	for(level_begin(level); level_next(level, &A, &B);) {
+		
+		/* remove any parts of A or B that are being used by the internal buffers */
+		start = A.start;
+		if(start == pull[0].range.start) {
+			if(pull[0].from > pull[0].to) {
+				A.start += pull[0].count;
 				
-				if(range_length(blockA) > 0) {
-					for(;;) {
-						/* if there's a previous B block and the first value of the minimum A block is <= the last value of the previous B block, */
-						/* then drop that minimum A block behind. or if there are no B blocks left then keep dropping the remaining A blocks. */
-						if((range_length(lastB) > 0 && CMP(lastB.end - 1, indexA) >= 0) || range_length(blockB) == 0) {
-							/* figure out where to split the previous B block, and rotate it at the split */
-							size_t B_split = BinaryFirst(sort, ARRAY(indexA), lastB);
-							size_t B_remaining = lastB.end - B_split;
-							
-							/* swap the minimum A block to the beginning of the rolling A blocks */
-							size_t minA = blockA.start;
-							for(findA = minA + block_size; findA < blockA.end; findA += block_size)
-								if(CMP(findA, minA) < 0)
-									minA = findA;
-							blockswap_aa(sort, ARRAY(blockA.start), ARRAY(minA), block_size);
-							
-							/* swap the first item of the previous A block back with its original value, which is stored in buffer1 */
-							swap_aa(sort, ARRAY(blockA.start), ARRAY(indexA));
-							indexA++;
-							
-							/*
-							 locally merge the previous A block with the B values that follow it
-							 if lastA fits into the external cache we'll use that (with MergeExternal),
-							 or if the second internal buffer exists we'll use that (with MergeInternal),
-							 or failing that we'll use a strictly in-place merge algorithm (MergeInPlace)
-							 */
-							if(range_length(buffer2) > 0)
-								MergeInternal(sort, lastA, range_new(lastA.end, B_split), buffer2);
+				/* if the internal buffer takes up the entire A or B subarray, then there's nothing to merge */
+				/* this only happens for very small subarrays, like √4 = 2, 2 * (2 internal buffers) = 4, */
+				/* which also only happens when cache_size is small or 0 since it'd otherwise use MergeExternal */
+				if(range_length(A) == 0) continue;
+			} else if(pull[0].from < pull[0].to) {
+				B.end -= pull[0].count;
+				if(range_length(B) == 0) continue;
+			}
+		}
+		if(start == pull[1].range.start) {
+			if(pull[1].from > pull[1].to) {
+				A.start += pull[1].count;
+				if(range_length(A) == 0) continue;
+			} else if(pull[1].from < pull[1].to) {
+				B.end -= pull[1].count;
+				if(range_length(B) == 0) continue;
+			}
+		}
+		
+		if(CMP(B.end - 1, A.start) < 0) {
+			/* the two ranges are in reverse order, so a simple rotation should fix it */
+			rotate(sort, range_length(A), range_new(A.start, B.end), sort->cache_size);
+			STATS_PAIR(rotated);
+		}
+		else if(CMP(A.end, A.end - 1) < 0) {
+			/* these two ranges weren't already in order, so we'll need to merge them! */
+			range_t blockA, firstA, lastA, lastB, blockB;
+			size_t indexA, findA;
+			
+			/* break the remainder of A into blocks. firstA is the uneven-sized first A block */
+			blockA = range_new(A.start, A.end);
+			firstA = range_new(A.start, A.start + range_length(blockA) % block_size);
+			
+			/* swap the first value of each A block with the value in buffer1 */
+			for(indexA = buffer1.start, index = firstA.end; index < blockA.end; indexA++, index += block_size) 
+				swap_aa(sort, ARRAY(indexA), ARRAY(index));
+			
+			/* start rolling the A blocks through the B blocks! */
+			/* whenever we leave an A block behind, we'll need to merge the previous A block with any B blocks that follow it, so track that information as well */
+			lastA = firstA;
+			lastB = range_new(0, 0);
+			blockB = range_new(B.start, B.start + min(block_size, range_length(B)));
+			blockA.start += range_length(firstA);
+			indexA = buffer1.start;
+			
+			/* if the first unevenly sized A block fits into the cache, copy it there for when we go to Merge it */
+			/* otherwise, if the second buffer is available, block swap the contents into that */
+			if(range_length(lastA) <= sort->cache_size)
+				cache_store(sort, lastA);
+			else if(range_length(buffer2) > 0)
+				blockswap_aa(sort, ARRAY(lastA.start), ARRAY(buffer2.start), range_length(lastA));
+			
+			if(range_length(blockA) > 0) {
+				for(;;) {
+					/* if there's a previous B block and the first value of the minimum A block is <= the last value of the previous B block, */
+					/* then drop that minimum A block behind. or if there are no B blocks left then keep dropping the remaining A blocks. */
+					if((range_length(lastB) > 0 && CMP(lastB.end - 1, indexA) >= 0) || range_length(blockB) == 0) {
+						/* figure out where to split the previous B block, and rotate it at the split */
+						size_t B_split = BinaryFirst(sort, ARRAY(indexA), lastB);
+						size_t B_remaining = lastB.end - B_split;
+						
+						/* swap the minimum A block to the beginning of the rolling A blocks */
+						size_t minA = blockA.start;
+						for(findA = minA + block_size; findA < blockA.end; findA += block_size)
+							if(CMP(findA, minA) < 0)
+								minA = findA;
+						blockswap_aa(sort, ARRAY(blockA.start), ARRAY(minA), block_size);
+						
+						/* swap the first item of the previous A block back with its original value, which is stored in buffer1 */
+						swap_aa(sort, ARRAY(blockA.start), ARRAY(indexA));
+						indexA++;
+						
+						/*
+						 locally merge the previous A block with the B values that follow it
+						 if lastA fits into the external cache we'll use that (with MergeExternal),
+						 or if the second internal buffer exists we'll use that (with MergeInternal),
+						 or failing that we'll use a strictly in-place merge algorithm (MergeInPlace)
+						 */
+						if(range_length(lastA) <= sort->cache_size)
+							MergeExternal(sort, lastA, range_new(lastA.end, B_split));
+						else if(range_length(buffer2) > 0)
+							MergeInternal(sort, lastA, range_new(lastA.end, B_split), buffer2);
+						else
+							MergeInPlace(sort, lastA, range_new(lastA.end, B_split));
+						
+						if(range_length(buffer2) > 0 || block_size <= sort->cache_size) {
+							/* copy the previous A block into the cache or buffer2, since that's where we need it to be when we go to merge it anyway */
+							if(block_size <= sort->cache_size)
+								cache_store(sort, range_new(blockA.start, blockA.start + block_size));
 							else
-								MergeInPlace(sort, lastA, range_new(lastA.end, B_split));
-							
-							if(range_length(buffer2) > 0) {
-								/* copy the previous A block into the cache or buffer2, since that's where we need it to be when we go to merge it anyway */
 								blockswap_aa(sort, ARRAY(blockA.start), ARRAY(buffer2.start), block_size);
-								
-								/* this is equivalent to rotating, but faster */
-								/* the area normally taken up by the A block is either the contents of buffer2, or data we don't need anymore since we memcopied it */
-								/* either way, we don't need to retain the order of those items, so instead of rotating we can just block swap B to where it belongs */
-								blockswap_aa(sort, ARRAY(B_split), ARRAY(blockA.start + block_size - B_remaining), B_remaining);
-							} else {
-								/* we are unable to use the 'buffer2' trick to speed up the rotation operation since buffer2 doesn't exist, so perform a normal rotation */
-								rotate(sort, blockA.start - B_split, range_new(B_split, blockA.start + block_size));
-							}
-							
-							/* update the range for the remaining A blocks, and the range remaining from the B block after it was split */
-							lastA = range_new(blockA.start - B_remaining, blockA.start - B_remaining + block_size);
-							lastB = range_new(lastA.end, lastA.end + B_remaining);
-							
-							/* if there are no more A blocks remaining, this step is finished! */
-							blockA.start += block_size;
-							if(range_length(blockA) == 0)
-								break;
-							
-						} else if(range_length(blockB) < block_size) {
-							/* move the last B block, which is unevenly sized, to before the remaining A blocks, by using a rotation */
-							/* the cache is disabled here since it might contain the contents of the previous A block */
-							rotate(sort, blockB.start - blockA.start, range_new(blockA.start, blockB.end));
 							
-							lastB = range_new(blockA.start, blockA.start + range_length(blockB));
-							blockA.start += range_length(blockB);
-							blockA.end += range_length(blockB);
-							blockB.end = blockB.start;
+							/* this is equivalent to rotating, but faster */
+							/* the area normally taken up by the A block is either the contents of buffer2, or data we don't need anymore since we memcopied it */
+							/* either way, we don't need to retain the order of those items, so instead of rotating we can just block swap B to where it belongs */
+							blockswap_aa(sort, ARRAY(B_split), ARRAY(blockA.start + block_size - B_remaining), B_remaining);
 						} else {
-							/* roll the leftmost A block to the end by swapping it with the next B block */
-							blockswap_aa(sort, ARRAY(blockA.start), ARRAY(blockB.start), block_size);
-							lastB = range_new(blockA.start, blockA.start + block_size);
-							
-							blockA.start += block_size;
-							blockA.end += block_size;
-							blockB.start += block_size;
-							
-							if(blockB.end > B.end - block_size) blockB.end = B.end;
-							else blockB.end += block_size;
+							/* we are unable to use the 'buffer2' trick to speed up the rotation operation since buffer2 doesn't exist, so perform a normal rotation */
+							rotate(sort, blockA.start - B_split, range_new(B_split, blockA.start + block_size), sort->cache_size);
 						}
+						
+						/* update the range for the remaining A blocks, and the range remaining from the B block after it was split */
+						lastA = range_new(blockA.start - B_remaining, blockA.start - B_remaining + block_size);
+						lastB = range_new(lastA.end, lastA.end + B_remaining);
+						
+						/* if there are no more A blocks remaining, this step is finished! */
+						blockA.start += block_size;
+						if(range_length(blockA) == 0)
+							break;
+						
+					} else if(range_length(blockB) < block_size) {
+						/* move the last B block, which is unevenly sized, to before the remaining A blocks, by using a rotation */
+						/* the cache is disabled here since it might contain the contents of the previous A block */
+						rotate(sort, blockB.start - blockA.start, range_new(blockA.start, blockB.end), 0);
+						
+						lastB = range_new(blockA.start, blockA.start + range_length(blockB));
+						blockA.start += range_length(blockB);
+						blockA.end += range_length(blockB);
+						blockB.end = blockB.start;
+					} else {
+						/* roll the leftmost A block to the end by swapping it with the next B block */
+						blockswap_aa(sort, ARRAY(blockA.start), ARRAY(blockB.start), block_size);
+						lastB = range_new(blockA.start, blockA.start + block_size);
+						
+						blockA.start += block_size;
+						blockA.end += block_size;
+						blockB.start += block_size;
+						
+						if(blockB.end > B.end - block_size) blockB.end = B.end;
+						else blockB.end += block_size;
 					}
 				}
-				
-				/* merge the last A block with the remaining B values */
-				if(range_length(buffer2) > 0)
-					MergeInternal(sort, lastA, range_new(lastA.end, B.end), buffer2);
-				else
-					MergeInPlace(sort, lastA, range_new(lastA.end, B.end));
 			}
+			
+			/* merge the last A block with the remaining B values */
+			if(range_length(lastA) <= sort->cache_size)
+				MergeExternal(sort, lastA, range_new(lastA.end, B.end));
+			else if(range_length(buffer2) > 0)
+				MergeInternal(sort, lastA, range_new(lastA.end, B.end), buffer2);
+			else
+				MergeInPlace(sort, lastA, range_new(lastA.end, B.end));
+			
+			if(block_size <= sort->cache_size)
+				STATS_PAIR(merged_external);
+			else if(range_length(buffer2) > 0)
+				STATS_PAIR(merged_internal);
+			else
+				STATS_PAIR(merged_inplace);
+		}
+		else
+			STATS_PAIR(skipped);
+	}
+	
+	if(level_stats) {
+		now = stats_clock(sort);
+		level_stats->merge_time += now - time;
+		time = now;
+	}
+	
+	/* the kept buffers are redistributed by runsort() after the last level */
+	if(keep && keep->valid)
+		return;
+	
+	redistribute_buffers(sort, pull, buffer2);
+	
+	if(level_stats)
+		level_stats->redistribute_time += stats_clock(sort) - time;
+}
+
+/* merge the two adjacent sorted ranges A and B */
+static void merge_pair(
+		const sort_t *sort,
+		range_t A,
+		range_t B)
+{
+	struct wikisort_stats_level *level_stats;
+	level_t level;
+	if(range_length(A) == 0 || range_length(B) == 0)
+		return;
+	
+	/* check for the cheap cases first, so we don't bother pulling out internal buffers for them */
+	level_stats = stats_level(sort, range_length(A));
+	if(CMP(B.start, A.end - 1) >= 0) {
+		STATS_PAIR(skipped);
+		return;
+	}
+	if(CMP(B.end - 1, A.start) < 0) {
+		rotate(sort, range_length(A), range_new(A.start, B.end), sort->cache_size);
+		STATS_PAIR(rotated);
+		return;
+	}
+	level = level_pair(A, B);
+	merge_level(sort, &level);
+}
+
+/* find the end of the natural run starting at 'start'. strictly descending runs are reversed, which keeps them stable */
+static size_t natural_run(
+		const sort_t *sort,
+		size_t start)
+{
+	size_t end = start + 1;
+	if(end >= sort->size)
+		return sort->size;
+	
+	if(CMP(end, start) < 0) {
+		while(end + 1 < sort->size && CMP(end + 1, end) < 0)
+			end++;
+		end++;
+		reverse(sort, range_new(start, end));
+	}
+	else {
+		while(end + 1 < sort->size && CMP(end + 1, end) >= 0)
+			end++;
+		end++;
+	}
+	return end;
+}
+
+/* power of the node between two neighboring runs, for the merge policy of powersort */
+/* (Munro and Wild, "Nearly-Optimal Mergesorts", 2018) */
+static unsigned node_power(
+		size_t size,
+		size_t start1,
+		size_t length1,
+		size_t length2)
+{
+	/* a and b are twice the midpoints of the two runs */
+	size_t a = start1 + start1 + length1;
+	size_t b = a + length1 + length2;
+	unsigned power = 0;
+	for(;;) {
+		power++;
+		if(a >= size) {
+			a -= size;
+			b -= size;
+		}
+		else if(b >= size)
+			break;
+		a <<= 1;
+		b <<= 1;
+	}
+	return power;
+}
+
+/* sort by merging the natural runs of the array, which needs only about n comparisons if the array is already sorted, */
+/* reversed or made of a few long runs. runs shorter than RUN_MIN are extended with an insertion sort. */
+/* gives up and returns false once too much of the array turns out to be in short runs, which leaves the array */
+/* partially sorted. the stack of pending runs is bounded by the number of bits in size_t */
+static bool natural_sort(
+		const sort_t *sort)
+{
+	struct {
+		size_t start;
+		unsigned power;
+	} stack[sizeof(size_t) * CHAR_BIT + 1];
+	size_t top = 0, shortsz = 0;
+	size_t start1 = 0, end1, start2, end2;
+	
+	end1 = natural_run(sort, 0);
+	while(end1 < sort->size) {
+		unsigned power;
+		start2 = end1;
+		end2 = natural_run(sort, start2);
+		if(end2 - start2 < RUN_MIN) {
+			shortsz += RUN_MIN;
+			if(shortsz > RUN_MIN * 8 && shortsz * 2 > end2)
+				return false;
+			end2 = min(start2 + RUN_MIN, sort->size);
+			InsertionSort(sort, range_new(start2, end2));
 		}
 		
-		/* when we're finished with this merge step we should have the one or two internal buffers left over, where the second buffer is all jumbled up */
-		/* insertion sort the second buffer, then redistribute the buffers back into the array using the opposite process used for creating the buffer */
-		
-		/* while an unstable sort like quicksort could be applied here, in benchmarks it was consistently slightly slower than a simple insertion sort, */
-		/* even for tens of millions of items. this may be because insertion sort is quite fast when the data is already somewhat sorted, like it is here */
-		InsertionSort(sort, buffer2);
-		
-		for(pull_index = 0; pull_index < 2; pull_index++) {
-			size_t amount, unique = pull[pull_index].count * 2;
-			if(pull[pull_index].from > pull[pull_index].to) {
-				/* the values were pulled out to the left, so redistribute them back to the right */
-				range_t buffer = range_new(pull[pull_index].range.start, pull[pull_index].range.start + pull[pull_index].count);
-				while(range_length(buffer) > 0) {
-					index = FindFirstForward(sort, ARRAY(buffer.start), range_new(buffer.end, pull[pull_index].range.end), unique);
-					amount = index - buffer.end;
-					rotate(sort, range_length(buffer), range_new(buffer.start, index));
-					buffer.start += (amount + 1);
-					buffer.end += amount;
-					unique -= 2;
+		/* merge the runs on the stack which are below the new node in the merge tree */
+		power = node_power(sort->size, start1, end1 - start1, end2 - start2);
+		while(top > 0 && stack[top - 1].power > power) {
+			top--;
+			merge_pair(sort, range_new(stack[top].start, start1), range_new(start1, end1));
+			start1 = stack[top].start;
+		}
+		stack[top].start = start1;
+		stack[top].power = power;
+		top++;
+		start1 = start2;
+		end1 = end2;
+	}
+	
+	while(top > 0) {
+		top--;
+		merge_pair(sort, range_new(stack[top].start, start1), range_new(start1, end1));
+		start1 = stack[top].start;
+	}
+	return true;
+}
+
+#ifdef SIMD
+/* Batcher's odd-even merge sort of 32 inputs as pairs of inputs to compare and swap. */
+/* the first NETWORK16 comparators sort the first 16 inputs on their own */
+#define NETWORK16 63
+#define NETWORK32 191
+static const uint8_t network32[2 * NETWORK32] = {
+	0, 1, 2, 3, 0, 2, 1, 3, 1, 2, 4, 5, 6, 7, 4, 6, 5, 7, 5, 6, 0, 4, 2, 6, 2, 4, 1, 5, 3, 7, 3, 5,
+	1, 2, 3, 4, 5, 6, 8, 9, 10, 11, 8, 10, 9, 11, 9, 10, 12, 13, 14, 15, 12, 14, 13, 15, 13, 14, 8, 12, 10, 14, 10, 12,
+	9, 13, 11, 15, 11, 13, 9, 10, 11, 12, 13, 14, 0, 8, 4, 12, 4, 8, 2, 10, 6, 14, 6, 10, 2, 4, 6, 8, 10, 12, 1, 9,
+	5, 13, 5, 9, 3, 11, 7, 15, 7, 11, 3, 5, 7, 9, 11, 13, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+	18, 19, 16, 18, 17, 19, 17, 18, 20, 21, 22, 23, 20, 22, 21, 23, 21, 22, 16, 20, 18, 22, 18, 20, 17, 21, 19, 23, 19, 21, 17, 18,
+	19, 20, 21, 22, 24, 25, 26, 27, 24, 26, 25, 27, 25, 26, 28, 29, 30, 31, 28, 30, 29, 31, 29, 30, 24, 28, 26, 30, 26, 28, 25, 29,
+	27, 31, 27, 29, 25, 26, 27, 28, 29, 30, 16, 24, 20, 28, 20, 24, 18, 26, 22, 30, 22, 26, 18, 20, 22, 24, 26, 28, 17, 25, 21, 29,
+	21, 25, 19, 27, 23, 31, 23, 27, 19, 21, 23, 25, 27, 29, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 0, 16, 8, 24,
+	8, 16, 4, 20, 12, 28, 12, 20, 4, 8, 12, 16, 20, 24, 2, 18, 10, 26, 10, 18, 6, 22, 14, 30, 14, 22, 6, 10, 14, 18, 22, 26,
+	2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 1, 17, 9, 25, 9, 17, 5, 21, 13, 29, 13, 21, 5, 9, 13, 17, 21, 25,
+	3, 19, 11, 27, 11, 19, 7, 23, 15, 31, 15, 23, 7, 11, 15, 19, 23, 27, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29,
+	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30
+};
+
+/* the vectors hold input i of as many groups as they have lanes */
+typedef int64_t vec2_t __attribute__((vector_size(16)));
+typedef int64_t vec4_t __attribute__((vector_size(32)));
+
+/* run the first 'count' comparators of the network over 'key'. the keys are signed, so they can be compared with the */
+/* SSE4.2 and AVX2 instructions. if 'idx' is NULL the original positions are packed into the low bits of the keys, */
+/* otherwise equal keys are ordered by 'idx' */
+#define NETWORK(NAME, VEC, TARGET) \
+	__attribute__((target(TARGET))) \
+	static void network_##NAME( \
+			void *key_, \
+			void *idx_, \
+			size_t count) \
+	{ \
+		VEC *key = key_, *idx = idx_; \
+		for(size_t n = 0; n < 2 * count; n += 2) { \
+			size_t x = network32[n], y = network32[n + 1]; \
+			VEC a = key[x], b = key[y], swap = a > b; \
+			if(idx) { \
+				VEC ia = idx[x], ib = idx[y]; \
+				swap |= (a == b) & (ia > ib); \
+				idx[x] = (ia & ~swap) | (ib & swap); \
+				idx[y] = (ib & ~swap) | (ia & swap); \
+			} \
+			key[x] = (a & ~swap) | (b & swap); \
+			key[y] = (b & ~swap) | (a & swap); \
+		} \
+	}
+
+NETWORK(sse, vec2_t, "sse4.2")
+NETWORK(avx2, vec4_t, "avx2")
+#undef NETWORK
+
+/* move the items of the group at 'start' into the order of 'perm', where perm[i] is the position of the item which */
+/* belongs at i. follows the cycles of the permutation, so each item is moved only once */
+static void permute(
+		const sort_t *sort,
+		size_t start,
+		const size_t *perm,
+		size_t length)
+{
+	char *tmp = alloca(sort->itemsz);
+	uint32_t done = 0;
+	for(size_t i = 0; i < length; i++) {
+		size_t index = i, tmpidx;
+		if(perm[i] == i || (done >> i & 1))
+			continue;
+		tmpidx = copy_pa(sort, tmp, ARRAY(start + i));
+		while(perm[index] != i) {
+			copy_aa(sort, ARRAY(start + index), ARRAY(start + perm[index]));
+			done |= (uint32_t)1 << index;
+			index = perm[index];
+		}
+		copy_ap(sort, ARRAY(start + index), tmp, tmpidx);
+		done |= (uint32_t)1 << index;
+		STATS_ADD(moves, 2);
+	}
+}
+
+/* sort groups of 16-32 items with a typed key by running the network over several groups at once. the keys are */
+/* turned into integers of the same order first, and equal keys keep their order because 32-bit keys get the position */
+/* within the group packed into their low bits, while 64-bit keys carry it in a second vector. */
+/* returns false and leaves 'iter' alone if the key isn't typed or the processor has neither SSE4.2 nor AVX2 */
+static bool presort_simd(
+		const sort_t *sort,
+		iter_t *iter)
+{
+	int64_t key[32 * 4] __attribute__((aligned(32)));
+	int64_t idx[32 * 4] __attribute__((aligned(32)));
+	void (*network)(void *key, void *idx, size_t count);
+	size_t lanes, perm[32];
+	size_t keyoff = sort->stats ? sort->stats->counted.keyoff : sort->keyoff;
+	bool wide = sort->keytype >= WIKISORT_U64;
+	bool bare = !sort->map && sort->itemsz == sort->keysz;
+	range_t group[4];
+
+	if(!sort->keytype || sort->size < 32)
+		return false;
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		network = network_avx2;
+		lanes = 4;
+	}
+	else if(__builtin_cpu_supports("sse4.2")) {
+		network = network_sse;
+		lanes = 2;
+	}
+	else
+		return false;
+
+	*iter = iter_new(sort->size, 16);
+	for(iter_begin(iter); !iter_finished(iter);) {
+		size_t count, inputs = 16;
+		for(count = 0; count < lanes && !iter_finished(iter); count++) {
+			group[count] = iter_nextRange(iter);
+			if(range_length(group[count]) > 16)
+				inputs = 32;
+		}
+
+		/* the unused inputs are padded with the largest key, and are sorted behind the items since their positions are larger */
+		for(size_t g = 0; g < lanes; g++)
+			for(size_t i = 0; i < inputs; i++) {
+				int64_t k = INT64_MAX;
+				if(g < count && i < range_length(group[g])) {
+					uint64_t bits = key_bits(sort->keytype, ARRAY(group[g].start + i) + keyoff);
+					if(!wide)
+						bits = bits << 32 | i;
+					k = (int64_t)(bits ^ UINT64_C(0x8000000000000000));
 				}
+				key[i * lanes + g] = k;
+				idx[i * lanes + g] = i;
 			}
-			else if(pull[pull_index].from < pull[pull_index].to) {
-				/* the values were pulled out to the right, so redistribute them back to the left */
-				range_t buffer = range_new(pull[pull_index].range.end - pull[pull_index].count, pull[pull_index].range.end);
-				while(range_length(buffer) > 0) {
-					index = FindLastBackward(sort, ARRAY(buffer.end - 1), range_new(pull[pull_index].range.start, buffer.start), unique);
-					amount = buffer.start - index;
-					rotate(sort, amount, range_new(index, buffer.end));
-					buffer.start -= amount;
-					buffer.end -= (amount + 1);
-					unique -= 2;
+
+		network(key, wide ? idx : NULL, inputs == 16 ? NETWORK16 : NETWORK32);
+
+		for(size_t g = 0; g < count; g++) {
+			if(bare) {
+				/* the items are just their keys, so they can be written back from the sorted keys */
+				for(size_t i = 0; i < range_length(group[g]); i++) {
+					uint64_t bits = (uint64_t)key[i * lanes + g] ^ UINT64_C(0x8000000000000000);
+					key_unbits(sort->keytype, ARRAY(group[g].start + i), wide ? bits : bits >> 32);
 				}
+				STATS_ADD(moves, range_length(group[g]));
+				continue;
 			}
+			for(size_t i = 0; i < range_length(group[g]); i++)
+				perm[i] = wide ? (size_t)idx[i * lanes + g] : (size_t)(key[i * lanes + g] & 0xffffffff);
+			permute(sort, group[g].start, perm, range_length(group[g]));
 		}
-		
-		/* double the size of each A and B subarray that will be merged in the next level */
-		if(!iter_nextLevel(&iter))
-			break;
 	}
+	return true;
 }
-
-void wikisort_trace(
-		void *base,
-		size_t size,
-		size_t itemsz,
-		int (*cmp)(const void *a, const void *b),
-		size_t *map) /* size: 'size' */
+#else
+static bool presort_simd(
+		const sort_t *sort,
+		iter_t *iter)
 {
-	sort_t sort;
-	sort.array = base;
-	sort.itemsz = itemsz;
-	sort.size = size;
-	sort.cmp = cmp;
-	sort.map = map;
-	for(size_t i = 0; i < size; i++)
-		map[i] = i;
-	runsort(&sort);
+	(void)sort;
+	(void)iter;
+	return false;
 }
+#endif
 
-void wikisort(
-		void *base,
-		size_t size,
-		size_t itemsz,
-		int (*cmp)(const void *a, const void *b))
+/* sort groups of 4-8 items at a time using an unstable sorting network, */
+/* but keep track of the original item orders to force it to be stable */
+/* http://pages.ripco.net/~jgamble/nw.html */
+static void presort_networks(
+		const sort_t *sort,
+		iter_t *iter)
 {
-	sort_t sort;
-	sort.array = base;
-	sort.itemsz = itemsz;
-	sort.size = size;
-	sort.cmp = cmp;
-	sort.map = NULL;
-	runsort(&sort);
+#define SWAPIF(X, Y) \
+		do { \
+			int cmp = CMP(range.start + X, range.start + Y); \
+			if(cmp > 0 || (order[X] > order[Y] && cmp >= 0)) { \
+				uint8_t tmp = order[X]; \
+				order[X] = order[Y]; \
+				order[Y] = tmp; \
+				swap_aa(sort, ARRAY(range.start + X), ARRAY(range.start + Y)); \
+			} \
+		} while(0)
+	for(iter_begin(iter); !iter_finished(iter);) {
+		uint8_t order[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+		range_t range = iter_nextRange(iter);
+	
+		if(range_length(range) == 8) {
+			SWAPIF(0, 1); SWAPIF(2, 3); SWAPIF(4, 5); SWAPIF(6, 7);
+			SWAPIF(0, 2); SWAPIF(1, 3); SWAPIF(4, 6); SWAPIF(5, 7);
+			SWAPIF(1, 2); SWAPIF(5, 6); SWAPIF(0, 4); SWAPIF(3, 7);
+			SWAPIF(1, 5); SWAPIF(2, 6);
+			SWAPIF(1, 4); SWAPIF(3, 6);
+			SWAPIF(2, 4); SWAPIF(3, 5);
+			SWAPIF(3, 4);
+			
+		}
+		else if(range_length(range) == 7) {
+			SWAPIF(1, 2); SWAPIF(3, 4); SWAPIF(5, 6);
+			SWAPIF(0, 2); SWAPIF(3, 5); SWAPIF(4, 6);
+			SWAPIF(0, 1); SWAPIF(4, 5); SWAPIF(2, 6);
+			SWAPIF(0, 4); SWAPIF(1, 5);
+			SWAPIF(0, 3); SWAPIF(2, 5);
+			SWAPIF(1, 3); SWAPIF(2, 4);
+			SWAPIF(2, 3);
+			
+		}
+		else if(range_length(range) == 6) {
+			SWAPIF(1, 2); SWAPIF(4, 5);
+			SWAPIF(0, 2); SWAPIF(3, 5);
+			SWAPIF(0, 1); SWAPIF(3, 4); SWAPIF(2, 5);
+			SWAPIF(0, 3); SWAPIF(1, 4);
+			SWAPIF(2, 4); SWAPIF(1, 3);
+			SWAPIF(2, 3);
+			
+		}
+		else if(range_length(range) == 5) {
+			SWAPIF(0, 1); SWAPIF(3, 4);
+			SWAPIF(2, 4);
+			SWAPIF(2, 3); SWAPIF(1, 4);
+			SWAPIF(0, 3);
+			SWAPIF(0, 2); SWAPIF(1, 3);
+			SWAPIF(1, 2);
+			
+		}
+		else if(range_length(range) == 4) {
+			SWAPIF(0, 1); SWAPIF(2, 3);
+			SWAPIF(0, 2); SWAPIF(1, 3);
+			SWAPIF(1, 2);
+		}
+	}
+#undef SWAPIF
 }
 
+static void runsort(
+		sort_t *sort)
+{
+	iter_t iter, last;
+	keep_t keep;
+	double time = stats_clock(sort);
+	
+	/* presorted input is handled in about n comparisons by merging its natural runs */
+	if(sort->size >= RUN_MIN * 2 && natural_sort(sort))
+		return;
+
+	/* if the array is of size 0, 1, 2, or 3, just sort them like so: */
+	if(sort->size < 4) {
+		if(sort->size == 3) {
+			/* hard-coded insertion sort */
+			if(CMP(1, 0) < 0)
+				swap_aa(sort, ARRAY(0), ARRAY(1));
+			if(CMP(2, 1) < 0) {
+				swap_aa(sort, ARRAY(1), ARRAY(2));
+				if(CMP(1, 0) < 0)
+					swap_aa(sort, ARRAY(0), ARRAY(1));
+			}
+		}
+		else if(sort->size == 2) {
+			/* swap the items if they're out of order */
+			if(CMP(1, 0) < 0)
+				swap_aa(sort, ARRAY(0), ARRAY(1));
+		}
+		return;
+	}
+
+	/* sort the first small groups of items with sorting networks */
+	if(!presort_simd(sort, &iter)) {
+		iter = iter_new(sort->size, 4);
+		presort_networks(sort, &iter);
+	}
+	STATS_ADD(presort_time, stats_clock(sort) - time);
+	if(iter_length(&iter) >= sort->size)
+		return;
+
+	/* the internal buffers are sized for the last level, which merges the two halves of the array */
+	last = iter;
+	keep.valid = false;
+	keep.length = iter_length(&last);
+	while(iter_nextLevel(&last))
+		keep.length = iter_length(&last);
+	
+	for(;;) {
+		level_t level = level_new(&iter);
+		level.keep = &keep;
+		merge_level(sort, &level);
+		
+		/* double the size of each A and B subarray that will be merged in the next level */
+		if(!iter_nextLevel(&iter))
+			break;
+	}
+	
+	if(keep.valid) {
+		struct wikisort_stats_level *level_stats = stats_level(sort, keep.length);
+		time = stats_clock(sort);
+		redistribute_buffers(sort, keep.pull, keep.buffer2);
+		if(level_stats)
+			level_stats->redistribute_time += stats_clock(sort) - time;
+	}
+}
+
+/* sort a range of the array on its own */
+static void sort_range(
+		const sort_t *sort,
+		range_t range)
+{
+	sort_t sub = *sort;
+	sub.array = ARRAY(range.start);
+	sub.size = range_length(range);
+	if(sub.map)
+		sub.map += range.start * sub.mapsz;
+	runsort(&sub);
+}
+
+/* sort the 'k' smallest items to the front of the array. the rest of the array is scanned for items which are smaller */
+/* than the current k-th item, and those are gathered right behind the first k items in their original order. */
+/* whenever k of them are gathered, they are sorted and merged with the first k items, which pushes the larger items back out. */
+/* items which tie with one of the first k items come later in the array, so they are never gathered and stability holds */
+static void runtopk(
+		const sort_t *sort,
+		size_t k)
+{
+	size_t index, count = 0;
+	
+	sort_range(sort, range_new(0, k));
+	for(index = k; index < sort->size; index++) {
+		if(CMP(index, k - 1) >= 0)
+			continue;
+		if(index != k + count)
+			swap_aa(sort, ARRAY(k + count), ARRAY(index));
+		if(++count == k) {
+			sort_range(sort, range_new(k, k + count));
+			merge_pair(sort, range_new(0, k), range_new(k, k + count));
+			count = 0;
+		}
+	}
+	sort_range(sort, range_new(k, k + count));
+	merge_pair(sort, range_new(0, k), range_new(k, k + count));
+}
+
+/* number of items that fit into the default stack cache */
+static inline size_t default_cache_size(
+		size_t itemsz)
+{
+	if(itemsz == 0)
+		return 0;
+	return min(CACHE_SIZE, CACHE_BYTES / itemsz);
+}
+
+static void sort_init(
+		sort_t *sort,
+		void *base,
+		size_t size,
+		size_t itemsz)
+{
+	sort->array = base;
+	sort->itemsz = itemsz;
+	sort->size = size;
+	/* the inverse of an odd number x modulo 2^n starts with x, which is right in the lowest 3 bits, and each */
+	/* step of newton's method doubles the number of right bits */
+	for(sort->index_shift = 0; itemsz > 0 && !(itemsz >> sort->index_shift & 1); sort->index_shift++);
+	sort->index_inverse = itemsz >> sort->index_shift;
+	for(int i = 0; i < 5; i++)
+		sort->index_inverse *= 2 - (itemsz >> sort->index_shift) * sort->index_inverse;
+	sort->cmp = NULL;
+	sort->cmp_r = NULL;
+	sort->ctx = NULL;
+	sort->keyoff = 0;
+	sort->keysz = 0;
+	sort->keytype = 0;
+	sort->map = NULL;
+	sort->mapsz = sizeof(size_t);
+	sort->seeded = false;
+	sort->prefixed = false;
+	sort->strings = false;
+	sort->depth = 0;
+	/* most callers only set 'cmp'. sort_prepare() picks the comparison again for the others */
+	sort->compare = compare_cmp;
+	sort->cache = NULL;
+	sort->cachemap = NULL;
+	sort->cache_size = 0;
+	sort->stats = NULL;
+}
+
+/* compare the typed key at 'keyoff' with the comparator of its type */
+static void sort_typed(
+		sort_t *sort,
+		size_t keyoff,
+		int keytype)
+{
+	assert(keytype >= WIKISORT_U32 && keytype <= WIKISORT_F64);
+	sort->cmp_r = key_compare[keytype];
+	sort->keyoff = keyoff;
+	sort->keysz = keytype >= WIKISORT_U64 ? 8 : 4;
+	sort->keytype = keytype;
+}
+
+/* give the sort the default cache, on the stack of the calling function */
+#define SORT_CACHE(_sort) \
+	char cache[CACHE_BYTES]; \
+	size_t cachemap[CACHE_SIZE]; \
+	(_sort)->cache = cache; \
+	(_sort)->cachemap = (char*)cachemap; \
+	(_sort)->cache_size = default_cache_size((_sort)->itemsz)
+
+/* pick the comparison and the movers, set up the statistics and start the map with the original order */
+static void sort_prepare(
+		sort_t *sort)
+{
+	compare_init(sort);
+	mover_init(sort);
+	if(sort->stats)
+		stats_init(sort);
+	if(sort->map && !sort->seeded)
+		for(size_t i = 0; i < sort->size; i++)
+			map_set(sort, sort->map, i, i);
+}
+
+/* sort with the cache set up by the caller */
+static void sort_run_cached(
+		sort_t *sort)
+{
+	double time;
+	sort_prepare(sort);
+	time = stats_clock(sort);
+	runsort(sort);
+	STATS_ADD(total_time, stats_clock(sort) - time);
+}
+
+/* sort with the default cache on the stack */
+static void sort_run(
+		sort_t *sort)
+{
+	SORT_CACHE(sort);
+	sort_run_cached(sort);
+}
+
+/* sort the segments 'segments.start' up to 'segments.end' on their own, where segment i holds the items from */
+/* offsets[i] up to offsets[i + 1]. the sort is already prepared, so each segment only costs a copy of it, and runsort() */
+/* sorts tiny segments with the hard-coded insertion sort or the sorting networks anyway */
+static void segments_sort(
+		const sort_t *sort,
+		const size_t *offsets,
+		range_t segments)
+{
+	for(size_t i = segments.start; i < segments.end; i++)
+		if(offsets[i + 1] - offsets[i] > 1)
+			sort_range(sort, range_new(offsets[i], offsets[i + 1]));
+}
+
+#ifndef WIKISORT_NO_THREADS
+typedef struct pool pool_t;
+
+/* a minimal thread pool. pool_run() hands out the indices of a job to the worker threads and the calling thread, */
+/* and returns once all of them are finished */
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t wake, done;
+	pthread_t *threads;
+	size_t nthreads;
+	unsigned generation;
+	bool quit;
+
+	void (*job)(pool_t *pool, size_t index);
+	size_t count, next, finished;
+
+	/* the sort, and the A+B pairs (or chunks for pool_sortChunk(), or batches of segments for pool_sortSegments()) */
+	/* the jobs work on. pool_splitPair() writes into 'split', which holds twice as many pairs as 'pairs' */
+	const sort_t *sort;
+	range_t *pairs;
+	range_t *split;
+	const size_t *offsets;
+};
+
+/* hand out job indices until there are none left. must be called with the lock held */
+static void pool_work(
+		pool_t *pool)
+{
+	while(pool->next < pool->count) {
+		size_t index = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		pool->job(pool, index);
+		pthread_mutex_lock(&pool->lock);
+		if(++pool->finished == pool->count)
+			pthread_cond_broadcast(&pool->done);
+	}
+}
+
+static void *pool_thread(
+		void *arg)
+{
+	pool_t *pool = arg;
+	unsigned generation = 0;
+	pthread_mutex_lock(&pool->lock);
+	for(;;) {
+		while(!pool->quit && pool->generation == generation)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if(pool->quit)
+			break;
+		generation = pool->generation;
+		pool_work(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void pool_run(
+		pool_t *pool,
+		void (*job)(pool_t *pool, size_t index),
+		size_t count)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->job = job;
+	pool->count = count;
+	pool->next = 0;
+	pool->finished = 0;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->wake);
+	pool_work(pool);
+	while(pool->finished < pool->count)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* start 'nthreads' - 1 worker threads, since the calling thread works as well. */
+/* if some threads can't be created we just continue with fewer of them */
+static bool pool_init(
+		pool_t *pool,
+		const sort_t *sort,
+		size_t nthreads)
+{
+	pool->threads = malloc((nthreads - 1) * sizeof(*pool->threads));
+	pool->pairs = malloc(8 * nthreads * sizeof(*pool->pairs));
+	if(!pool->threads || !pool->pairs) {
+		free(pool->threads);
+		free(pool->pairs);
+		return false;
+	}
+	pool->split = pool->pairs + 4 * nthreads;
+	pool->sort = sort;
+	pool->offsets = NULL;
+	pool->generation = 0;
+	pool->quit = false;
+	pool->count = pool->next = pool->finished = 0;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for(pool->nthreads = 0; pool->nthreads < nthreads - 1; pool->nthreads++)
+		if(pthread_create(&pool->threads[pool->nthreads], NULL, pool_thread, pool) != 0)
+			break;
+	return true;
+}
+
+static void pool_free(
+		pool_t *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	for(size_t i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+	free(pool->pairs);
+}
+
+/* every job works on a copy of the sort with its own cache on the stack */
+#define POOL_SORT(_sub, _pool) \
+	sort_t _sub = *(_pool)->sort; \
+	SORT_CACHE(&_sub)
+
+/* sort the chunk pairs[index] on its own */
+static void pool_sortChunk(
+		pool_t *pool,
+		size_t index)
+{
+	POOL_SORT(sub, pool);
+	sort_range(&sub, pool->pairs[index]);
+}
+
+/* split the A+B pair 'index' into two independent pairs, by rotating the upper part of A behind the lower part of B */
+static void pool_splitPair(
+		pool_t *pool,
+		size_t index)
+{
+	range_t A = pool->pairs[2 * index], B = pool->pairs[2 * index + 1];
+	range_t *split = pool->split + 4 * index;
+	size_t a, b, lower_B;
+	POOL_SORT(sub, pool);
+	const sort_t *sort = &sub;
+	
+	if(range_length(A) + range_length(B) < 2 * PARALLEL_MIN || range_length(A) == 0 || range_length(B) == 0 || CMP(B.start, A.end - 1) >= 0) {
+		/* not worth splitting */
+		split[0] = A;
+		split[1] = B;
+		split[2] = split[3] = range_new(B.end, B.end);
+		return;
+	}
+	
+	/* everything in A before 'a' and in B before 'b' is placed before the rest, while keeping equal items in order */
+	if(range_length(A) >= range_length(B)) {
+		a = A.start + range_length(A) / 2;
+		b = BinaryFirst(sort, ARRAY(a), B);
+	}
+	else {
+		b = B.start + range_length(B) / 2;
+		a = BinaryLast(sort, ARRAY(b), A);
+	}
+	rotate(sort, A.end - a, range_new(a, b), sort->cache_size);
+	
+	lower_B = b - B.start;
+	split[0] = range_new(A.start, a);
+	split[1] = range_new(a, a + lower_B);
+	split[2] = range_new(a + lower_B, b);
+	split[3] = range_new(b, B.end);
+}
+
+static void pool_mergePair(
+		pool_t *pool,
+		size_t index)
+{
+	POOL_SORT(sub, pool);
+	merge_pair(&sub, pool->pairs[2 * index], pool->pairs[2 * index + 1]);
+}
+
+/* sort the batch of segments pairs[index] */
+static void pool_sortSegments(
+		pool_t *pool,
+		size_t index)
+{
+	POOL_SORT(sub, pool);
+	segments_sort(&sub, pool->offsets, pool->pairs[index]);
+}
+
+/* spread the segments across the threads, in up to 8 batches per thread of about the same number of items. */
+/* the segments behind the last full batch, even empty ones, go into the last batch so there are never more than 'pool->pairs' holds */
+static void segments_parallel(
+		pool_t *pool,
+		const sort_t *sort,
+		const size_t *offsets,
+		size_t nsegs,
+		size_t nthreads)
+{
+	size_t batches = 8 * nthreads, count = 0, start = 0;
+	size_t batch = (offsets[nsegs] - offsets[0] + batches - 1) / batches;
+	for(size_t i = 0; i < nsegs; i++) {
+		if((count < batches - 1 && offsets[i + 1] - offsets[start] >= batch) || i == nsegs - 1) {
+			pool->pairs[count++] = range_new(start, i + 1);
+			start = i + 1;
+		}
+	}
+	pool->sort = sort;
+	pool->offsets = offsets;
+	pool_run(pool, pool_sortSegments, count);
+}
+
+/* sort the array of 'pool->sort' with the threads of the pool. each thread sorts a chunk of the array, then the levels of merges are spread across the threads. */
+/* once there are fewer A+B pairs than threads, the pairs are split into independent smaller pairs by rotating */
+/* the upper half of A behind the lower half of B, just like the first step of a merge by divide and conquer */
+static void runsort_pool(
+		pool_t *pool,
+		size_t nthreads)
+{
+	const sort_t *sort = pool->sort;
+	iter_t iter;
+	size_t chunks, ranges, npairs;
+	
+	/* find the level of the merge sort with the smallest power of two number of ranges which is >= nthreads */
+	for(chunks = 2; chunks < nthreads; chunks += chunks);
+	iter = iter_new(sort->size, 4);
+	for(ranges = iter.denominator; ranges > chunks; ranges /= 2)
+		iter_nextLevel(&iter);
+	
+	/* sort each of those ranges separately */
+	ranges = 0;
+	for(iter_begin(&iter); !iter_finished(&iter);)
+		pool->pairs[ranges++] = iter_nextRange(&iter);
+	pool_run(pool, pool_sortChunk, ranges);
+	
+	for(;;) {
+		npairs = 0;
+		for(iter_begin(&iter); !iter_finished(&iter); npairs++) {
+			pool->pairs[2 * npairs] = iter_nextRange(&iter);
+			pool->pairs[2 * npairs + 1] = iter_nextRange(&iter);
+		}
+		
+		/* split the pairs until there is enough work for every thread */
+		while(npairs < nthreads) {
+			size_t index, count = 0;
+			pool_run(pool, pool_splitPair, npairs);
+			for(index = 0; index < 2 * npairs; index++) {
+				range_t A = pool->split[2 * index], B = pool->split[2 * index + 1];
+				if(range_length(A) + range_length(B) == 0)
+					continue;
+				pool->pairs[2 * count] = A;
+				pool->pairs[2 * count + 1] = B;
+				count++;
+			}
+			if(count == npairs)
+				break;
+			npairs = count;
+		}
+		pool_run(pool, pool_mergePair, npairs);
+		
+		/* double the size of each A and B subarray that will be merged in the next level */
+		if(!iter_nextLevel(&iter))
+			break;
+	}
+}
+
+/* sort with a pool of threads of its own */
+static void runsort_parallel(
+		sort_t *sort,
+		size_t nthreads)
+{
+	pool_t pool;
+	if(!pool_init(&pool, sort, nthreads)) {
+		runsort(sort);
+		return;
+	}
+	runsort_pool(&pool, nthreads);
+	pool_free(&pool);
+}
+#endif
+
+typedef struct task task_t;
+
+/* a pending piece of work of a wikisort_job: merge A and B, or reverse A if 'reverse' is set */
+struct task {
+	range_t A, B;
+	bool reverse;
+};
+
+/* the state of an incremental sort. the array is sorted in chunks of at least RUN_MIN items first, which 'iter' */
+/* walks through, then 'iter' walks through the A+B pairs of each level. pairs which are larger than the budget of */
+/* a step are split into 'tasks' as by pool_splitPair(), but rotated by reversals, which can be stopped at any point */
+struct wikisort_job {
+	sort_t sort;
+	char cache[CACHE_BYTES];
+	iter_t iter;
+	bool merging, done;
+	/* the current level and the number of levels, which counts the chunks as one. the items before 'finished' */
+	/* are done for the current level */
+	size_t level, levels, finished;
+	size_t ntasks;
+	task_t tasks[JOB_TASKS];
+};
+
+/* the context of wikisort_ctx_new(). 'sort' is set up once without an array, and every sort with the context */
+/* works on a copy of it. 'threaded' is set if 'pool' holds the threads */
+struct wikisort_ctx {
+	sort_t sort;
+	size_t nthreads;
+	bool threaded;
+#ifndef WIKISORT_NO_THREADS
+	pool_t pool;
+#endif
+};
+
+/* a loser tree (tournament tree) for merging 'count' sorted runs. the leaf of run i is the node 'count' + i, the children */
+/* of node n are the nodes 2n and 2n + 1, and each inner node keeps the loser of the match between the winners of its subtrees. */
+/* loser[0] keeps the overall winner. 'less' tells whether the current item of run a goes before the one of run b, */
+/* it needs to put exhausted runs last and break ties by the run index to keep the merge stable */
+typedef bool (*tree_less_t)(const void *ctx, size_t a, size_t b);
+
+/* set up the subtree below 'node', and return its winner */
+static size_t tree_build(
+		size_t *loser,
+		size_t count,
+		size_t node,
+		tree_less_t less,
+		const void *ctx)
+{
+	size_t left, right;
+	if(node >= count)
+		return node - count;
+	left = tree_build(loser, count, 2 * node, less, ctx);
+	right = tree_build(loser, count, 2 * node + 1, less, ctx);
+	if(less(ctx, right, left)) {
+		loser[node] = left;
+		return right;
+	}
+	loser[node] = right;
+	return left;
+}
+
+static inline void tree_init(
+		size_t *loser,
+		size_t count,
+		tree_less_t less,
+		const void *ctx)
+{
+	loser[0] = tree_build(loser, count, 1, less, ctx);
+}
+
+/* find the new winner after the current item of the winner's run changed, by replaying the matches on its path to the root */
+static inline void tree_replay(
+		size_t *loser,
+		size_t count,
+		tree_less_t less,
+		const void *ctx)
+{
+	size_t winner = loser[0], node;
+	for(node = (winner + count) / 2; node > 0; node /= 2) {
+		if(less(ctx, loser[node], winner)) {
+			size_t tmp = loser[node];
+			loser[node] = winner;
+			winner = tmp;
+		}
+	}
+	loser[0] = winner;
+}
+
+/* state of merging the runs of wikisort_merge_runs(). pos[i] is the index of the current item of run i */
+typedef struct kway kway_t;
+struct kway {
+	sort_t sort; /* only used for compare() */
+	const struct wikisort_run *runs;
+	size_t *pos;
+};
+
+static bool kway_less(
+		const void *ctx,
+		size_t a,
+		size_t b)
+{
+	const kway_t *kway = ctx;
+	const sort_t *sort = &kway->sort;
+	int cmp;
+	if(kway->pos[a] == kway->runs[a].size)
+		return false;
+	if(kway->pos[b] == kway->runs[b].size)
+		return true;
+	cmp = compare(sort, (const char*)kway->runs[a].base + kway->pos[a] * sort->itemsz, (const char*)kway->runs[b].base + kway->pos[b] * sort->itemsz);
+	return cmp < 0 || (cmp == 0 && a < b);
+}
+
+/* merge the runs, and copy every item to 'out' and its origin to 'origin', and/or pass it to 'emit', whichever is set */
+static void kway_merge(
+		const struct wikisort_run *runs,
+		size_t count,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		char *out,
+		struct wikisort_origin *origin,
+		void (*emit)(const void *item, size_t run, size_t index, void *ctx),
+		void *ctx,
+		size_t *tree)
+{
+	kway_t kway;
+	size_t *loser = tree;
+	
+	if(count == 0)
+		return;
+	sort_init(&kway.sort, NULL, 0, itemsz);
+	kway.sort.cmp = cmp;
+	kway.runs = runs;
+	kway.pos = tree + count;
+	for(size_t i = 0; i < count; i++)
+		kway.pos[i] = 0;
+	tree_init(loser, count, kway_less, &kway);
+	
+	for(;;) {
+		size_t run = loser[0], index = kway.pos[run];
+		const char *item = (const char*)runs[run].base + index * itemsz;
+		if(index == runs[run].size)
+			break;
+		if(out) {
+			memcpy(out, item, itemsz);
+			out += itemsz;
+		}
+		if(origin) {
+			origin->run = run;
+			origin->index = index;
+			origin++;
+		}
+		if(emit)
+			emit(item, run, index, ctx);
+		kway.pos[run]++;
+		tree_replay(loser, count, kway_less, &kway);
+	}
+}
+
+#ifndef WIKISORT_NO_FILES
+typedef struct xreq xreq_t;
+typedef struct xio xio_t;
+typedef struct xrun xrun_t;
+typedef struct external external_t;
+
+/* a read or write of a whole buffer at an offset of a file */
+struct xreq {
+	xreq_t *next;
+	int fd;
+	char *buf;
+	size_t len;
+	off_t off;
+	bool write, pending;
+	int error;
+};
+
+/* runs the reads or the writes of the external sort, either right away, or one after the other on a thread of its own */
+struct xio {
+	bool threaded;
+#ifndef WIKISORT_NO_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t wake, done;
+	pthread_t thread;
+	bool quit;
+	xreq_t *head, *tail;
+#endif
+};
+
+/* a sorted run while it's being merged. the block in buf[cur] is merged while the next one is read into the other buffer */
+struct xrun {
+	size_t next, end; /* the items of the run which haven't been read yet */
+	char *buf[2];
+	size_t len[2];
+	xreq_t req[2];
+	size_t pos;
+	int cur;
+};
+
+struct external {
+	sort_t sort; /* only used for compare() */
+	size_t itemsz;
+	char *memory;
+	size_t memory_size;
+	xio_t reader, writer;
+	xrun_t *runs; /* the runs which are being merged */
+};
+
+/* read or write the whole buffer, returns 0 or the error */
+static int xreq_run(
+		xreq_t *req)
+{
+	size_t done = 0;
+	while(done < req->len) {
+		ssize_t n;
+		if(req->write)
+			n = pwrite(req->fd, req->buf + done, req->len - done, req->off + done);
+		else
+			n = pread(req->fd, req->buf + done, req->len - done, req->off + done);
+		if(n < 0 && errno == EINTR)
+			continue;
+		else if(n < 0)
+			return errno;
+		else if(n == 0)
+			return EIO; /* the file is shorter than expected */
+		done += n;
+	}
+	return 0;
+}
+
+#ifndef WIKISORT_NO_THREADS
+static void *xio_thread(
+		void *arg)
+{
+	xio_t *io = arg;
+	pthread_mutex_lock(&io->lock);
+	for(;;) {
+		xreq_t *req;
+		while(!io->quit && !io->head)
+			pthread_cond_wait(&io->wake, &io->lock);
+		if(!io->head)
+			break;
+		req = io->head;
+		io->head = req->next;
+		if(!io->head)
+			io->tail = NULL;
+		pthread_mutex_unlock(&io->lock);
+		req->error = xreq_run(req);
+		pthread_mutex_lock(&io->lock);
+		req->pending = false;
+		pthread_cond_broadcast(&io->done);
+	}
+	pthread_mutex_unlock(&io->lock);
+	return NULL;
+}
+#endif
+
+/* if the thread can't be created, the requests are run right away instead */
+static void xio_init(
+		xio_t *io,
+		bool threaded)
+{
+	io->threaded = false;
+#ifndef WIKISORT_NO_THREADS
+	if(!threaded)
+		return;
+	io->quit = false;
+	io->head = io->tail = NULL;
+	pthread_mutex_init(&io->lock, NULL);
+	pthread_cond_init(&io->wake, NULL);
+	pthread_cond_init(&io->done, NULL);
+	if(pthread_create(&io->thread, NULL, xio_thread, io) == 0)
+		io->threaded = true;
+	else {
+		pthread_mutex_destroy(&io->lock);
+		pthread_cond_destroy(&io->wake);
+		pthread_cond_destroy(&io->done);
+	}
+#else
+	(void)threaded;
+#endif
+}
+
+static void xio_free(
+		xio_t *io)
+{
+#ifndef WIKISORT_NO_THREADS
+	if(!io->threaded)
+		return;
+	pthread_mutex_lock(&io->lock);
+	io->quit = true;
+	pthread_cond_broadcast(&io->wake);
+	pthread_mutex_unlock(&io->lock);
+	pthread_join(io->thread, NULL);
+	pthread_mutex_destroy(&io->lock);
+	pthread_cond_destroy(&io->wake);
+	pthread_cond_destroy(&io->done);
+#else
+	(void)io;
+#endif
+}
+
+static void xio_submit(
+		xio_t *io,
+		xreq_t *req,
+		int fd,
+		char *buf,
+		size_t len,
+		off_t off,
+		bool write)
+{
+	req->next = NULL;
+	req->fd = fd;
+	req->buf = buf;
+	req->len = len;
+	req->off = off;
+	req->write = write;
+	req->error = 0;
+#ifndef WIKISORT_NO_THREADS
+	if(io->threaded) {
+		pthread_mutex_lock(&io->lock);
+		req->pending = true;
+		if(io->tail)
+			io->tail->next = req;
+		else
+			io->head = req;
+		io->tail = req;
+		pthread_cond_signal(&io->wake);
+		pthread_mutex_unlock(&io->lock);
+		return;
+	}
+#else
+	(void)io;
+#endif
+	req->pending = false;
+	req->error = xreq_run(req);
+}
+
+/* wait until the request is finished, returns 0 or the error */
+static int xio_wait(
+		xio_t *io,
+		xreq_t *req)
+{
+#ifndef WIKISORT_NO_THREADS
+	if(io->threaded) {
+		pthread_mutex_lock(&io->lock);
+		while(req->pending)
+			pthread_cond_wait(&io->done, &io->lock);
+		pthread_mutex_unlock(&io->lock);
+	}
+#else
+	(void)io;
+#endif
+	return req->error;
+}
+
+/* a temporary file which is already unlinked, so it's gone once it's closed */
+static int external_tmpfile(
+		const char *tmpdir)
+{
+	char *path;
+	int fd;
+	if(!tmpdir)
+		tmpdir = getenv("TMPDIR");
+	if(!tmpdir)
+		tmpdir = "/tmp";
+	path = malloc(strlen(tmpdir) + sizeof("/wikisort.XXXXXX"));
+	if(!path)
+		return -1;
+	strcpy(path, tmpdir);
+	strcat(path, "/wikisort.XXXXXX");
+	fd = mkstemp(path);
+	if(fd >= 0)
+		unlink(path);
+	free(path);
+	return fd;
+}
+
+/* start reading the next block of the run into buf[index] */
+static void xrun_fill(
+		external_t *ext,
+		xrun_t *run,
+		int index,
+		int fd,
+		size_t block)
+{
+	size_t len = min(block, run->end - run->next);
+	run->len[index] = len;
+	if(len > 0)
+		xio_submit(&ext->reader, &run->req[index], fd, run->buf[index], len * ext->itemsz, (off_t)run->next * ext->itemsz, false);
+	run->next += len;
+}
+
+static inline bool xrun_empty(
+		const xrun_t *run)
+{
+	return run->pos >= run->len[run->cur];
+}
+
+static inline char *xrun_item(
+		const external_t *ext,
+		const xrun_t *run)
+{
+	return run->buf[run->cur] + run->pos * ext->itemsz;
+}
+
+/* whether the current item of run 'a' goes before the one of run 'b'. equal items go in the order of the runs */
+static bool xrun_less(
+		const void *ctx,
+		size_t a,
+		size_t b)
+{
+	const external_t *ext = ctx;
+	int cmp;
+	if(xrun_empty(&ext->runs[a]))
+		return false;
+	if(xrun_empty(&ext->runs[b]))
+		return true;
+	cmp = compare(&ext->sort, xrun_item(ext, &ext->runs[a]), xrun_item(ext, &ext->runs[b]));
+	return cmp < 0 || (cmp == 0 && a < b);
+}
+
+/* merge the sorted runs of the file 'src' into a single run starting at item 'to' of the file 'dst'. */
+/* the memory is split into two blocks for each run and two for the output, so one block of each can be read or written */
+/* in the background while the other one is merged. returns 0 or the error */
+static int external_merge(
+		external_t *ext,
+		int src,
+		const range_t *ranges,
+		size_t count,
+		int dst,
+		size_t to)
+{
+	size_t itemsz = ext->itemsz;
+	size_t block = ext->memory_size / (2 * count + 2) / itemsz;
+	xrun_t *runs = malloc(count * sizeof(*runs));
+	size_t *loser = malloc(count * sizeof(*loser));
+	char *out[2];
+	xreq_t outreq[2];
+	size_t outlen = 0, index;
+	int outcur = 0, error = 0;
+	
+	if(!runs || !loser) {
+		free(runs);
+		free(loser);
+		return ENOMEM;
+	}
+	
+	for(index = 0; index < count; index++) {
+		xrun_t *run = &runs[index];
+		run->next = ranges[index].start;
+		run->end = ranges[index].end;
+		run->buf[0] = ext->memory + 2 * index * block * itemsz;
+		run->buf[1] = run->buf[0] + block * itemsz;
+		run->req[0].pending = run->req[1].pending = false;
+		run->req[0].error = run->req[1].error = 0;
+		run->pos = 0;
+		run->cur = 0;
+		xrun_fill(ext, run, 0, src, block);
+		xrun_fill(ext, run, 1, src, block);
+	}
+	out[0] = ext->memory + 2 * count * block * itemsz;
+	out[1] = out[0] + block * itemsz;
+	outreq[0].pending = outreq[1].pending = false;
+	outreq[0].error = outreq[1].error = 0;
+	
+	for(index = 0; index < count && !error; index++)
+		error = xio_wait(&ext->reader, &runs[index].req[0]);
+	ext->runs = runs;
+	if(!error)
+		tree_init(loser, count, xrun_less, ext);
+	
+	while(!error) {
+		xrun_t *run = &runs[loser[0]];
+		if(xrun_empty(run))
+			break;
+		
+		memcpy(out[outcur] + outlen * itemsz, xrun_item(ext, run), itemsz);
+		if(++outlen == block) {
+			/* write this block in the background, and continue with the other one once its previous write is finished */
+			xio_submit(&ext->writer, &outreq[outcur], dst, out[outcur], outlen * itemsz, (off_t)to * itemsz, true);
+			to += outlen;
+			outlen = 0;
+			outcur = !outcur;
+			error = xio_wait(&ext->writer, &outreq[outcur]);
+		}
+		
+		if(++run->pos == run->len[run->cur]) {
+			/* continue with the block which was read in the background, and start reading the one after it */
+			int other = !run->cur;
+			error = error ? error : xio_wait(&ext->reader, &run->req[other]);
+			xrun_fill(ext, run, run->cur, src, block);
+			run->cur = other;
+			run->pos = 0;
+		}
+		
+		tree_replay(loser, count, xrun_less, ext);
+	}
+	
+	if(!error && outlen > 0)
+		xio_submit(&ext->writer, &outreq[outcur], dst, out[outcur], outlen * itemsz, (off_t)to * itemsz, true);
+	
+	/* nothing may still be using the memory once we return, even after an error */
+	for(index = 0; index < count; index++) {
+		xio_wait(&ext->reader, &runs[index].req[0]);
+		xio_wait(&ext->reader, &runs[index].req[1]);
+	}
+	for(index = 0; index < 2; index++) {
+		int status = xio_wait(&ext->writer, &outreq[index]);
+		error = error ? error : status;
+	}
+	free(runs);
+	free(loser);
+	return error;
+}
+
+/* sort the file 'in' into the file 'output'. 'in' is closed before 'output' is opened, so they may be the same file. */
+/* returns 0 or the error */
+static int external_sort(
+		external_t *ext,
+		int in,
+		size_t size,
+		const char *output,
+		const char *tmpdir)
+{
+	size_t itemsz = ext->itemsz;
+	size_t chunk = ext->memory_size / itemsz;
+	size_t blocks = ext->memory_size / EXTERNAL_BLOCK;
+	/* a merge needs two blocks of at least one item for each run and for the output, which limits it for large items */
+	size_t fanin = min(blocks >= 6 ? blocks / 2 - 1 : 2, chunk / 2 - 1);
+	size_t count = (size + chunk - 1) / chunk, index;
+	range_t *runs;
+	int tmp[2] = { -1, -1 }, out = -1, error = 0;
+	xreq_t req;
+	
+	if(count <= 1) {
+		/* everything fits into memory */
+		req.fd = in;
+		req.buf = ext->memory;
+		req.len = size * itemsz;
+		req.off = 0;
+		req.write = false;
+		error = xreq_run(&req);
+		close(in);
+		if(error)
+			return error;
+		wikisort(ext->memory, size, itemsz, ext->sort.cmp);
+		
+		out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if(out < 0)
+			return errno;
+		req.fd = out;
+		req.write = true;
+		error = xreq_run(&req);
+		if(close(out) != 0 && !error)
+			error = errno;
+		return error;
+	}
+	
+	runs = malloc(count * sizeof(*runs));
+	tmp[0] = external_tmpfile(tmpdir);
+	if(!runs || tmp[0] < 0) {
+		error = runs ? errno : ENOMEM;
+		close(in);
+		free(runs);
+		if(tmp[0] >= 0)
+			close(tmp[0]);
+		return error;
+	}
+	
+	/* sort chunks of the file which fit into memory, and write them to the temporary file as the initial runs */
+	for(index = 0; index < count && !error; index++) {
+		runs[index] = range_new(index * chunk, min(size, (index + 1) * chunk));
+		req.fd = in;
+		req.buf = ext->memory;
+		req.len = range_length(runs[index]) * itemsz;
+		req.off = (off_t)runs[index].start * itemsz;
+		req.write = false;
+		error = xreq_run(&req);
+		if(error)
+			break;
+		wikisort(ext->memory, range_length(runs[index]), itemsz, ext->sort.cmp);
+		req.fd = tmp[0];
+		req.write = true;
+		error = xreq_run(&req);
+	}
+	close(in);
+	
+	/* if there are too many runs to give each one a large enough block, merge neighboring runs until there are few enough */
+	while(!error && count > fanin) {
+		size_t merged = 0;
+		if(tmp[1] < 0 && (tmp[1] = external_tmpfile(tmpdir)) < 0) {
+			error = errno;
+			break;
+		}
+		for(index = 0; index < count && !error; index += fanin, merged++) {
+			size_t last = min(count, index + fanin) - 1;
+			error = external_merge(ext, tmp[0], runs + index, last - index + 1, tmp[1], runs[index].start);
+			runs[merged] = range_new(runs[index].start, runs[last].end);
+		}
+		count = merged;
+		out = tmp[0];
+		tmp[0] = tmp[1];
+		tmp[1] = out;
+	}
+	
+	if(!error) {
+		out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if(out < 0)
+			error = errno;
+		else {
+			error = external_merge(ext, tmp[0], runs, count, out, 0);
+			if(close(out) != 0 && !error)
+				error = errno;
+		}
+	}
+	
+	close(tmp[0]);
+	if(tmp[1] >= 0)
+		close(tmp[1]);
+	free(runs);
+	return error;
+}
+
+/* give the kernel advice about the pages of the array, which is mapped from a file, that are entirely within the range. */
+/* neighboring ranges never share a page this way, and ranges smaller than a page don't cost a system call */
+static void file_advise(
+		const sort_t *sort,
+		range_t range,
+		size_t pagesz,
+		int advice)
+{
+	size_t start = (range.start * sort->itemsz + pagesz - 1) / pagesz * pagesz;
+	size_t end = range.end * sort->itemsz / pagesz * pagesz;
+	if(end > start)
+		madvise(sort->array + start, end - start, advice);
+}
+
+/* sort an array which is mapped from a file. this merges level by level just like runsort(), but each pair is merged on its own */
+/* with merge_pair(), so the internal buffers are pulled out and redistributed within the pair instead of across the whole level. */
+/* every level is a sequential sweep over the file, so the pages of the next pair are requested while merging the current one, */
+/* and the pages of merged pairs are released again. if 'tile' is larger than the first level, ranges of up to 'tile' items are */
+/* sorted on their own first, which skips all those levels of sweeps */
+static void runsort_file(
+		sort_t *sort,
+		size_t tile,
+		size_t pagesz)
+{
+	iter_t iter;
+	range_t A, B, nextA, nextB;
+	
+	file_advise(sort, range_new(0, sort->size), pagesz, MADV_SEQUENTIAL);
+	if(sort->size <= max(tile, 8)) {
+		runsort(sort);
+		return;
+	}
+	if(sort->size >= RUN_MIN * 2 && natural_sort(sort))
+		return;
+	
+	/* find the level of the merge sort with the longest ranges that still fit into a tile, and sort those ranges */
+	iter = iter_new(sort->size, 4);
+	while(2 * (iter_length(&iter) + 1) <= tile)
+		iter_nextLevel(&iter);
+	for(iter_begin(&iter); !iter_finished(&iter);) {
+		A = iter_nextRange(&iter);
+		sort_range(sort, A);
+		file_advise(sort, A, pagesz, MADV_DONTNEED);
+	}
+	
+	for(;;) {
+		iter_begin(&iter);
+		nextA = iter_nextRange(&iter);
+		nextB = iter_nextRange(&iter);
+		do {
+			A = nextA;
+			B = nextB;
+			if(!iter_finished(&iter)) {
+				nextA = iter_nextRange(&iter);
+				nextB = iter_nextRange(&iter);
+				file_advise(sort, range_new(nextA.start, nextB.end), pagesz, MADV_WILLNEED);
+			}
+			else
+				nextA = nextB = range_new(sort->size, sort->size);
+			merge_pair(sort, A, B);
+			file_advise(sort, range_new(A.start, B.end), pagesz, MADV_DONTNEED);
+		} while(range_length(nextA) > 0);
+		
+		/* double the size of each A and B subarray that will be merged in the next level */
+		if(!iter_nextLevel(&iter))
+			break;
+	}
+}
+#endif
+
+/* comparator state for sorting an array of indices into 'base' */
+typedef struct indirect indirect_t;
+struct indirect {
+	const char *base;
+	size_t itemsz;
+	int (*cmp)(const void *a, const void *b);
+};
+
+static int cmp_indirect(
+		const void *a,
+		const void *b,
+		void *ctx)
+{
+	const indirect_t *indirect = ctx;
+	return indirect->cmp(indirect->base + *(const size_t*)a * indirect->itemsz, indirect->base + *(const size_t*)b * indirect->itemsz);
+}
+
+/* reorder the items so that index i holds the item which was at perm[i]. this follows the cycles of the permutation, */
+/* so each item is moved exactly once, plus once more into a temporary location for each cycle */
+static void apply_permutation(
+		char *base,
+		size_t size,
+		size_t itemsz,
+		size_t *perm)
+{
+	char *tmp = alloca(itemsz);
+	
+	/* items which are already in place are marked by inverting their entry in 'perm', and restored at the end */
+	for(size_t start = 0; start < size; start++) {
+		size_t index = start, next;
+		if(perm[start] >= size)
+			continue;
+		if(perm[start] == start) {
+			perm[start] = ~perm[start];
+			continue;
+		}
+		
+		memcpy(tmp, base + start * itemsz, itemsz);
+		for(;;) {
+			next = perm[index];
+			perm[index] = ~next;
+			if(next == start)
+				break;
+			memcpy(base + index * itemsz, base + next * itemsz, itemsz);
+			index = next;
+		}
+		memcpy(base + index * itemsz, tmp, itemsz);
+	}
+	for(size_t i = 0; i < size; i++)
+		perm[i] = ~perm[i];
+}
+
+void wikisort_parallel(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		size_t nthreads)
+{
+#ifndef WIKISORT_NO_THREADS
+	sort_t sort;
+	
+	nthreads = min(nthreads, size / PARALLEL_MIN);
+	if(nthreads < 2) {
+		wikisort(base, size, itemsz, cmp);
+		return;
+	}
+	
+	sort_init(&sort, base, size, itemsz);
+	sort.cmp = cmp;
+	mover_init(&sort);
+	runsort_parallel(&sort, nthreads);
+#else
+	(void)nthreads;
+	wikisort(base, size, itemsz, cmp);
+#endif
+}
+
+void wikisort_trace_cached(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		size_t *map, /* size: 'size' */
+		void *cache, /* size: 'cache_size' * 'itemsz' */
+		size_t *cachemap, /* size: 'cache_size' */
+		size_t cache_size)
+{
+	sort_t sort;
+	sort_init(&sort, base, size, itemsz);
+	sort.cmp = cmp;
+	sort.map = (char*)map;
+	sort.cache = cache;
+	sort.cachemap = (char*)cachemap;
+	sort.cache_size = cache ? cache_size : 0;
+	sort_run_cached(&sort);
+}
+
+void wikisort_cached(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		void *cache, /* size: 'cache_size' * 'itemsz' */
+		size_t cache_size)
+{
+	sort_t sort;
+	sort_init(&sort, base, size, itemsz);
+	sort.cmp = cmp;
+	sort.cache = cache;
+	sort.cache_size = cache ? cache_size : 0;
+	sort_run_cached(&sort);
+}
+
+void wikisort_topk(
+		void *base,
+		size_t size,
+		size_t k,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b))
+{
+	sort_t sort;
+	
+	if(k >= size) {
+		wikisort(base, size, itemsz, cmp);
+		return;
+	}
+	if(k == 0)
+		return;
+	sort_init(&sort, base, size, itemsz);
+	sort.cmp = cmp;
+	SORT_CACHE(&sort);
+	sort_prepare(&sort);
+	runtopk(&sort, k);
+}
+
+void wikisort_trace_merge(
+		void *base,
+		size_t len_a,
+		size_t len_b,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		size_t *map) /* size: 'len_a' + 'len_b' */
+{
+	sort_t sort;
+	sort_init(&sort, base, len_a + len_b, itemsz);
+	sort.cmp = cmp;
+	sort.map = (char*)map;
+	SORT_CACHE(&sort);
+	sort_prepare(&sort);
+	merge_pair(&sort, range_new(0, len_a), range_new(len_a, len_a + len_b));
+}
+
+void wikisort_merge(
+		void *base,
+		size_t len_a,
+		size_t len_b,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b))
+{
+	wikisort_trace_merge(base, len_a, len_b, itemsz, cmp, NULL);
+}
+
+void wikisort_trace(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		size_t *map) /* size: 'size' */
+{
+	sort_t sort;
+	sort_init(&sort, base, size, itemsz);
+	sort.cmp = cmp;
+	sort.map = (char*)map;
+	sort_run(&sort);
+}
+
+void wikisort(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b))
+{
+	sort_t sort;
+	sort_init(&sort, base, size, itemsz);
+	sort.cmp = cmp;
+	sort_run(&sort);
+}
+
+void wikisort_trace_r(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b, void *ctx),
+		void *ctx,
+		size_t *map) /* size: 'size' */
+{
+	sort_t sort;
+	sort_init(&sort, base, size, itemsz);
+	sort.cmp_r = cmp;
+	sort.ctx = ctx;
+	sort.map = (char*)map;
+	sort_run(&sort);
+}
+
+void wikisort_r(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b, void *ctx),
+		void *ctx)
+{
+	sort_t sort;
+	sort_init(&sort, base, size, itemsz);
+	sort.cmp_r = cmp;
+	sort.ctx = ctx;
+	sort_run(&sort);
+}
+
+void wikisort_trace_key(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		size_t keyoff,
+		size_t keysz,
+		int (*keycmp)(const void *a, const void *b, void *ctx),
+		void *ctx,
+		size_t *map) /* size: 'size' */
+{
+	sort_t sort;
+	sort_init(&sort, base, size, itemsz);
+	sort.cmp_r = keycmp;
+	sort.ctx = ctx;
+	sort.keyoff = keyoff;
+	sort.keysz = keysz;
+	sort.map = (char*)map;
+	sort_run(&sort);
+}
+
+void wikisort_key(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		size_t keyoff,
+		size_t keysz,
+		int (*keycmp)(const void *a, const void *b, void *ctx),
+		void *ctx)
+{
+	sort_t sort;
+	sort_init(&sort, base, size, itemsz);
+	sort.cmp_r = keycmp;
+	sort.ctx = ctx;
+	sort.keyoff = keyoff;
+	sort.keysz = keysz;
+	sort_run(&sort);
+}
+
+void wikisort_indirect(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		size_t *perm) /* size: 'size' */
+{
+	indirect_t indirect;
+	sort_t sort;
+	
+	/* sort the indices of the items, and then move each item only once */
+	indirect.base = base;
+	indirect.itemsz = itemsz;
+	indirect.cmp = cmp;
+	for(size_t i = 0; i < size; i++)
+		perm[i] = i;
+	sort_init(&sort, perm, size, sizeof(*perm));
+	sort.cmp_r = cmp_indirect;
+	sort.ctx = &indirect;
+	sort_run(&sort);
+	apply_permutation(base, size, itemsz, perm);
+}
+
+void wikisort_indirect_key(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		size_t keyoff,
+		size_t keysz,
+		int (*keycmp)(const void *a, const void *b, void *ctx),
+		void *ctx,
+		void *scratch, /* size: 'size' * WIKISORT_INDIRECT_ENTRYSZ('keysz') */
+		size_t *perm) /* size: 'size' */
+{
+	size_t entrysz = WIKISORT_INDIRECT_ENTRYSZ(keysz);
+	char *entries = scratch;
+	sort_t sort;
+	
+	/* sort the keys together with the indices of their items, so no comparison has to look at the items themselves */
+	for(size_t i = 0; i < size; i++) {
+		memcpy(entries + i * entrysz, &i, sizeof(i));
+		memcpy(entries + i * entrysz + sizeof(size_t), (char*)base + i * itemsz + keyoff, keysz);
+	}
+	sort_init(&sort, entries, size, entrysz);
+	sort.cmp_r = keycmp;
+	sort.ctx = ctx;
+	sort.keyoff = sizeof(size_t);
+	sort.keysz = keysz;
+	sort_run(&sort);
+	
+	for(size_t i = 0; i < size; i++)
+		memcpy(&perm[i], entries + i * entrysz, sizeof(*perm));
+	apply_permutation(base, size, itemsz, perm);
+}
+
+void wikisort_trace_stats(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		size_t *map, /* size: 'size' */
+		struct wikisort_stats *stats)
+{
+	stats_t counters;
+	sort_t sort;
+	sort_init(&sort, base, size, itemsz);
+	sort.cmp = cmp;
+	sort.map = (char*)map;
+	counters.out = stats;
+	sort.stats = &counters;
+	sort_run(&sort);
+}
+
+void wikisort_stats(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		struct wikisort_stats *stats)
+{
+	wikisort_trace_stats(base, size, itemsz, cmp, NULL, stats);
+}
+
+int wikisort_external(
+		const char *input,
+		const char *output,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		size_t memory,
+		const char *tmpdir,
+		int flags)
+{
+#ifndef WIKISORT_NO_FILES
+	external_t ext;
+	struct stat st;
+	int in, error;
+	
+	/* the memory needs to hold at least a block of two runs and of the output, twice */
+	if(itemsz == 0 || memory / itemsz < 6) {
+		errno = EINVAL;
+		return -1;
+	}
+	in = open(input, O_RDONLY);
+	if(in < 0)
+		return -1;
+	if(fstat(in, &st) != 0) {
+		error = errno;
+		close(in);
+		errno = error;
+		return -1;
+	}
+	if(st.st_size % itemsz != 0) {
+		close(in);
+		errno = EINVAL;
+		return -1;
+	}
+	
+	sort_init(&ext.sort, NULL, 0, itemsz);
+	ext.sort.cmp = cmp;
+	ext.itemsz = itemsz;
+	ext.memory_size = min(memory, max((size_t)st.st_size, 6 * itemsz));
+	ext.memory = malloc(ext.memory_size);
+	if(!ext.memory) {
+		close(in);
+		errno = ENOMEM;
+		return -1;
+	}
+	xio_init(&ext.reader, flags & WIKISORT_EXTERNAL_THREADS);
+	xio_init(&ext.writer, flags & WIKISORT_EXTERNAL_THREADS);
+	
+	error = external_sort(&ext, in, st.st_size / itemsz, output, tmpdir);
+	
+	xio_free(&ext.reader);
+	xio_free(&ext.writer);
+	free(ext.memory);
+	if(error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+#else
+	(void)input;
+	(void)output;
+	(void)itemsz;
+	(void)cmp;
+	(void)memory;
+	(void)tmpdir;
+	(void)flags;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int wikisort_file(
+		const char *path,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		int flags)
+{
+#ifndef WIKISORT_NO_FILES
+	sort_t sort;
+	struct stat st;
+	void *base;
+	int fd, error = 0;
+	
+	if(itemsz == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	fd = open(path, O_RDWR);
+	if(fd < 0)
+		return -1;
+	if(fstat(fd, &st) != 0) {
+		error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+	if(st.st_size % itemsz != 0 || (size_t)st.st_size != (uint64_t)st.st_size) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	if(st.st_size == 0)
+		return close(fd);
+	
+	base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(base == MAP_FAILED) {
+		error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+	
+	sort_init(&sort, base, st.st_size / itemsz, itemsz);
+	sort.cmp = cmp;
+	{
+		SORT_CACHE(&sort);
+		sort_prepare(&sort);
+		runsort_file(&sort, flags & WIKISORT_FILE_TILES ? FILE_TILE / itemsz : 0, sysconf(_SC_PAGESIZE));
+	}
+	
+	if(flags & WIKISORT_FILE_SYNC && msync(base, st.st_size, MS_SYNC) != 0)
+		error = errno;
+	munmap(base, st.st_size);
+	if(close(fd) != 0 && !error)
+		error = errno;
+	if(error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+#else
+	(void)path;
+	(void)itemsz;
+	(void)cmp;
+	(void)flags;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+void wikisort_trace_merge_runs(
+		const struct wikisort_run *runs, /* size: 'count' */
+		size_t count,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		void *out, /* size: total size of the runs * 'itemsz' */
+		struct wikisort_origin *origin, /* size: total size of the runs */
+		size_t *tree) /* size: 2 * 'count' */
+{
+	kway_merge(runs, count, itemsz, cmp, out, origin, NULL, NULL, tree);
+}
+
+void wikisort_merge_runs(
+		const struct wikisort_run *runs, /* size: 'count' */
+		size_t count,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		void *out, /* size: total size of the runs * 'itemsz' */
+		size_t *tree) /* size: 2 * 'count' */
+{
+	kway_merge(runs, count, itemsz, cmp, out, NULL, NULL, NULL, tree);
+}
+
+void wikisort_stream_runs(
+		const struct wikisort_run *runs, /* size: 'count' */
+		size_t count,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		void (*emit)(const void *item, size_t run, size_t index, void *ctx),
+		void *ctx,
+		size_t *tree) /* size: 2 * 'count' */
+{
+	kway_merge(runs, count, itemsz, cmp, NULL, NULL, emit, ctx, tree);
+}
+
+void wikisort_trace_typed(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		size_t keyoff,
+		int keytype,
+		size_t *map) /* size: 'size' */
+{
+	sort_t sort;
+	sort_init(&sort, base, size, itemsz);
+	sort_typed(&sort, keyoff, keytype);
+	sort.map = (char*)map;
+	sort_run(&sort);
+}
+
+void wikisort_typed(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		size_t keyoff,
+		int keytype)
+{
+	sort_t sort;
+	sort_init(&sort, base, size, itemsz);
+	sort_typed(&sort, keyoff, keytype);
+	sort_run(&sort);
+}
+
+void wikisort_prefix(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		uint64_t (*prefix)(const void *item),
+		size_t *prefixes)
+{
+	/* where size_t has fewer bits, the upper bits of the prefixes still order the items the same way */
+	unsigned shift = sizeof(size_t) * CHAR_BIT < 64 ? 64 - sizeof(size_t) * CHAR_BIT : 0;
+	sort_t sort;
+	sort_init(&sort, base, size, itemsz);
+	sort.cmp = cmp;
+	sort.map = (char*)prefixes;
+	sort.seeded = true;
+	sort.prefixed = true;
+	for(size_t i = 0; i < size; i++)
+		prefixes[i] = prefix((const char*)base + i * itemsz) >> shift;
+	sort_run(&sort);
+}
+
+/* the number of bytes from 'depth' on which all of the strings share with the first one */
+static size_t strings_lcp(
+		const char **base,
+		size_t size,
+		size_t depth)
+{
+	const char *first = base[0] + depth;
+	size_t lcp = SIZE_MAX;
+	for(size_t i = 1; i < size && lcp > 0; i++) {
+		const char *s = base[i] + depth;
+		size_t length = 0;
+		while(length < lcp && first[length] && first[length] == s[length])
+			length++;
+		lcp = length;
+	}
+	return lcp;
+}
+
+/* sort strings which share their first 'depth' bytes. they are sorted by the prefixes behind their common bytes, then */
+/* each run of equal prefixes which doesn't end the strings is sorted by the bytes behind them. only the smaller runs */
+/* recurse, and the largest one is sorted by the loop, so the recursion stays within log2(size) */
+static void strings_sort(
+		const char **base,
+		size_t size,
+		size_t *prefixes,
+		size_t depth)
+{
+	while(size > 1) {
+		size_t largest = 0, largest_size = 0;
+		sort_t sort;
+		depth += strings_lcp(base, size, depth);
+		sort_init(&sort, base, size, sizeof(*base));
+		sort.map = (char*)prefixes;
+		sort.seeded = true;
+		sort.prefixed = true;
+		sort.strings = true;
+		sort.depth = depth;
+		for(size_t i = 0; i < size; i++)
+			prefixes[i] = string_prefix(base[i], depth);
+		sort_run(&sort);
+
+		for(size_t start = 0, end; start < size; start = end) {
+			for(end = start + 1; end < size && prefixes[end] == prefixes[start]; end++);
+			if(end - start < 2 || (prefixes[start] & UCHAR_MAX) == 0)
+				continue;
+			if(end - start > largest_size) {
+				if(largest_size > 0)
+					strings_sort(base + largest, largest_size, prefixes + largest, depth + sizeof(size_t));
+				largest = start;
+				largest_size = end - start;
+			}
+			else
+				strings_sort(base + start, end - start, prefixes + start, depth + sizeof(size_t));
+		}
+		base += largest;
+		prefixes += largest;
+		size = largest_size;
+		depth += sizeof(size_t);
+	}
+}
+
+void wikisort_strings(
+		const char **base,
+		size_t size,
+		size_t *prefixes)
+{
+	strings_sort(base, size, prefixes, 0);
+}
+
+void wikisort_segmented(
+		void *base,
+		const size_t *offsets,
+		size_t nsegs,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b))
+{
+	sort_t sort;
+	sort_init(&sort, base, nsegs > 0 ? offsets[nsegs] : 0, itemsz);
+	sort.cmp = cmp;
+	SORT_CACHE(&sort);
+	mover_init(&sort);
+	segments_sort(&sort, offsets, range_new(0, nsegs));
+}
+
+struct wikisort_ctx *wikisort_ctx_new(
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		size_t nthreads)
+{
+	struct wikisort_ctx *ctx = malloc(sizeof(*ctx));
+	if(!ctx)
+		return NULL;
+	sort_init(&ctx->sort, NULL, 0, itemsz);
+	ctx->sort.cmp = cmp;
+	ctx->sort.cache_size = default_cache_size(itemsz);
+	ctx->sort.cache = malloc(max(ctx->sort.cache_size * itemsz, 1));
+	if(!ctx->sort.cache) {
+		free(ctx);
+		return NULL;
+	}
+	mover_init(&ctx->sort);
+	ctx->nthreads = nthreads;
+	ctx->threaded = false;
+#ifndef WIKISORT_NO_THREADS
+	if(nthreads > 1)
+		ctx->threaded = pool_init(&ctx->pool, &ctx->sort, nthreads);
+#endif
+	return ctx;
+}
+
+void wikisort_ctx_free(
+		struct wikisort_ctx *ctx)
+{
+	if(!ctx)
+		return;
+#ifndef WIKISORT_NO_THREADS
+	if(ctx->threaded)
+		pool_free(&ctx->pool);
+#endif
+	free(ctx->sort.cache);
+	free(ctx);
+}
+
+void wikisort_ctx_sort(
+		struct wikisort_ctx *ctx,
+		void *base,
+		size_t size)
+{
+	sort_t sort = ctx->sort;
+	sort.array = base;
+	sort.size = size;
+#ifndef WIKISORT_NO_THREADS
+	if(ctx->threaded && size / PARALLEL_MIN >= 2) {
+		ctx->pool.sort = &sort;
+		runsort_pool(&ctx->pool, min(ctx->nthreads, size / PARALLEL_MIN));
+		return;
+	}
+#endif
+	runsort(&sort);
+}
+
+void wikisort_ctx_segmented(
+		struct wikisort_ctx *ctx,
+		void *base,
+		const size_t *offsets,
+		size_t nsegs)
+{
+	sort_t sort = ctx->sort;
+	sort.array = base;
+	sort.size = nsegs > 0 ? offsets[nsegs] : 0;
+#ifndef WIKISORT_NO_THREADS
+	if(ctx->threaded && sort.size - offsets[0] >= 2 * PARALLEL_MIN) {
+		segments_parallel(&ctx->pool, &sort, offsets, nsegs, ctx->nthreads);
+		return;
+	}
+#endif
+	segments_sort(&sort, offsets, range_new(0, nsegs));
+}
+
+static void job_push(
+		struct wikisort_job *job,
+		range_t A,
+		range_t B,
+		bool reverse)
+{
+	assert(job->ntasks < JOB_TASKS);
+	job->tasks[job->ntasks].A = A;
+	job->tasks[job->ntasks].B = B;
+	job->tasks[job->ntasks].reverse = reverse;
+	job->ntasks++;
+}
+
+/* reverse the outer pairs of items of the range, as many as the budget allows, and leave the inner ones as a new task. */
+/* a swap takes about a quarter of the time of merging an item, so a pair counts as half an item */
+static size_t job_reverse(
+		struct wikisort_job *job,
+		range_t range,
+		size_t budget)
+{
+	const sort_t *sort = &job->sort;
+	size_t count = min(range_length(range) / 2, max(min(budget, SIZE_MAX / 2) * 2, 1));
+	for(size_t index = 0; index < count; index++)
+		swap_aa(sort, ARRAY(range.start + index), ARRAY(range.end - 1 - index));
+	if(range_length(range) - 2 * count > 1)
+		job_push(job, range_new(range.start + count, range.end - count), range_new(0, 0), true);
+	return count / 2;
+}
+
+/* merge A and B if they fit into the budget, otherwise split them into two independent pairs. the upper part of A */
+/* is rotated behind the lower part of B by three reversals, which are done first */
+static size_t job_merge(
+		struct wikisort_job *job,
+		range_t A,
+		range_t B,
+		size_t budget)
+{
+	const sort_t *sort = &job->sort;
+	size_t a, b, lower_B;
+	if(range_length(A) == 0 || range_length(B) == 0 || CMP(B.start, A.end - 1) >= 0)
+		return 1;
+	if(range_length(A) + range_length(B) <= budget) {
+		merge_pair(sort, A, B);
+		return range_length(A) + range_length(B);
+	}
+	
+	if(range_length(A) >= range_length(B)) {
+		a = A.start + range_length(A) / 2;
+		b = BinaryFirst(sort, ARRAY(a), B);
+	}
+	else {
+		b = B.start + range_length(B) / 2;
+		a = BinaryLast(sort, ARRAY(b), A);
+	}
+	lower_B = b - B.start;
+	job_push(job, range_new(a + lower_B, b), range_new(b, B.end), false);
+	job_push(job, range_new(A.start, a), range_new(a, a + lower_B), false);
+	job_push(job, range_new(a, b), range_new(0, 0), true);
+	job_push(job, range_new(A.end, b), range_new(0, 0), true);
+	job_push(job, range_new(a, A.end), range_new(0, 0), true);
+	return 1;
+}
+
+/* do the next piece of work, and return how many items it merged, or the equivalent of that for the other work */
+static size_t job_work(
+		struct wikisort_job *job,
+		size_t budget)
+{
+	range_t range;
+	if(job->ntasks > 0) {
+		task_t task = job->tasks[--job->ntasks];
+		if(task.reverse)
+			return job_reverse(job, task.A, budget);
+		return job_merge(job, task.A, task.B, budget);
+	}
+	
+	if(iter_finished(&job->iter)) {
+		/* the chunks are merged in pairs first, then double the size of each A and B subarray that will be merged in the next level */
+		if(job->merging)
+			iter_nextLevel(&job->iter);
+		if(iter_length(&job->iter) >= job->sort.size) {
+			job->done = true;
+			return 0;
+		}
+		job->merging = true;
+		job->level++;
+		iter_begin(&job->iter);
+	}
+	
+	job->finished = job->iter.decimal;
+	range = iter_nextRange(&job->iter);
+	if(!job->merging) {
+		/* sorting a chunk takes about as long as 4 merges of it */
+		sort_range(&job->sort, range);
+		return 4 * range_length(range);
+	}
+	return job_merge(job, range, iter_nextRange(&job->iter), budget);
+}
+
+struct wikisort_job *wikisort_begin(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b))
+{
+	struct wikisort_job *job = malloc(sizeof(*job));
+	iter_t last;
+	if(!job)
+		return NULL;
+	sort_init(&job->sort, base, size, itemsz);
+	job->sort.cmp = cmp;
+	job->sort.cache = job->cache;
+	job->sort.cache_size = default_cache_size(itemsz);
+	mover_init(&job->sort);
+	job->merging = job->done = false;
+	job->level = job->finished = job->ntasks = 0;
+	job->levels = 1;
+	
+	/* the iterator can't split fewer than 4 items, so those are sorted as a single chunk */
+	if(size < 4) {
+		job->iter.size = size;
+		job->iter.decimal_step = size;
+		job->iter.numerator_step = 0;
+		job->iter.denominator = 1;
+		iter_begin(&job->iter);
+		return job;
+	}
+	job->iter = iter_new(size, 4);
+	for(last = job->iter; iter_length(&job->iter) < RUN_MIN && iter_nextLevel(&last); job->iter = last);
+	iter_begin(&job->iter);
+	for(last = job->iter; iter_length(&last) < size; iter_nextLevel(&last))
+		job->levels++;
+	return job;
+}
+
+double wikisort_step(
+		struct wikisort_job *job,
+		size_t budget)
+{
+	size_t work = 0;
+	while(!job->done && work < budget)
+		work += job_work(job, budget - work);
+	if(job->done)
+		return 1;
+	return (job->level + (double)job->finished / job->sort.size) / job->levels;
+}
+
+void wikisort_finish(
+		struct wikisort_job *job)
+{
+	while(!job->done)
+		job_work(job, SIZE_MAX);
+	free(job);
+}
+
+void wikisort_cancel(
+		struct wikisort_job *job)
+{
+	free(job);
+}
+
+void wikisort_trace_map(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		void *map,
+		void *inverse,
+		int flags)
+{
+	sort_t sort;
+	sort_init(&sort, base, size, itemsz);
+	sort.cmp = cmp;
+	sort.map = map;
+	sort.mapsz = flags & WIKISORT_MAP32 ? sizeof(uint32_t) : sizeof(size_t);
+	sort.seeded = (flags & WIKISORT_MAP_SEEDED) != 0;
+	assert(!(flags & WIKISORT_MAP32) || size <= UINT32_MAX);
+	sort_run(&sort);
+	if(inverse)
+		for(size_t i = 0; i < size; i++)
+			map_set(&sort, inverse, map_get(&sort, sort.map, i), i);
+}
@@ -1,3 +1,5 @@
+#include <stdint.h>
+
 void wikisort_trace(
 		void *base,
 		size_t size,
@@ -11,3 +13,362 @@ void wikisort(
 		size_t itemsz,
 		int (*cmp)(const void *a, const void *b));
 
+
+/* same as above, but use the caller-supplied 'cache' of 'cache_size' items to speed up merging.
+ * any cache size is allowed, including 0. wikisort() and wikisort_trace() use a small default cache on the stack. */
+void wikisort_trace_cached(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		size_t *map, /* size: 'size' */
+		void *cache, /* size: 'cache_size' * 'itemsz' */
+		size_t *cachemap, /* size: 'cache_size' */
+		size_t cache_size);
+
+void wikisort_cached(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		void *cache, /* size: 'cache_size' * 'itemsz' */
+		size_t cache_size);
+
+/* same as wikisort(), but sort with up to 'nthreads' threads. still stable and without any extra memory except
+ * for a few bytes per thread. needs to be linked with -pthread, or compiled with WIKISORT_NO_THREADS to always sort
+ * on the calling thread. */
+void wikisort_parallel(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		size_t nthreads);
+
+/* same as wikisort_trace() and wikisort(), but 'ctx' is passed to every call of 'cmp' */
+void wikisort_trace_r(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b, void *ctx),
+		void *ctx,
+		size_t *map); /* size: 'size' */
+
+void wikisort_r(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b, void *ctx),
+		void *ctx);
+
+/* sort by the key of 'keysz' bytes at offset 'keyoff' within each item. 'keycmp' gets pointers to the keys
+ * instead of the items. if 'keycmp' is NULL, the keys are compared with memcmp() */
+void wikisort_trace_key(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		size_t keyoff,
+		size_t keysz,
+		int (*keycmp)(const void *a, const void *b, void *ctx),
+		void *ctx,
+		size_t *map); /* size: 'size' */
+
+void wikisort_key(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		size_t keyoff,
+		size_t keysz,
+		int (*keycmp)(const void *a, const void *b, void *ctx),
+		void *ctx);
+
+/* sort large items indirectly: sort their indices first, then move every item only once.
+ * afterwards 'perm' holds the same as 'map' of wikisort_trace() */
+void wikisort_indirect(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		size_t *perm); /* size: 'size' */
+
+/* same as above, but sort by the key at 'keyoff' (see wikisort_key()), which is copied into 'scratch' next to
+ * the index of each item */
+#define WIKISORT_INDIRECT_ENTRYSZ(keysz) \
+	(sizeof(size_t) + ((keysz) + sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t))
+
+void wikisort_indirect_key(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		size_t keyoff,
+		size_t keysz,
+		int (*keycmp)(const void *a, const void *b, void *ctx),
+		void *ctx,
+		void *scratch, /* size: 'size' * WIKISORT_INDIRECT_ENTRYSZ('keysz') */
+		size_t *perm); /* size: 'size' */
+
+/* statistics about the merges of a single level, see struct wikisort_stats */
+struct wikisort_stats_level {
+	size_t merges; /* number of times a level of this size was merged */
+	size_t length; /* length of the A subarrays */
+	size_t block_size; /* size of the A blocks, 0 if the merges only used the cache */
+	size_t buffer1, buffer2; /* sizes of the two internal buffers */
+	size_t skipped; /* A+B pairs which were already in order */
+	size_t rotated; /* A+B pairs which were in reverse order */
+	size_t merged_external; /* A+B pairs merged with the help of the cache */
+	size_t merged_internal; /* A+B pairs merged with the help of the second internal buffer */
+	size_t merged_inplace; /* A+B pairs merged without a buffer, because there weren't enough unique values */
+	double pull_time, merge_time, redistribute_time; /* seconds spent pulling out the buffers, merging and redistributing the buffers */
+};
+
+#define WIKISORT_STATS_LEVELS 64
+
+/* statistics filled by the *_stats() functions. set 'timing' to measure the processor time of each phase as well,
+ * all other fields are overwritten by the sort */
+struct wikisort_stats {
+	int timing;
+	size_t compares; /* calls of the comparator */
+	size_t moves; /* items copied */
+	size_t swaps; /* items swapped */
+	size_t rotations; /* rotations, and the total number of items rotated */
+	size_t rotated;
+	size_t levels; /* levels of merges */
+	double presort_time; /* seconds spent looking for natural runs and sorting the first small groups of items */
+	double total_time;
+	struct wikisort_stats_level level[WIKISORT_STATS_LEVELS]; /* level[i] is about merges where A has 2^i to 2^(i+1)-1 items */
+};
+
+/* same as wikisort_trace() and wikisort(), but fill 'stats'. sorting without statistics doesn't cost anything extra */
+void wikisort_trace_stats(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		size_t *map, /* size: 'size' */
+		struct wikisort_stats *stats);
+
+void wikisort_stats(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		struct wikisort_stats *stats);
+
+/* move the 'k' smallest items to the front of the array, sorted just like wikisort() would sort them.
+ * the rest of the array is left in no particular order. takes O(n log k) time, and only about n comparisons
+ * if k is much smaller than n and the input is random or already sorted */
+void wikisort_topk(
+		void *base,
+		size_t size,
+		size_t k,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b));
+
+/* merge the two sorted ranges of 'len_a' and 'len_b' items at the start of the array, stably and without extra memory.
+ * takes O(n) time, and only one or two comparisons if all of B belongs behind or before all of A */
+void wikisort_trace_merge(
+		void *base,
+		size_t len_a,
+		size_t len_b,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		size_t *map); /* size: 'len_a' + 'len_b' */
+
+void wikisort_merge(
+		void *base,
+		size_t len_a,
+		size_t len_b,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b));
+
+/* flags for wikisort_external() */
+#define WIKISORT_EXTERNAL_THREADS 1 /* read ahead and write behind on two threads of their own, needs -pthread */
+
+/* sort a file of items of 'itemsz' bytes which may be much larger than the memory into the file 'output', using at most
+ * 'memory' bytes plus a bit of bookkeeping. chunks of the file which fit into memory are sorted and written into a temporary
+ * file in 'tmpdir' (or $TMPDIR, or /tmp if NULL) as runs, which are then merged stably. 'input' and 'output' may be the same
+ * file. returns 0, or -1 and sets errno. not available if compiled with WIKISORT_NO_FILES */
+int wikisort_external(
+		const char *input,
+		const char *output,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		size_t memory,
+		const char *tmpdir,
+		int flags);
+
+/* flags for wikisort_file() */
+#define WIKISORT_FILE_TILES 1 /* sort cache-sized tiles of the file first, which saves a few sweeps over the whole file */
+#define WIKISORT_FILE_SYNC 2 /* write the sorted file back to the disk before returning */
+
+/* sort a file of items of 'itemsz' bytes in place, by mapping it into memory. tells the kernel which pages each level
+ * of merges will need next and which ones it is done with, so files much larger than the memory stay usable.
+ * returns 0, or -1 and sets errno. not available if compiled with WIKISORT_NO_FILES */
+int wikisort_file(
+		const char *path,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		int flags);
+
+/* a sorted run for wikisort_merge_runs() */
+struct wikisort_run {
+	const void *base;
+	size_t size;
+};
+
+/* where an item of the output of wikisort_trace_merge_runs() came from: item 'index' of run 'run' */
+struct wikisort_origin {
+	size_t run;
+	size_t index;
+};
+
+/* merge 'count' sorted runs into 'out' with a loser tree, which takes about log2('count') comparisons per item.
+ * equal items keep the order of their runs. 'tree' is scratch space for the loser tree */
+void wikisort_trace_merge_runs(
+		const struct wikisort_run *runs, /* size: 'count' */
+		size_t count,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		void *out, /* size: total size of the runs * 'itemsz' */
+		struct wikisort_origin *origin, /* size: total size of the runs */
+		size_t *tree); /* size: 2 * 'count' */
+
+void wikisort_merge_runs(
+		const struct wikisort_run *runs, /* size: 'count' */
+		size_t count,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		void *out, /* size: total size of the runs * 'itemsz' */
+		size_t *tree); /* size: 2 * 'count' */
+
+/* same as above, but pass each item in sorted order to 'emit' instead, which gets its origin and 'ctx' as well */
+void wikisort_stream_runs(
+		const struct wikisort_run *runs, /* size: 'count' */
+		size_t count,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		void (*emit)(const void *item, size_t run, size_t index, void *ctx),
+		void *ctx,
+		size_t *tree); /* size: 2 * 'count' */
+
+/* key types for wikisort_typed(). floats are ordered by value, except that -0 comes before +0 and NaNs are placed
+ * at both ends depending on their sign bit */
+#define WIKISORT_U32 1
+#define WIKISORT_I32 2
+#define WIKISORT_F32 3
+#define WIKISORT_U64 4
+#define WIKISORT_I64 5
+#define WIKISORT_F64 6
+
+/* sort by the integer or floating point key of type 'keytype' at offset 'keyoff' within each item, the rest of the item
+ * is carried along. same as wikisort_key() with a matching 'keycmp', but small groups of items are sorted with SSE4.2
+ * or AVX2 sorting networks first if the processor has them, unless compiled with WIKISORT_NO_SIMD. items of 4, 8 or 16
+ * bytes are merged without calls and branches, and arrays of bare keys with AVX2 */
+void wikisort_trace_typed(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		size_t keyoff,
+		int keytype,
+		size_t *map); /* size: 'size' */
+
+void wikisort_typed(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		size_t keyoff,
+		int keytype);
+
+/* same as wikisort(), but 'cmp' is only called for items with equal prefixes. 'prefix' turns an item into an integer which
+ * orders the items like 'cmp' as far as it goes, so items with a smaller prefix have to compare as smaller. e.g. the first
+ * 8 bytes of a string key in big endian byte order. the prefixes are kept in 'prefixes' and move along with the items,
+ * where size_t has less than 64 bits only their upper bits are kept */
+void wikisort_prefix(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		uint64_t (*prefix)(const void *item),
+		size_t *prefixes); /* size: 'size' */
+
+/* sort an array of strings stably in the order of strcmp(). the bytes which all of the strings share are skipped, and
+ * the next few bytes of each string are kept in 'prefixes' next to the pointers, so most comparisons don't read the
+ * strings at all. strings with equal prefixes are sorted by the bytes behind them afterwards */
+void wikisort_strings(
+		const char **base,
+		size_t size,
+		size_t *prefixes); /* size: 'size' */
+
+/* sort 'nsegs' arrays which lie back to back in 'base', each on its own. segment i holds the items from index offsets[i]
+ * up to offsets[i + 1]. same as calling wikisort() for each segment, but the sort is only set up once.
+ * wikisort_ctx_segmented() spreads the segments across threads as well */
+void wikisort_segmented(
+		void *base,
+		const size_t *offsets, /* size: 'nsegs' + 1 */
+		size_t nsegs,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b));
+
+/* a context for repeated sorts with the same item size and comparator, which sets up the sort and its cache once.
+ * with 'nthreads' > 1 it keeps a pool of threads, which large arrays and many segments are spread across.
+ * a context must not be used by several threads at once. returns NULL if out of memory */
+struct wikisort_ctx *wikisort_ctx_new(
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		size_t nthreads);
+
+void wikisort_ctx_free(
+		struct wikisort_ctx *ctx);
+
+/* same as wikisort() */
+void wikisort_ctx_sort(
+		struct wikisort_ctx *ctx,
+		void *base,
+		size_t size);
+
+/* same as wikisort_segmented() */
+void wikisort_ctx_segmented(
+		struct wikisort_ctx *ctx,
+		void *base,
+		const size_t *offsets, /* size: 'nsegs' + 1 */
+		size_t nsegs);
+
+/* an incremental sort, for callers which can't block for a whole sort */
+struct wikisort_job;
+
+/* start sorting the array in steps of bounded work. nothing is sorted until the first step. returns NULL if out of memory */
+struct wikisort_job *wikisort_begin(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b));
+
+/* do about as much work as merging 'budget' items takes. merges which are larger than the budget are split into smaller
+ * ones first, so a step only goes over it by sorting one of the first chunks of up to 64 items. the array is a permutation
+ * of its items after every step. returns the progress from 0 to 1, which is 1 once the array is sorted */
+double wikisort_step(
+		struct wikisort_job *job,
+		size_t budget);
+
+/* do the rest of the sort at once, and free the job */
+void wikisort_finish(
+		struct wikisort_job *job);
+
+/* stop the sort and free the job. the array is left in the order of the last step */
+void wikisort_cancel(
+		struct wikisort_job *job);
+
+/* flags for wikisort_trace_map() */
+#define WIKISORT_MAP32 1 /* 'map' and 'inverse' hold uint32_t instead of size_t, which needs 'size' <= UINT32_MAX */
+#define WIKISORT_MAP_SEEDED 2 /* 'map' is filled in by the caller instead of with the original indices */
+
+/* same as wikisort_trace(), with more control over the map. a seeded map keeps the entries the caller put in, which move
+ * along with their items, so the map of an earlier sort of the array continues through this one. 'inverse' gets the
+ * position every item ended up at, so inverse[map[i]] == i, which needs the seeds to be below 'size'. it may be NULL */
+void wikisort_trace_map(
+		void *base,
+		size_t size,
+		size_t itemsz,
+		int (*cmp)(const void *a, const void *b),
+		void *map, /* size: 'size' entries */
+		void *inverse, /* size: 'size' entries */
+		int flags);
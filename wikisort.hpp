@@ -0,0 +1,1341 @@
+/* header-only C++ front end of the sort.
+ *
+ *   wikisort::stable_sort(first, last);
+ *   wikisort::stable_sort(first, last, comp);
+ *   wikisort::stable_sort(first, last, comp, proj);
+ *   wikisort::stable_sort_trace(first, last, map, comp, proj);
+ *
+ * sort the random-access range [first, last) stably by comp(proj(a), proj(b)), which defaults to proj(a) < proj(b).
+ * unlike wikisort(), items are moved with std::move() and swapped with std::iter_swap(), so types which can't be copied
+ * with memcpy() (std::string, std::unique_ptr or structs holding them) can be sorted, and the comparison is inlined.
+ * stable_sort_trace() fills 'map' like wikisort_trace() does.
+ *
+ * nothing is allocated: besides a cache of at most 16kb of items on the stack the sort works in place, whereas
+ * std::stable_sort() needs a buffer of n/2 items and falls back to an O(n log^2 n) merge if it can't get one.
+ * if 'comp', 'proj' or a move throws, the range is left in an unspecified order. needs C++11. */
+
+#ifndef WIKISORT_HPP
+#define WIKISORT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <climits>
+#include <iterator>
+#include <new>
+#include <utility>
+#include <algorithm>
+
+namespace wikisort {
+
+/* the default comparison */
+struct less {
+	template<class A, class B>
+	bool operator()(
+			const A &a,
+			const B &b) const
+	{
+		return a < b;
+	}
+};
+
+/* the default projection, which compares the items themselves */
+struct identity {
+	template<class T>
+	T &&operator()(
+			T &&value) const
+	{
+		return std::forward<T>(value);
+	}
+};
+
+namespace detail {
+
+/* number of items in the stack cache, capped to 16kb like WIKISORT_IMPL_CACHE_SIZE() */
+template<class T>
+struct cache_size {
+	static const std::size_t value = sizeof(T) * 512 <= 16384 ? 512 : 16384 / sizeof(T);
+};
+
+/* natural runs shorter than this are extended by an insertion sort before merging them */
+static const std::size_t run_min = 32;
+
+/* rotate() follows the permutation cycles instead of block swapping if the shorter side is smaller than this many bytes */
+static const std::size_t rotate_cycles_bytes = 64;
+
+/* structure to represent ranges within the array */
+struct range {
+	std::size_t start;
+	std::size_t end;
+};
+
+/* calculate how to scale the index value to the range within the array */
+/* the bottom-up merge sort only operates on values that are powers of two, */
+/* so scale down to that power of two, then use a fraction to scale back again */
+struct iter {
+	std::size_t size, power_of_two;
+	std::size_t numerator, decimal;
+	std::size_t denominator, decimal_step, numerator_step;
+};
+
+/* the A+B pairs merged at once: either all pairs of a level of the iterator, or a single pair */
+struct level {
+	iter *it;
+	range A, B;
+	std::size_t length;
+	bool done;
+};
+
+inline std::size_t pow2_floor(
+		std::size_t x)
+{
+	for(std::size_t i = 1; i < sizeof(x) * CHAR_BIT; i <<= 1)
+		x |= x >> i;
+	return x - (x >> 1);
+}
+
+inline std::size_t isqrt(
+		std::size_t x)
+{
+	std::size_t op = x, res = 0, one;
+
+	/* "one" starts at the highest power of four <= than the argument. */
+	one = (std::size_t)1 << (sizeof(x) * CHAR_BIT - 2);
+	while(one > op)
+		one >>= 2;
+
+	while(one != 0) {
+		if(op >= res + one) {
+			op -= res + one;
+			res += one << 1;
+		}
+		res >>= 1;
+		one >>= 2;
+	}
+	return res;
+}
+
+inline std::size_t range_length(
+		range r)
+{
+	return r.end - r.start;
+}
+
+inline range range_new(
+		std::size_t start,
+		std::size_t end)
+{
+	range r;
+	r.start = start;
+	r.end = end;
+	return r;
+}
+
+inline void iter_begin(
+		iter *me)
+{
+	me->numerator = me->decimal = 0;
+}
+
+inline range iter_nextRange(
+		iter *me)
+{
+	std::size_t start = me->decimal;
+
+	me->decimal += me->decimal_step;
+	me->numerator += me->numerator_step;
+	if(me->numerator >= me->denominator) {
+		me->numerator -= me->denominator;
+		me->decimal++;
+	}
+	return range_new(start, me->decimal);
+}
+
+inline bool iter_finished(
+		iter *me)
+{
+	return me->decimal >= me->size;
+}
+
+inline bool iter_nextLevel(
+		iter *me)
+{
+	me->decimal_step += me->decimal_step;
+	me->numerator_step += me->numerator_step;
+	if(me->numerator_step >= me->denominator) {
+		me->numerator_step -= me->denominator;
+		me->decimal_step++;
+	}
+
+	return me->decimal_step < me->size;
+}
+
+inline std::size_t iter_length(
+		iter *me)
+{
+	return me->decimal_step;
+}
+
+inline iter iter_new(
+		std::size_t size2,
+		std::size_t min_level)
+{
+	iter me;
+	me.size = size2;
+	me.power_of_two = pow2_floor(me.size);
+	me.denominator = me.power_of_two / min_level;
+	me.numerator_step = me.size % me.denominator;
+	me.decimal_step = me.size / me.denominator;
+	return me;
+}
+
+inline level level_new(
+		iter *it)
+{
+	level me;
+	me.it = it;
+	me.length = iter_length(it);
+	return me;
+}
+
+inline level level_pair(
+		range A,
+		range B)
+{
+	level me;
+	me.it = NULL;
+	me.A = A;
+	me.B = B;
+	me.length = range_length(A);
+	return me;
+}
+
+inline void level_begin(
+		level *me)
+{
+	if(me->it)
+		iter_begin(me->it);
+	else
+		me->done = false;
+}
+
+/* get the next A+B pair, returns false if there are no more pairs */
+inline bool level_next(
+		level *me,
+		range *A,
+		range *B)
+{
+	if(me->it) {
+		if(iter_finished(me->it))
+			return false;
+		*A = iter_nextRange(me->it);
+		*B = iter_nextRange(me->it);
+		return true;
+	}
+	else if(me->done)
+		return false;
+	*A = me->A;
+	*B = me->B;
+	me->done = true;
+	return true;
+}
+
+/* power of the node between two neighboring runs, for the merge policy of powersort, see wikisort.c */
+inline unsigned node_power(
+		std::size_t size,
+		std::size_t start1,
+		std::size_t length1,
+		std::size_t length2)
+{
+	std::size_t a = start1 + start1 + length1;
+	std::size_t b = a + length1 + length2;
+	unsigned power = 0;
+	for(;;) {
+		power++;
+		if(a >= size) {
+			a -= size;
+			b -= size;
+		}
+		else if(b >= size)
+			break;
+		a <<= 1;
+		b <<= 1;
+	}
+	return power;
+}
+
+/* the sort itself, a one-to-one translation of runsort() in wikisort.c, see there for the details.
+ * TRACE is a constant and decides whether 'map' is updated. the cache holds raw storage for 'cache_size' items,
+ * which are move constructed into it and destroyed again as soon as they are moved back */
+template<class It, class Comp, class Proj, bool TRACE>
+class sorter {
+public:
+	typedef typename std::iterator_traits<It>::value_type value_type;
+
+	sorter(
+			It array,
+			std::size_t size,
+			std::size_t *map,
+			Comp &comp,
+			Proj &proj,
+			value_type *cache,
+			std::size_t *cachemap,
+			std::size_t cache_size)
+		: array(array), size(size), map(map), comp(comp), proj(proj),
+		  cache(cache), cachemap(cachemap), cache_size(cache_size), cached(0)
+	{
+	}
+
+	~sorter()
+	{
+		cache_free();
+	}
+
+	void runsort();
+
+private:
+	It array;
+	std::size_t size;
+	std::size_t *map;
+	Comp &comp;
+	Proj &proj;
+
+	value_type *cache;
+	std::size_t *cachemap;
+	std::size_t cache_size;
+	std::size_t cached; /* number of items constructed in the cache */
+
+	sorter(const sorter&);
+	sorter &operator=(const sorter&);
+
+	bool less(
+			const value_type &a,
+			const value_type &b)
+	{
+		return comp(proj(a), proj(b));
+	}
+
+	bool less_aa(
+			std::size_t a,
+			std::size_t b)
+	{
+		return less(array[a], array[b]);
+	}
+
+	/* move an element within the array */
+	void move_aa(
+			std::size_t a,
+			std::size_t b)
+	{
+		if(TRACE)
+			map[a] = map[b];
+		array[a] = std::move(array[b]);
+	}
+
+	/* swap two elements in the array */
+	void swap_aa(
+			std::size_t a,
+			std::size_t b)
+	{
+		std::iter_swap(array + a, array + b);
+		if(TRACE)
+			std::swap(map[a], map[b]);
+	}
+
+	/* swap a series of values in the array. the series may overlap, in which case they are swapped from front to back */
+	void blockswap_aa(
+			std::size_t a,
+			std::size_t b,
+			std::size_t n)
+	{
+		for(std::size_t i = 0; i < n; i++)
+			swap_aa(a + i, b + i);
+	}
+
+	/* move a series of values within the array, the source and destination may overlap */
+	void move_range(
+			std::size_t to,
+			std::size_t from,
+			std::size_t len)
+	{
+		if(to < from) {
+			std::move(array + from, array + from + len, array + to);
+			if(TRACE)
+				std::copy(map + from, map + from + len, map + to);
+		}
+		else if(to > from) {
+			std::move_backward(array + from, array + from + len, array + to + len);
+			if(TRACE)
+				std::copy_backward(map + from, map + from + len, map + to + len);
+		}
+	}
+
+	/* move a range of values from the array into the cache */
+	void cache_store(
+			range r)
+	{
+		for(std::size_t i = r.start; i < r.end; i++) {
+			::new(static_cast<void*>(cache + cached)) value_type(std::move(array[i]));
+			if(TRACE)
+				cachemap[cached] = map[i];
+			cached++;
+		}
+	}
+
+	/* destroy the items in the cache, which have been moved back into the array already */
+	void cache_free()
+	{
+		for(std::size_t i = 0; i < cached; i++)
+			cache[i].~value_type();
+		cached = 0;
+	}
+
+	/* move the values from the cache back into the array */
+	void cache_load(
+			std::size_t start)
+	{
+		std::move(cache, cache + cached, array + start);
+		if(TRACE)
+			std::copy(cachemap, cachemap + cached, map + start);
+		cache_free();
+	}
+
+	std::size_t BinaryFirst(const value_type &value, range r);
+	std::size_t BinaryLast(const value_type &value, range r);
+	std::size_t FindFirstForward(const value_type &value, range r, std::size_t unique);
+	std::size_t FindLastForward(const value_type &value, range r, std::size_t unique);
+	std::size_t FindFirstBackward(const value_type &value, range r, std::size_t unique);
+	std::size_t FindLastBackward(const value_type &value, range r, std::size_t unique);
+	void InsertionSort(range r);
+	void reverse(range r);
+	void rotate_cycles(std::size_t amount, range r);
+	void rotate_blocks(std::size_t amount, range r);
+	void rotate(std::size_t amount, range r, std::size_t cache_size);
+	void MergeExternal(range A, range B);
+	void MergeInternal(range A, range B, range buffer);
+	void MergeInPlace(range A, range B);
+	void merge_level(level *lvl);
+	void merge_pair(range A, range B);
+	std::size_t natural_run(std::size_t start);
+	bool natural_sort();
+	void swapif(std::size_t start, std::uint8_t *order, std::size_t x, std::size_t y);
+};
+
+/* find the index of the first value within the range that is equal to array[index] */
+template<class It, class Comp, class Proj, bool TRACE>
+std::size_t sorter<It, Comp, Proj, TRACE>::BinaryFirst(
+		const value_type &value,
+		range r)
+{
+	std::size_t start = r.start, end = r.end - 1;
+	if(r.start >= r.end)
+		return r.start;
+	while(start < end) {
+		std::size_t mid = start + (end - start) / 2;
+		if(less(array[mid], value))
+			start = mid + 1;
+		else
+			end = mid;
+	}
+	if(start == r.end - 1 && less(array[start], value))
+		start++;
+	return start;
+}
+
+/* find the index of the last value within the range that is equal to array[index], plus 1 */
+template<class It, class Comp, class Proj, bool TRACE>
+std::size_t sorter<It, Comp, Proj, TRACE>::BinaryLast(
+		const value_type &value,
+		range r)
+{
+	std::size_t start = r.start, end = r.end - 1;
+	if(r.start >= r.end)
+		return r.end;
+	while(start < end) {
+		std::size_t mid = start + (end - start) / 2;
+		if(!less(value, array[mid]))
+			start = mid + 1;
+		else
+			end = mid;
+	}
+	if(start == r.end - 1 && !less(value, array[start]))
+		start++;
+	return start;
+}
+
+/* combine a linear search with a binary search to reduce the number of comparisons in situations */
+/* where have some idea as to how many unique values there are and where the next value might be */
+template<class It, class Comp, class Proj, bool TRACE>
+std::size_t sorter<It, Comp, Proj, TRACE>::FindFirstForward(
+		const value_type &value,
+		range r,
+		std::size_t unique)
+{
+	std::size_t skip, index;
+	if(range_length(r) == 0)
+		return r.start;
+	skip = std::max<std::size_t>(range_length(r) / unique, 1);
+
+	for(index = r.start + skip; less(array[index - 1], value); index += skip)
+		if(index >= r.end - skip)
+			return BinaryFirst(value, range_new(index, r.end));
+
+	return BinaryFirst(value, range_new(index - skip, index));
+}
+
+template<class It, class Comp, class Proj, bool TRACE>
+std::size_t sorter<It, Comp, Proj, TRACE>::FindLastForward(
+		const value_type &value,
+		range r,
+		std::size_t unique)
+{
+	std::size_t skip, index;
+	if(range_length(r) == 0)
+		return r.start;
+	skip = std::max<std::size_t>(range_length(r) / unique, 1);
+
+	for(index = r.start + skip; !less(value, array[index - 1]); index += skip)
+		if(index >= r.end - skip)
+			return BinaryLast(value, range_new(index, r.end));
+
+	return BinaryLast(value, range_new(index - skip, index));
+}
+
+template<class It, class Comp, class Proj, bool TRACE>
+std::size_t sorter<It, Comp, Proj, TRACE>::FindFirstBackward(
+		const value_type &value,
+		range r,
+		std::size_t unique)
+{
+	std::size_t skip, index;
+	if(range_length(r) == 0)
+		return r.start;
+	skip = std::max<std::size_t>(range_length(r) / unique, 1);
+
+	for(index = r.end - skip; index > r.start && !less(array[index - 1], value); index -= skip)
+		if(index < r.start + skip)
+			return BinaryFirst(value, range_new(r.start, index));
+
+	return BinaryFirst(value, range_new(index, index + skip));
+}
+
+template<class It, class Comp, class Proj, bool TRACE>
+std::size_t sorter<It, Comp, Proj, TRACE>::FindLastBackward(
+		const value_type &value,
+		range r,
+		std::size_t unique)
+{
+	std::size_t skip, index;
+	if(range_length(r) == 0)
+		return r.start;
+	skip = std::max<std::size_t>(range_length(r) / unique, 1);
+
+	for(index = r.end - skip; index > r.start && less(value, array[index - 1]); index -= skip)
+		if(index < r.start + skip)
+			return BinaryLast(value, range_new(r.start, index));
+
+	return BinaryLast(value, range_new(index, index + skip));
+}
+
+/* n^2 sorting algorithm used to sort tiny chunks of the full array */
+template<class It, class Comp, class Proj, bool TRACE>
+void sorter<It, Comp, Proj, TRACE>::InsertionSort(
+		range r)
+{
+	std::size_t i, j;
+	for(i = r.start + 1; i < r.end; i++) {
+		if(!less(array[i], array[i - 1]))
+			continue;
+		value_type tmp(std::move(array[i]));
+		std::size_t tmpidx = TRACE ? map[i] : 0;
+		for(j = i; j > r.start && less(tmp, array[j - 1]); j--)
+			move_aa(j, j - 1);
+		array[j] = std::move(tmp);
+		if(TRACE)
+			map[j] = tmpidx;
+	}
+}
+
+/* reverse a range of values within the array */
+template<class It, class Comp, class Proj, bool TRACE>
+void sorter<It, Comp, Proj, TRACE>::reverse(
+		range r)
+{
+	std::size_t index;
+	for(index = range_length(r) / 2; index > 0; index--)
+		swap_aa(r.start + index - 1, r.end - index);
+}
+
+/* rotate by following the cycles of the permutation, which moves each item exactly once, */
+/* but one item at a time, so it's only worth it if one of the sides is tiny */
+template<class It, class Comp, class Proj, bool TRACE>
+void sorter<It, Comp, Proj, TRACE>::rotate_cycles(
+		std::size_t amount,
+		range r)
+{
+	std::size_t length = range_length(r);
+	std::size_t cycles = amount, rest = length;
+	while(rest != 0) {
+		std::size_t tmp = cycles % rest;
+		cycles = rest;
+		rest = tmp;
+	}
+
+	for(std::size_t leader = 0; leader < cycles; leader++) {
+		std::size_t index = leader, next;
+		value_type tmp(std::move(array[r.start + leader]));
+		std::size_t tmpidx = TRACE ? map[r.start + leader] : 0;
+		for(;;) {
+			next = index + amount;
+			if(next >= length)
+				next -= length;
+			if(next == leader)
+				break;
+			move_aa(r.start + index, r.start + next);
+			index = next;
+		}
+		array[r.start + index] = std::move(tmp);
+		if(TRACE)
+			map[r.start + index] = tmpidx;
+	}
+}
+
+/* rotate with the Gries-Mills algorithm, which repeatedly block swaps the shorter side into place */
+template<class It, class Comp, class Proj, bool TRACE>
+void sorter<It, Comp, Proj, TRACE>::rotate_blocks(
+		std::size_t amount,
+		range r)
+{
+	std::size_t split = r.start + amount;
+	std::size_t left = amount, right = r.end - split;
+
+	while(left != right) {
+		if(left < right) {
+			blockswap_aa(split - left, split + right - left, left);
+			right -= left;
+		}
+		else {
+			blockswap_aa(split - left, split, right);
+			left -= right;
+		}
+	}
+	blockswap_aa(split - left, split, left);
+}
+
+/* rotate the values in an array ([0 1 2 3] becomes [1 2 3 0] if we rotate by 1) */
+/* this assumes that 0 <= amount <= range.length() */
+/* pass cache_size = 0 if the cache is in use and must not be touched */
+template<class It, class Comp, class Proj, bool TRACE>
+void sorter<It, Comp, Proj, TRACE>::rotate(
+		std::size_t amount,
+		range r,
+		std::size_t cache_size)
+{
+	std::size_t left = amount, right = range_length(r) - amount;
+	if(left == 0 || right == 0)
+		return;
+
+	if(left <= right && left <= cache_size) {
+		/* the left side fits into the cache, so move it out of the way and shift the right side over */
+		cache_store(range_new(r.start, r.start + left));
+		move_range(r.start, r.start + left, right);
+		cache_load(r.start + right);
+	}
+	else if(right <= cache_size) {
+		cache_store(range_new(r.start + left, r.end));
+		move_range(r.end - left, r.start, left);
+		cache_load(r.start);
+	}
+	else if(std::min(left, right) * sizeof(value_type) < rotate_cycles_bytes)
+		rotate_cycles(amount, r);
+	else
+		rotate_blocks(amount, r);
+}
+
+/* merge operation using an external buffer */
+template<class It, class Comp, class Proj, bool TRACE>
+void sorter<It, Comp, Proj, TRACE>::MergeExternal(
+		range A,
+		range B)
+{
+	/* A has been moved into the cache, so use that instead of the internal buffer */
+	std::size_t A_index = 0, A_last = range_length(A);
+	std::size_t B_index = B.start, insert = A.start;
+
+	if(range_length(B) > 0 && range_length(A) > 0) {
+		for(;;) {
+			if(!less(array[B_index], cache[A_index])) {
+				array[insert] = std::move(cache[A_index]);
+				if(TRACE)
+					map[insert] = cachemap[A_index];
+				A_index++;
+				insert++;
+				if(A_index == A_last)
+					break;
+			}
+			else {
+				move_aa(insert, B_index);
+				B_index++;
+				insert++;
+				if(B_index == B.end)
+					break;
+			}
+		}
+	}
+
+	/* move the remainder of A into the final array */
+	for(; A_index < A_last; A_index++, insert++) {
+		array[insert] = std::move(cache[A_index]);
+		if(TRACE)
+			map[insert] = cachemap[A_index];
+	}
+	cache_free();
+}
+
+/* merge operation using an internal buffer */
+template<class It, class Comp, class Proj, bool TRACE>
+void sorter<It, Comp, Proj, TRACE>::MergeInternal(
+		range A,
+		range B,
+		range buffer)
+{
+	/* whenever we find a value to add to the final array, swap it with the value that's already in that spot */
+	/* when this algorithm is finished, 'buffer' will contain its original contents, but in a different order */
+	std::size_t A_count = 0, B_count = 0, insert = 0;
+	std::size_t A_len = range_length(A);
+	std::size_t B_len = range_length(B);
+
+	if(B_len > 0 && A_len > 0) {
+		for(;;) {
+			if(!less_aa(B.start + B_count, buffer.start + A_count)) {
+				swap_aa(A.start + insert, buffer.start + A_count);
+				A_count++;
+				insert++;
+				if(A_count >= A_len)
+					break;
+			}
+			else {
+				swap_aa(A.start + insert, B.start + B_count);
+				B_count++;
+				insert++;
+				if(B_count >= B_len)
+					break;
+			}
+		}
+	}
+
+	/* swap the remainder of A into the final array */
+	blockswap_aa(buffer.start + A_count, A.start + insert, A_len - A_count);
+}
+
+/* merge operation without a buffer */
+template<class It, class Comp, class Proj, bool TRACE>
+void sorter<It, Comp, Proj, TRACE>::MergeInPlace(
+		range A,
+		range B)
+{
+	if(range_length(A) == 0 || range_length(B) == 0)
+		return;
+
+	/* this just repeatedly binary searches into B and rotates A into position. */
+	/* see MergeInPlace() in wikisort.c for why this is good enough here */
+	for(;;) {
+		/* find the first place in B where the first item in A needs to be inserted */
+		std::size_t mid = BinaryFirst(array[A.start], B);
+
+		/* rotate A into place */
+		std::size_t amount = mid - A.end;
+		rotate(range_length(A), range_new(A.start, mid), cache_size);
+		if(B.end == mid)
+			break;
+
+		/* calculate the new A and B ranges */
+		B.start = mid;
+		A = range_new(A.start + amount, B.start);
+		A.start = BinaryLast(array[A.start], A);
+		if(range_length(A) == 0)
+			break;
+	}
+}
+
+/* merge each A+B pair of a level */
+template<class It, class Comp, class Proj, bool TRACE>
+void sorter<It, Comp, Proj, TRACE>::merge_level(
+		level *lvl)
+{
+	range A, B;
+
+	if(lvl->length < cache_size) {
+		/* if every A and B block will fit into the cache, use a special branch specifically for merging with the cache */
+		for(level_begin(lvl); level_next(lvl, &A, &B);) {
+			if(less_aa(B.end - 1, A.start))
+				rotate(range_length(A), range_new(A.start, B.end), cache_size);
+			else if(less_aa(B.start, A.end - 1)) {
+				cache_store(A);
+				MergeExternal(A, B);
+			}
+		}
+		return;
+	}
+
+	/* pull out two internal buffers each containing √A unique values, then roll the A blocks through the B blocks, */
+	/* and redistribute the buffers once the whole level is merged */
+	std::size_t block_size = isqrt(lvl->length);
+	std::size_t buffer_size = lvl->length / block_size + 1;
+
+	range buffer1, buffer2;
+	bool find_separately;
+	std::size_t index, last, count, find, start, pull_index = 0;
+	struct {
+		std::size_t from, to, count;
+		detail::range range;
+	} pull[2];
+
+	pull[0].from = pull[0].to = pull[0].count = 0; pull[0].range = range_new(0, 0);
+	pull[1].from = pull[1].to = pull[1].count = 0; pull[1].range = range_new(0, 0);
+
+	buffer1 = range_new(0, 0);
+	buffer2 = range_new(0, 0);
+
+	/* find two internal buffers of size 'buffer_size' each */
+	find = buffer_size + buffer_size;
+	find_separately = false;
+
+	if(block_size <= cache_size)
+		find = buffer_size;
+	else if(find > lvl->length) {
+		find = buffer_size;
+		find_separately = true;
+	}
+
+	for(level_begin(lvl); level_next(lvl, &A, &B);) {
+		/* check A for the number of unique values we need to fill an internal buffer */
+		for(last = A.start, count = 1; count < find; last = index, count++) {
+			index = FindLastForward(array[last], range_new(last + 1, A.end), find - count);
+			if(index == A.end)
+				break;
+		}
+		index = last;
+
+		if(count >= buffer_size) {
+			pull[pull_index].range = range_new(A.start, B.end);
+			pull[pull_index].count = count;
+			pull[pull_index].from = index;
+			pull[pull_index].to = A.start;
+			pull_index = 1;
+
+			if(count == buffer_size + buffer_size) {
+				buffer1 = range_new(A.start, A.start + buffer_size);
+				buffer2 = range_new(A.start + buffer_size, A.start + count);
+				break;
+			}
+			else if(find == buffer_size + buffer_size) {
+				buffer1 = range_new(A.start, A.start + count);
+				find = buffer_size;
+			}
+			else if(block_size <= cache_size) {
+				buffer1 = range_new(A.start, A.start + count);
+				break;
+			}
+			else if(find_separately) {
+				buffer1 = range_new(A.start, A.start + count);
+				find_separately = false;
+			}
+			else {
+				buffer2 = range_new(A.start, A.start + count);
+				break;
+			}
+		}
+		else if(pull_index == 0 && count > range_length(buffer1)) {
+			buffer1 = range_new(A.start, A.start + count);
+			pull[pull_index].range = range_new(A.start, B.end);
+			pull[pull_index].count = count;
+			pull[pull_index].from = index;
+			pull[pull_index].to = A.start;
+		}
+
+		/* check B for the number of unique values we need to fill an internal buffer */
+		for(last = B.end - 1, count = 1; count < find; last = index - 1, count++) {
+			index = FindFirstBackward(array[last], range_new(B.start, last), find - count);
+			if(index == B.start)
+				break;
+		}
+		index = last;
+
+		if(count >= buffer_size) {
+			pull[pull_index].range = range_new(A.start, B.end);
+			pull[pull_index].count = count;
+			pull[pull_index].from = index;
+			pull[pull_index].to = B.end;
+			pull_index = 1;
+
+			if(count == buffer_size + buffer_size) {
+				buffer1 = range_new(B.end - count, B.end - buffer_size);
+				buffer2 = range_new(B.end - buffer_size, B.end);
+				break;
+			}
+			else if(find == buffer_size + buffer_size) {
+				buffer1 = range_new(B.end - count, B.end);
+				find = buffer_size;
+			}
+			else if(block_size <= cache_size) {
+				buffer1 = range_new(B.end - count, B.end);
+				break;
+			}
+			else if(find_separately) {
+				buffer1 = range_new(B.end - count, B.end);
+				find_separately = false;
+			}
+			else {
+				if(pull[0].range.start == A.start)
+					pull[0].range.end -= pull[1].count;
+				buffer2 = range_new(B.end - count, B.end);
+				break;
+			}
+		}
+		else if(pull_index == 0 && count > range_length(buffer1)) {
+			buffer1 = range_new(B.end - count, B.end);
+			pull[pull_index].range = range_new(A.start, B.end);
+			pull[pull_index].count = count;
+			pull[pull_index].from = index;
+			pull[pull_index].to = B.end;
+		}
+	}
+
+	/* pull out the two ranges so we can use them as internal buffers */
+	for(pull_index = 0; pull_index < 2; pull_index++) {
+		range r;
+		std::size_t length = pull[pull_index].count;
+
+		if(pull[pull_index].to < pull[pull_index].from) {
+			index = pull[pull_index].from;
+			for(count = 1; count < length; count++) {
+				index = FindFirstBackward(array[index - 1], range_new(pull[pull_index].to, pull[pull_index].from - (count - 1)), length - count);
+				r = range_new(index + 1, pull[pull_index].from + 1);
+				rotate(range_length(r) - count, r, cache_size);
+				pull[pull_index].from = index + count;
+			}
+		}
+		else if(pull[pull_index].to > pull[pull_index].from) {
+			index = pull[pull_index].from + 1;
+			for(count = 1; count < length; count++) {
+				index = FindLastForward(array[index], range_new(index, pull[pull_index].to), length - count);
+				r = range_new(pull[pull_index].from, index - 1);
+				rotate(count, r, cache_size);
+				pull[pull_index].from = index - 1 - count;
+			}
+		}
+	}
+
+	/* adjust block_size and buffer_size based on the values we were able to pull out */
+	buffer_size = range_length(buffer1);
+	block_size = lvl->length / buffer_size + 1;
+
+	/* now that the two internal buffers have been created, it's time to merge each A+B combination at this level of the merge sort! */
+	for(level_begin(lvl); level_next(lvl, &A, &B);) {
+		/* remove any parts of A or B that are being used by the internal buffers */
+		start = A.start;
+		if(start == pull[0].range.start) {
+			if(pull[0].from > pull[0].to) {
+				A.start += pull[0].count;
+				if(range_length(A) == 0)
+					continue;
+			}
+			else if(pull[0].from < pull[0].to) {
+				B.end -= pull[0].count;
+				if(range_length(B) == 0)
+					continue;
+			}
+		}
+		if(start == pull[1].range.start) {
+			if(pull[1].from > pull[1].to) {
+				A.start += pull[1].count;
+				if(range_length(A) == 0)
+					continue;
+			}
+			else if(pull[1].from < pull[1].to) {
+				B.end -= pull[1].count;
+				if(range_length(B) == 0)
+					continue;
+			}
+		}
+
+		if(less_aa(B.end - 1, A.start)) {
+			/* the two ranges are in reverse order, so a simple rotation should fix it */
+			rotate(range_length(A), range_new(A.start, B.end), cache_size);
+		}
+		else if(less_aa(A.end, A.end - 1)) {
+			/* these two ranges weren't already in order, so we'll need to merge them! */
+			range blockA, firstA, lastA, lastB, blockB;
+			std::size_t indexA, findA;
+
+			/* break the remainder of A into blocks. firstA is the uneven-sized first A block */
+			blockA = range_new(A.start, A.end);
+			firstA = range_new(A.start, A.start + range_length(blockA) % block_size);
+
+			/* swap the first value of each A block with the value in buffer1 */
+			for(indexA = buffer1.start, index = firstA.end; index < blockA.end; indexA++, index += block_size)
+				swap_aa(indexA, index);
+
+			/* start rolling the A blocks through the B blocks! */
+			lastA = firstA;
+			lastB = range_new(0, 0);
+			blockB = range_new(B.start, B.start + std::min(block_size, range_length(B)));
+			blockA.start += range_length(firstA);
+			indexA = buffer1.start;
+
+			if(range_length(lastA) <= cache_size)
+				cache_store(lastA);
+			else if(range_length(buffer2) > 0)
+				blockswap_aa(lastA.start, buffer2.start, range_length(lastA));
+
+			if(range_length(blockA) > 0) {
+				for(;;) {
+					if((range_length(lastB) > 0 && !less_aa(lastB.end - 1, indexA)) || range_length(blockB) == 0) {
+						/* figure out where to split the previous B block, and rotate it at the split */
+						std::size_t B_split = BinaryFirst(array[indexA], lastB);
+						std::size_t B_remaining = lastB.end - B_split;
+
+						/* swap the minimum A block to the beginning of the rolling A blocks */
+						std::size_t minA = blockA.start;
+						for(findA = minA + block_size; findA < blockA.end; findA += block_size)
+							if(less_aa(findA, minA))
+								minA = findA;
+						blockswap_aa(blockA.start, minA, block_size);
+
+						/* swap the first item of the previous A block back with its original value, which is stored in buffer1 */
+						swap_aa(blockA.start, indexA);
+						indexA++;
+
+						/* locally merge the previous A block with the B values that follow it */
+						if(range_length(lastA) <= cache_size)
+							MergeExternal(lastA, range_new(lastA.end, B_split));
+						else if(range_length(buffer2) > 0)
+							MergeInternal(lastA, range_new(lastA.end, B_split), buffer2);
+						else
+							MergeInPlace(lastA, range_new(lastA.end, B_split));
+
+						if(range_length(buffer2) > 0 || block_size <= cache_size) {
+							/* move the previous A block into the cache or buffer2, since that's where we need it to be when we go to merge it anyway */
+							if(block_size <= cache_size)
+								cache_store(range_new(blockA.start, blockA.start + block_size));
+							else
+								blockswap_aa(blockA.start, buffer2.start, block_size);
+
+							/* this is equivalent to rotating, but faster */
+							blockswap_aa(B_split, blockA.start + block_size - B_remaining, B_remaining);
+						}
+						else {
+							/* we are unable to use the 'buffer2' trick to speed up the rotation operation since buffer2 doesn't exist, so perform a normal rotation */
+							rotate(blockA.start - B_split, range_new(B_split, blockA.start + block_size), cache_size);
+						}
+
+						/* update the range for the remaining A blocks, and the range remaining from the B block after it was split */
+						lastA = range_new(blockA.start - B_remaining, blockA.start - B_remaining + block_size);
+						lastB = range_new(lastA.end, lastA.end + B_remaining);
+
+						/* if there are no more A blocks remaining, this step is finished! */
+						blockA.start += block_size;
+						if(range_length(blockA) == 0)
+							break;
+					}
+					else if(range_length(blockB) < block_size) {
+						/* move the last B block, which is unevenly sized, to before the remaining A blocks, by using a rotation */
+						/* the cache is disabled here since it might contain the contents of the previous A block */
+						rotate(blockB.start - blockA.start, range_new(blockA.start, blockB.end), 0);
+
+						lastB = range_new(blockA.start, blockA.start + range_length(blockB));
+						blockA.start += range_length(blockB);
+						blockA.end += range_length(blockB);
+						blockB.end = blockB.start;
+					}
+					else {
+						/* roll the leftmost A block to the end by swapping it with the next B block */
+						blockswap_aa(blockA.start, blockB.start, block_size);
+						lastB = range_new(blockA.start, blockA.start + block_size);
+
+						blockA.start += block_size;
+						blockA.end += block_size;
+						blockB.start += block_size;
+
+						if(blockB.end > B.end - block_size)
+							blockB.end = B.end;
+						else
+							blockB.end += block_size;
+					}
+				}
+			}
+
+			/* merge the last A block with the remaining B values */
+			if(range_length(lastA) <= cache_size)
+				MergeExternal(lastA, range_new(lastA.end, B.end));
+			else if(range_length(buffer2) > 0)
+				MergeInternal(lastA, range_new(lastA.end, B.end), buffer2);
+			else
+				MergeInPlace(lastA, range_new(lastA.end, B.end));
+		}
+	}
+
+	/* insertion sort the second buffer, then redistribute the buffers back into the array using the opposite process used for creating the buffer */
+	InsertionSort(buffer2);
+
+	for(pull_index = 0; pull_index < 2; pull_index++) {
+		std::size_t amount, unique = pull[pull_index].count * 2;
+		if(pull[pull_index].from > pull[pull_index].to) {
+			/* the values were pulled out to the left, so redistribute them back to the right */
+			range buffer = range_new(pull[pull_index].range.start, pull[pull_index].range.start + pull[pull_index].count);
+			while(range_length(buffer) > 0) {
+				index = FindFirstForward(array[buffer.start], range_new(buffer.end, pull[pull_index].range.end), unique);
+				amount = index - buffer.end;
+				rotate(range_length(buffer), range_new(buffer.start, index), cache_size);
+				buffer.start += (amount + 1);
+				buffer.end += amount;
+				unique -= 2;
+			}
+		}
+		else if(pull[pull_index].from < pull[pull_index].to) {
+			/* the values were pulled out to the right, so redistribute them back to the left */
+			range buffer = range_new(pull[pull_index].range.end - pull[pull_index].count, pull[pull_index].range.end);
+			while(range_length(buffer) > 0) {
+				index = FindLastBackward(array[buffer.end - 1], range_new(pull[pull_index].range.start, buffer.start), unique);
+				amount = buffer.start - index;
+				rotate(amount, range_new(index, buffer.end), cache_size);
+				buffer.start -= amount;
+				buffer.end -= (amount + 1);
+				unique -= 2;
+			}
+		}
+	}
+}
+
+/* merge the two adjacent sorted ranges A and B */
+template<class It, class Comp, class Proj, bool TRACE>
+void sorter<It, Comp, Proj, TRACE>::merge_pair(
+		range A,
+		range B)
+{
+	level lvl;
+	if(range_length(A) == 0 || range_length(B) == 0)
+		return;
+
+	/* check for the cheap cases first, so we don't bother pulling out internal buffers for them */
+	if(!less_aa(B.start, A.end - 1))
+		return;
+	if(less_aa(B.end - 1, A.start)) {
+		rotate(range_length(A), range_new(A.start, B.end), cache_size);
+		return;
+	}
+	lvl = level_pair(A, B);
+	merge_level(&lvl);
+}
+
+/* find the end of the natural run starting at 'start'. strictly descending runs are reversed, which keeps them stable */
+template<class It, class Comp, class Proj, bool TRACE>
+std::size_t sorter<It, Comp, Proj, TRACE>::natural_run(
+		std::size_t start)
+{
+	std::size_t end = start + 1;
+	if(end >= size)
+		return size;
+
+	if(less_aa(end, start)) {
+		while(end + 1 < size && less_aa(end + 1, end))
+			end++;
+		end++;
+		reverse(range_new(start, end));
+	}
+	else {
+		while(end + 1 < size && !less_aa(end + 1, end))
+			end++;
+		end++;
+	}
+	return end;
+}
+
+/* sort by merging the natural runs of the array with the powersort policy, see natural_sort() in wikisort.c. */
+/* gives up and returns false once too much of the array turns out to be in short runs */
+template<class It, class Comp, class Proj, bool TRACE>
+bool sorter<It, Comp, Proj, TRACE>::natural_sort()
+{
+	struct {
+		std::size_t start;
+		unsigned power;
+	} stack[sizeof(std::size_t) * CHAR_BIT + 1];
+	std::size_t top = 0, shortsz = 0;
+	std::size_t start1 = 0, end1, start2, end2;
+
+	end1 = natural_run(0);
+	while(end1 < size) {
+		unsigned power;
+		start2 = end1;
+		end2 = natural_run(start2);
+		if(end2 - start2 < run_min) {
+			shortsz += run_min;
+			if(shortsz > run_min * 8 && shortsz * 2 > end2)
+				return false;
+			end2 = std::min(start2 + run_min, size);
+			InsertionSort(range_new(start2, end2));
+		}
+
+		/* merge the runs on the stack which are below the new node in the merge tree */
+		power = node_power(size, start1, end1 - start1, end2 - start2);
+		while(top > 0 && stack[top - 1].power > power) {
+			top--;
+			merge_pair(range_new(stack[top].start, start1), range_new(start1, end1));
+			start1 = stack[top].start;
+		}
+		stack[top].start = start1;
+		stack[top].power = power;
+		top++;
+		start1 = start2;
+		end1 = end2;
+	}
+
+	while(top > 0) {
+		top--;
+		merge_pair(range_new(stack[top].start, start1), range_new(start1, end1));
+		start1 = stack[top].start;
+	}
+	return true;
+}
+
+/* compare-and-swap step of the sorting networks, which uses 'order' to keep them stable */
+template<class It, class Comp, class Proj, bool TRACE>
+void sorter<It, Comp, Proj, TRACE>::swapif(
+		std::size_t start,
+		std::uint8_t *order,
+		std::size_t x,
+		std::size_t y)
+{
+	if(less_aa(start + y, start + x) || (order[x] > order[y] && !less_aa(start + x, start + y))) {
+		std::swap(order[x], order[y]);
+		swap_aa(start + x, start + y);
+	}
+}
+
+template<class It, class Comp, class Proj, bool TRACE>
+void sorter<It, Comp, Proj, TRACE>::runsort()
+{
+	iter it;
+
+	/* presorted input is handled in about n comparisons by merging its natural runs */
+	if(size >= run_min * 2 && natural_sort())
+		return;
+
+	/* if the array is of size 0, 1, 2, or 3, just sort them like so: */
+	if(size < 4) {
+		if(size == 3) {
+			/* hard-coded insertion sort */
+			if(less_aa(1, 0))
+				swap_aa(0, 1);
+			if(less_aa(2, 1)) {
+				swap_aa(1, 2);
+				if(less_aa(1, 0))
+					swap_aa(0, 1);
+			}
+		}
+		else if(size == 2) {
+			/* swap the items if they're out of order */
+			if(less_aa(1, 0))
+				swap_aa(0, 1);
+		}
+		return;
+	}
+
+	/* sort groups of 4-8 items at a time using an unstable sorting network, */
+	/* but keep track of the original item orders to force it to be stable */
+	it = iter_new(size, 4);
+	for(iter_begin(&it); !iter_finished(&it);) {
+		std::uint8_t order[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+		range r = iter_nextRange(&it);
+		std::size_t s = r.start;
+
+		if(range_length(r) == 8) {
+			swapif(s, order, 0, 1); swapif(s, order, 2, 3); swapif(s, order, 4, 5); swapif(s, order, 6, 7);
+			swapif(s, order, 0, 2); swapif(s, order, 1, 3); swapif(s, order, 4, 6); swapif(s, order, 5, 7);
+			swapif(s, order, 1, 2); swapif(s, order, 5, 6); swapif(s, order, 0, 4); swapif(s, order, 3, 7);
+			swapif(s, order, 1, 5); swapif(s, order, 2, 6);
+			swapif(s, order, 1, 4); swapif(s, order, 3, 6);
+			swapif(s, order, 2, 4); swapif(s, order, 3, 5);
+			swapif(s, order, 3, 4);
+		}
+		else if(range_length(r) == 7) {
+			swapif(s, order, 1, 2); swapif(s, order, 3, 4); swapif(s, order, 5, 6);
+			swapif(s, order, 0, 2); swapif(s, order, 3, 5); swapif(s, order, 4, 6);
+			swapif(s, order, 0, 1); swapif(s, order, 4, 5); swapif(s, order, 2, 6);
+			swapif(s, order, 0, 4); swapif(s, order, 1, 5);
+			swapif(s, order, 0, 3); swapif(s, order, 2, 5);
+			swapif(s, order, 1, 3); swapif(s, order, 2, 4);
+			swapif(s, order, 2, 3);
+		}
+		else if(range_length(r) == 6) {
+			swapif(s, order, 1, 2); swapif(s, order, 4, 5);
+			swapif(s, order, 0, 2); swapif(s, order, 3, 5);
+			swapif(s, order, 0, 1); swapif(s, order, 3, 4); swapif(s, order, 2, 5);
+			swapif(s, order, 0, 3); swapif(s, order, 1, 4);
+			swapif(s, order, 2, 4); swapif(s, order, 1, 3);
+			swapif(s, order, 2, 3);
+		}
+		else if(range_length(r) == 5) {
+			swapif(s, order, 0, 1); swapif(s, order, 3, 4);
+			swapif(s, order, 2, 4);
+			swapif(s, order, 2, 3); swapif(s, order, 1, 4);
+			swapif(s, order, 0, 3);
+			swapif(s, order, 0, 2); swapif(s, order, 1, 3);
+			swapif(s, order, 1, 2);
+		}
+		else if(range_length(r) == 4) {
+			swapif(s, order, 0, 1); swapif(s, order, 2, 3);
+			swapif(s, order, 0, 2); swapif(s, order, 1, 3);
+			swapif(s, order, 1, 2);
+		}
+	}
+	if(size < 8)
+		return;
+
+	/* merge the groups level by level, doubling the size of each A and B subarray every time */
+	do {
+		level lvl = level_new(&it);
+		merge_level(&lvl);
+	} while(iter_nextLevel(&it));
+}
+
+} /* namespace detail */
+
+template<class It, class Comp = less, class Proj = identity>
+void stable_sort(
+		It first,
+		It last,
+		Comp comp = Comp(),
+		Proj proj = Proj())
+{
+	typedef typename std::iterator_traits<It>::value_type value_type;
+	const std::size_t cache_size = detail::cache_size<value_type>::value;
+	alignas(value_type) unsigned char cache[(cache_size ? cache_size : 1) * sizeof(value_type)];
+	detail::sorter<It, Comp, Proj, false> sort(first, last - first, NULL, comp, proj,
+			reinterpret_cast<value_type*>(cache), NULL, cache_size);
+	sort.runsort();
+}
+
+template<class It, class Comp = less, class Proj = identity>
+void stable_sort_trace(
+		It first,
+		It last,
+		std::size_t *map, /* size: 'last' - 'first' */
+		Comp comp = Comp(),
+		Proj proj = Proj())
+{
+	typedef typename std::iterator_traits<It>::value_type value_type;
+	const std::size_t cache_size = detail::cache_size<value_type>::value;
+	alignas(value_type) unsigned char cache[(cache_size ? cache_size : 1) * sizeof(value_type)];
+	std::size_t cachemap[cache_size ? cache_size : 1];
+	std::size_t size = last - first;
+	detail::sorter<It, Comp, Proj, true> sort(first, size, map, comp, proj,
+			reinterpret_cast<value_type*>(cache), cachemap, cache_size);
+	for(std::size_t i = 0; i < size; i++)
+		map[i] = i;
+	sort.runsort();
+}
+
+} /* namespace wikisort */
+
+#endif
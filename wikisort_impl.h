@@ -0,0 +1,1013 @@
+/* type-specialized instantiations of the sort for C callers.
+ *
+ * WIKISORT_DEFINE(sort_u64, uint64_t, a < b) generates
+ *
+ *   void sort_u64(uint64_t *base, size_t size);
+ *   void sort_u64_trace(uint64_t *base, size_t size, size_t *map);
+ *
+ * which behave like wikisort() and wikisort_trace(), but compare with the given
+ * less-than expression on two values 'a' and 'b' of the type and move items with plain
+ * assignments, so the compiler can inline and specialize everything.
+ * use WIKISORT_DECLARE(sort_u64, uint64_t) to declare the functions in a header. */
+
+#ifndef WIKISORT_IMPL_H
+#define WIKISORT_IMPL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* hint that the item at 'p' will be needed soon */
+#ifdef __GNUC__
+#define WIKISORT_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define WIKISORT_PREFETCH(p) ((void)(p))
+#endif
+
+/* number of items in the stack cache of a generated sort, capped to 16kb */
+#define WIKISORT_IMPL_CACHE_SIZE(TYPE) \
+	(sizeof(TYPE) * 512 <= 16384 ? 512 : (sizeof(TYPE) <= 16384 ? 16384 / sizeof(TYPE) : 1))
+
+typedef struct wikisort_range wikisort_range_t;
+typedef struct wikisort_iter wikisort_iter_t;
+
+/* structure to represent ranges within the array */
+struct wikisort_range {
+	size_t start;
+	size_t end;
+};
+
+/* calculate how to scale the index value to the range within the array */
+/* the bottom-up merge sort only operates on values that are powers of two, */
+/* so scale down to that power of two, then use a fraction to scale back again */
+struct wikisort_iter {
+	size_t size, power_of_two;
+	size_t numerator, decimal;
+	size_t denominator, decimal_step, numerator_step;
+};
+
+static inline size_t wikisort_pow2_floor(
+		size_t x)
+{
+	for(size_t i = 0; i < sizeof(x) - 2; i++)
+		x |= x >> (1 << i);
+	return x - (x >> 1);
+}
+
+static inline size_t wikisort_min(
+		const size_t a,
+		const size_t b)
+{
+	if(a < b)
+		return a;
+	else
+		return b;
+}
+
+static inline size_t wikisort_max(
+		const size_t a,
+		const size_t b)
+{
+	if(a > b)
+		return a;
+	else
+		return b;
+}
+
+static inline size_t wikisort_isqrt(
+		size_t x)
+{
+	size_t op = x, res = 0, one;
+	
+	/* "one" starts at the highest power of four <= than the argument. */
+	one = (size_t)1 << (sizeof(x) * 8 - 2);
+	while(one > op)
+		one >>= 2;
+	
+	while(one != 0) {
+		if(op >= res + one) {
+			op -= res + one;
+			res += one << 1;
+		}
+		res >>= 1;
+		one >>= 2;
+	}
+	return res;
+}
+
+static inline size_t wikisort_range_length(
+		wikisort_range_t range)
+{
+	return range.end - range.start;
+}
+
+static inline wikisort_range_t wikisort_range_new(
+		const size_t start,
+		const size_t end)
+{
+	wikisort_range_t range;
+	range.start = start;
+	range.end = end;
+	return range;
+}
+
+static inline void wikisort_iter_begin(
+		wikisort_iter_t *me)
+{
+	me->numerator = me->decimal = 0;
+}
+
+static inline wikisort_range_t wikisort_iter_nextRange(
+		wikisort_iter_t *me)
+{
+	size_t start = me->decimal;
+	
+	me->decimal += me->decimal_step;
+	me->numerator += me->numerator_step;
+	if(me->numerator >= me->denominator) {
+		me->numerator -= me->denominator;
+		me->decimal++;
+	}
+	return wikisort_range_new(start, me->decimal);
+}
+
+static inline bool wikisort_iter_finished(
+		wikisort_iter_t *me)
+{
+	return me->decimal >= me->size;
+}
+
+static inline bool wikisort_iter_nextLevel(
+		wikisort_iter_t *me)
+{
+	me->decimal_step += me->decimal_step;
+	me->numerator_step += me->numerator_step;
+	if(me->numerator_step >= me->denominator) {
+		me->numerator_step -= me->denominator;
+		me->decimal_step++;
+	}
+	
+	return me->decimal_step < me->size;
+}
+
+static inline size_t wikisort_iter_length(
+		wikisort_iter_t *me)
+{
+	return me->decimal_step;
+}
+
+static inline wikisort_iter_t wikisort_iter_new(
+		size_t size2,
+		size_t min_level)
+{
+	wikisort_iter_t me;
+	me.size = size2;
+	me.power_of_two = wikisort_pow2_floor(me.size);
+	me.denominator = me.power_of_two / min_level;
+	me.numerator_step = me.size % me.denominator;
+	me.decimal_step = me.size / me.denominator;
+	return me;
+}
+
+#define WIKISORT_DECLARE(NAME, TYPE) \
+void NAME( \
+		TYPE *base, \
+		size_t size); \
+void NAME##_trace( \
+		TYPE *base, \
+		size_t size, \
+		size_t *map)
+
+/* the comparison and the search helpers, which don't move any items */
+#define WIKISORT_DEFINE_COMMON_(NAME, TYPE, LESS) \
+struct NAME##_sort { \
+	TYPE *array; \
+	size_t size; \
+	size_t *map; \
+\
+	TYPE *cache; \
+	size_t *cachemap; \
+	size_t cache_size; \
+}; \
+\
+static inline bool NAME##_less( \
+		const TYPE a, \
+		const TYPE b) \
+{ \
+	return (LESS); \
+} \
+\
+/* find the index of the first value within the range that is equal to array[index]. */ \
+/* halves the range without a branch, and fetches the middles of both halves while comparing */ \
+static size_t NAME##_BinaryFirst( \
+		const TYPE *array, \
+		const TYPE value, \
+		wikisort_range_t range) \
+{ \
+	size_t start = range.start, length = wikisort_range_length(range); \
+	if(length == 0) \
+		return range.start; \
+	while(length > 1) { \
+		size_t half = length / 2; \
+		WIKISORT_PREFETCH(&array[start + half / 2]); \
+		WIKISORT_PREFETCH(&array[start + half + half / 2]); \
+		start = NAME##_less(array[start + half], value) ? start + half : start; \
+		length -= half; \
+	} \
+	return start + NAME##_less(array[start], value); \
+} \
+\
+/* find the index of the last value within the range that is equal to array[index], plus 1 */ \
+static size_t NAME##_BinaryLast( \
+		const TYPE *array, \
+		const TYPE value, \
+		wikisort_range_t range) \
+{ \
+	size_t start = range.start, length = wikisort_range_length(range); \
+	if(length == 0) \
+		return range.end; \
+	while(length > 1) { \
+		size_t half = length / 2; \
+		WIKISORT_PREFETCH(&array[start + half / 2]); \
+		WIKISORT_PREFETCH(&array[start + half + half / 2]); \
+		start = !NAME##_less(value, array[start + half]) ? start + half : start; \
+		length -= half; \
+	} \
+	return start + !NAME##_less(value, array[start]); \
+} \
+\
+/* combine a linear search with a binary search to reduce the number of comparisons in situations */ \
+/* where have some idea as to how many unique values there are and where the next value might be */ \
+static size_t NAME##_FindFirstForward( \
+		const TYPE *array, \
+		const TYPE value, \
+		wikisort_range_t range, \
+		size_t unique) \
+{ \
+	size_t skip, index; \
+	if(wikisort_range_length(range) == 0) \
+		return range.start; \
+	skip = wikisort_max(wikisort_range_length(range) / unique, 1); \
+	 \
+	for(index = range.start + skip; NAME##_less(array[index - 1], value); index += skip) \
+		if(index >= range.end - skip) \
+			return NAME##_BinaryFirst(array, value, wikisort_range_new(index, range.end)); \
+	 \
+	return NAME##_BinaryFirst(array, value, wikisort_range_new(index - skip, index)); \
+} \
+\
+static size_t NAME##_FindLastForward( \
+		const TYPE *array, \
+		const TYPE value, \
+		wikisort_range_t range, \
+		size_t unique) \
+{ \
+	size_t skip, index; \
+	if(wikisort_range_length(range) == 0) \
+		return range.start; \
+	skip = wikisort_max(wikisort_range_length(range) / unique, 1); \
+	 \
+	for(index = range.start + skip; !NAME##_less(value, array[index - 1]); index += skip) \
+		if(index >= range.end - skip) \
+			return NAME##_BinaryLast(array, value, wikisort_range_new(index, range.end)); \
+	 \
+	return NAME##_BinaryLast(array, value, wikisort_range_new(index - skip, index)); \
+} \
+\
+static size_t NAME##_FindFirstBackward( \
+		const TYPE *array, \
+		const TYPE value, \
+		wikisort_range_t range, \
+		size_t unique) \
+{ \
+	size_t skip, index; \
+	if(wikisort_range_length(range) == 0) \
+		return range.start; \
+	skip = wikisort_max(wikisort_range_length(range) / unique, 1); \
+	 \
+	for(index = range.end - skip; index > range.start && !NAME##_less(array[index - 1], value); index -= skip) \
+		if(index < range.start + skip) \
+			return NAME##_BinaryFirst(array, value, wikisort_range_new(range.start, index)); \
+	 \
+	return NAME##_BinaryFirst(array, value, wikisort_range_new(index, index + skip)); \
+} \
+\
+static size_t NAME##_FindLastBackward( \
+		const TYPE *array, \
+		const TYPE value, \
+		wikisort_range_t range, \
+		size_t unique) \
+{ \
+	size_t skip, index; \
+	if(wikisort_range_length(range) == 0) \
+		return range.start; \
+	skip = wikisort_max(wikisort_range_length(range) / unique, 1); \
+	 \
+	for(index = range.end - skip; index > range.start && NAME##_less(value, array[index - 1]); index -= skip) \
+		if(index < range.start + skip) \
+			return NAME##_BinaryLast(array, value, wikisort_range_new(range.start, index)); \
+	 \
+	return NAME##_BinaryLast(array, value, wikisort_range_new(index, index + skip)); \
+}
+
+/* everything that moves items. TRACK is a constant 0 or 1 and decides whether 'map' is updated */
+#define WIKISORT_DEFINE_SORT_(NAME, IMPL, TYPE, TRACK) \
+/* copy an element from within the array */ \
+static inline void IMPL##_copy_aa( \
+		const struct NAME##_sort *sort, \
+		size_t a, \
+		size_t b) \
+{ \
+	if(TRACK) \
+		sort->map[a] = sort->map[b]; \
+	sort->array[a] = sort->array[b]; \
+} \
+\
+/* swap two elements in the array */ \
+static inline void IMPL##_swap_aa( \
+		const struct NAME##_sort *sort, \
+		size_t a, \
+		size_t b) \
+{ \
+	TYPE tmp = sort->array[a]; \
+	sort->array[a] = sort->array[b]; \
+	sort->array[b] = tmp; \
+	if(TRACK) { \
+		size_t tmpidx = sort->map[a]; \
+		sort->map[a] = sort->map[b]; \
+		sort->map[b] = tmpidx; \
+	} \
+} \
+\
+/* swap a series of values in the array */ \
+static inline void IMPL##_blockswap_aa( \
+		const struct NAME##_sort *sort, \
+		size_t a, \
+		size_t b, \
+		size_t n) \
+{ \
+	for(size_t i = 0; i < n; i++) \
+		IMPL##_swap_aa(sort, a + i, b + i); \
+} \
+\
+/* copy a range of values from the array into the cache */ \
+static inline void IMPL##_cache_store( \
+		const struct NAME##_sort *sort, \
+		wikisort_range_t range) \
+{ \
+	for(size_t i = range.start; i < range.end; i++) { \
+		sort->cache[i - range.start] = sort->array[i]; \
+		if(TRACK) \
+			sort->cachemap[i - range.start] = sort->map[i]; \
+	} \
+} \
+\
+/* n^2 sorting algorithm used to sort tiny chunks of the full array */ \
+static void IMPL##_InsertionSort( \
+		const struct NAME##_sort *sort, \
+		wikisort_range_t range) \
+{ \
+	TYPE *array = sort->array; \
+	size_t i, j; \
+	for(i = range.start + 1; i < range.end; i++) { \
+		TYPE tmp = array[i]; \
+		size_t tmpidx = TRACK ? sort->map[i] : 0; \
+		for(j = i; j > range.start && NAME##_less(tmp, array[j - 1]); j--) \
+			IMPL##_copy_aa(sort, j, j - 1); \
+		array[j] = tmp; \
+		if(TRACK) \
+			sort->map[j] = tmpidx; \
+	} \
+} \
+\
+/* reverse a range of values within the array */ \
+static void IMPL##_reverse( \
+		const struct NAME##_sort *sort, \
+		wikisort_range_t range) \
+{ \
+	size_t index; \
+	for(index = wikisort_range_length(range) / 2; index > 0; index--) \
+		IMPL##_swap_aa(sort, range.start + index - 1, range.end - index); \
+} \
+\
+/* rotate the values in an array ([0 1 2 3] becomes [1 2 3 0] if we rotate by 1) */ \
+/* this assumes that 0 <= amount <= range.length() */ \
+static void IMPL##_rotate( \
+		const struct NAME##_sort *sort, \
+		size_t amount, \
+		wikisort_range_t range) \
+{ \
+	size_t split; \
+	if(wikisort_range_length(range) == 0) \
+		return; \
+	 \
+	split = range.start + amount; \
+	IMPL##_reverse(sort, wikisort_range_new(range.start, split)); \
+	IMPL##_reverse(sort, wikisort_range_new(split, range.end)); \
+	IMPL##_reverse(sort, range); \
+} \
+\
+/* merge operation using an external buffer */ \
+static void IMPL##_MergeExternal( \
+		const struct NAME##_sort *sort, \
+		wikisort_range_t A, \
+		wikisort_range_t B) \
+{ \
+	/* A fits into the cache, so use that instead of the internal buffer */ \
+	TYPE *array = sort->array; \
+	size_t A_index = 0, A_last = wikisort_range_length(A); \
+	size_t B_index = B.start, insert = A.start; \
+	 \
+	if(wikisort_range_length(B) > 0 && wikisort_range_length(A) > 0) { \
+		for(;;) { \
+			if(!NAME##_less(array[B_index], sort->cache[A_index])) { \
+				array[insert] = sort->cache[A_index]; \
+				if(TRACK) \
+					sort->map[insert] = sort->cachemap[A_index]; \
+				A_index++; \
+				insert++; \
+				if(A_index == A_last) \
+					break; \
+			} \
+			else { \
+				IMPL##_copy_aa(sort, insert, B_index); \
+				B_index++; \
+				insert++; \
+				if(B_index == B.end) \
+					break; \
+			} \
+		} \
+	} \
+	 \
+	/* copy the remainder of A into the final array */ \
+	for(; A_index < A_last; A_index++, insert++) { \
+		array[insert] = sort->cache[A_index]; \
+		if(TRACK) \
+			sort->map[insert] = sort->cachemap[A_index]; \
+	} \
+} \
+\
+/* merge operation using an internal buffer */ \
+static void IMPL##_MergeInternal( \
+		const struct NAME##_sort *sort, \
+		wikisort_range_t A, \
+		wikisort_range_t B, \
+		wikisort_range_t buffer) \
+{ \
+	/* whenever we find a value to add to the final array, swap it with the value that's already in that spot */ \
+	/* when this algorithm is finished, 'buffer' will contain its original contents, but in a different order */ \
+	TYPE *array = sort->array; \
+	size_t A_count = 0, B_count = 0, insert = 0; \
+	size_t A_len = wikisort_range_length(A); \
+	size_t B_len = wikisort_range_length(B); \
+	 \
+	if(B_len > 0 && A_len > 0) { \
+		for(;;) { \
+			if(!NAME##_less(array[B.start + B_count], array[buffer.start + A_count])) { \
+				IMPL##_swap_aa(sort, A.start + insert, buffer.start + A_count); \
+				A_count++; \
+				insert++; \
+				if(A_count >= A_len) \
+					break; \
+			} \
+			else { \
+				IMPL##_swap_aa(sort, A.start + insert, B.start + B_count); \
+				B_count++; \
+				insert++; \
+				if(B_count >= B_len) \
+					break; \
+			} \
+		} \
+	} \
+	 \
+	/* swap the remainder of A into the final array */ \
+	IMPL##_blockswap_aa(sort, buffer.start + A_count, A.start + insert, A_len - A_count); \
+} \
+\
+/* merge operation without a buffer */ \
+static void IMPL##_MergeInPlace( \
+		const struct NAME##_sort *sort, \
+		wikisort_range_t A, \
+		wikisort_range_t B) \
+{ \
+	if(wikisort_range_length(A) == 0 || wikisort_range_length(B) == 0) \
+		return; \
+	 \
+	/* this just repeatedly binary searches into B and rotates A into position. */ \
+	/* see MergeInPlace() in wikisort.c for why this is good enough here */ \
+	for(;;) { \
+		/* find the first place in B where the first item in A needs to be inserted */ \
+		size_t mid = NAME##_BinaryFirst(sort->array, sort->array[A.start], B); \
+		 \
+		/* rotate A into place */ \
+		size_t amount = mid - A.end; \
+		IMPL##_rotate(sort, wikisort_range_length(A), wikisort_range_new(A.start, mid)); \
+		if(B.end == mid) \
+			break; \
+		 \
+		/* calculate the new A and B ranges */ \
+		B.start = mid; \
+		A = wikisort_range_new(A.start + amount, B.start); \
+		A.start = NAME##_BinaryLast(sort->array, sort->array[A.start], A); \
+		if(wikisort_range_length(A) == 0) \
+			break; \
+	} \
+} \
+\
+/* compare-and-swap step of the sorting networks, which uses 'order' to keep them stable */ \
+static inline void IMPL##_swapif( \
+		const struct NAME##_sort *sort, \
+		size_t start, \
+		uint8_t *order, \
+		size_t x, \
+		size_t y) \
+{ \
+	TYPE *array = sort->array; \
+	if(NAME##_less(array[start + y], array[start + x]) || (order[x] > order[y] && !NAME##_less(array[start + x], array[start + y]))) { \
+		uint8_t tmp = order[x]; \
+		order[x] = order[y]; \
+		order[y] = tmp; \
+		IMPL##_swap_aa(sort, start + x, start + y); \
+	} \
+} \
+\
+static void IMPL##_runsort( \
+		const struct NAME##_sort *sort) \
+{ \
+	TYPE *array = sort->array; \
+	wikisort_iter_t iter; \
+	 \
+	/* if the array is of size 0, 1, 2, or 3, just sort them like so: */ \
+	if(sort->size < 4) { \
+		if(sort->size == 3) { \
+			/* hard-coded insertion sort */ \
+			if(NAME##_less(array[1], array[0])) \
+				IMPL##_swap_aa(sort, 0, 1); \
+			if(NAME##_less(array[2], array[1])) { \
+				IMPL##_swap_aa(sort, 1, 2); \
+				if(NAME##_less(array[1], array[0])) \
+					IMPL##_swap_aa(sort, 0, 1); \
+			} \
+		} \
+		else if(sort->size == 2) { \
+			/* swap the items if they're out of order */ \
+			if(NAME##_less(array[1], array[0])) \
+				IMPL##_swap_aa(sort, 0, 1); \
+		} \
+		return; \
+	} \
+	 \
+	/* sort groups of 4-8 items at a time using an unstable sorting network, */ \
+	/* but keep track of the original item orders to force it to be stable */ \
+	iter = wikisort_iter_new(sort->size, 4); \
+	for(wikisort_iter_begin(&iter); !wikisort_iter_finished(&iter);) { \
+		uint8_t order[] = { 0, 1, 2, 3, 4, 5, 6, 7 }; \
+		wikisort_range_t range = wikisort_iter_nextRange(&iter); \
+		size_t s = range.start; \
+		 \
+		if(wikisort_range_length(range) == 8) { \
+			IMPL##_swapif(sort, s, order, 0, 1); IMPL##_swapif(sort, s, order, 2, 3); IMPL##_swapif(sort, s, order, 4, 5); IMPL##_swapif(sort, s, order, 6, 7); \
+			IMPL##_swapif(sort, s, order, 0, 2); IMPL##_swapif(sort, s, order, 1, 3); IMPL##_swapif(sort, s, order, 4, 6); IMPL##_swapif(sort, s, order, 5, 7); \
+			IMPL##_swapif(sort, s, order, 1, 2); IMPL##_swapif(sort, s, order, 5, 6); IMPL##_swapif(sort, s, order, 0, 4); IMPL##_swapif(sort, s, order, 3, 7); \
+			IMPL##_swapif(sort, s, order, 1, 5); IMPL##_swapif(sort, s, order, 2, 6); \
+			IMPL##_swapif(sort, s, order, 1, 4); IMPL##_swapif(sort, s, order, 3, 6); \
+			IMPL##_swapif(sort, s, order, 2, 4); IMPL##_swapif(sort, s, order, 3, 5); \
+			IMPL##_swapif(sort, s, order, 3, 4); \
+		} \
+		else if(wikisort_range_length(range) == 7) { \
+			IMPL##_swapif(sort, s, order, 1, 2); IMPL##_swapif(sort, s, order, 3, 4); IMPL##_swapif(sort, s, order, 5, 6); \
+			IMPL##_swapif(sort, s, order, 0, 2); IMPL##_swapif(sort, s, order, 3, 5); IMPL##_swapif(sort, s, order, 4, 6); \
+			IMPL##_swapif(sort, s, order, 0, 1); IMPL##_swapif(sort, s, order, 4, 5); IMPL##_swapif(sort, s, order, 2, 6); \
+			IMPL##_swapif(sort, s, order, 0, 4); IMPL##_swapif(sort, s, order, 1, 5); \
+			IMPL##_swapif(sort, s, order, 0, 3); IMPL##_swapif(sort, s, order, 2, 5); \
+			IMPL##_swapif(sort, s, order, 1, 3); IMPL##_swapif(sort, s, order, 2, 4); \
+			IMPL##_swapif(sort, s, order, 2, 3); \
+		} \
+		else if(wikisort_range_length(range) == 6) { \
+			IMPL##_swapif(sort, s, order, 1, 2); IMPL##_swapif(sort, s, order, 4, 5); \
+			IMPL##_swapif(sort, s, order, 0, 2); IMPL##_swapif(sort, s, order, 3, 5); \
+			IMPL##_swapif(sort, s, order, 0, 1); IMPL##_swapif(sort, s, order, 3, 4); IMPL##_swapif(sort, s, order, 2, 5); \
+			IMPL##_swapif(sort, s, order, 0, 3); IMPL##_swapif(sort, s, order, 1, 4); \
+			IMPL##_swapif(sort, s, order, 2, 4); IMPL##_swapif(sort, s, order, 1, 3); \
+			IMPL##_swapif(sort, s, order, 2, 3); \
+		} \
+		else if(wikisort_range_length(range) == 5) { \
+			IMPL##_swapif(sort, s, order, 0, 1); IMPL##_swapif(sort, s, order, 3, 4); \
+			IMPL##_swapif(sort, s, order, 2, 4); \
+			IMPL##_swapif(sort, s, order, 2, 3); IMPL##_swapif(sort, s, order, 1, 4); \
+			IMPL##_swapif(sort, s, order, 0, 3); \
+			IMPL##_swapif(sort, s, order, 0, 2); IMPL##_swapif(sort, s, order, 1, 3); \
+			IMPL##_swapif(sort, s, order, 1, 2); \
+		} \
+		else if(wikisort_range_length(range) == 4) { \
+			IMPL##_swapif(sort, s, order, 0, 1); IMPL##_swapif(sort, s, order, 2, 3); \
+			IMPL##_swapif(sort, s, order, 0, 2); IMPL##_swapif(sort, s, order, 1, 3); \
+			IMPL##_swapif(sort, s, order, 1, 2); \
+		} \
+	} \
+	if(sort->size < 8) \
+		return; \
+	 \
+	for(;;) { \
+		/* the merge logic is a one-to-one translation of runsort() in wikisort.c, see there for details */ \
+		size_t block_size, buffer_size; \
+		wikisort_range_t buffer1, buffer2, A, B; \
+		bool find_separately; \
+		size_t index, last, count, find, start, pull_index = 0; \
+		struct { \
+			size_t from, to, count; \
+			wikisort_range_t range; \
+		} pull[2]; \
+		 \
+		if(wikisort_iter_length(&iter) < sort->cache_size) { \
+			/* if every A and B block will fit into the cache, use a special branch specifically for merging with the cache */ \
+			for(wikisort_iter_begin(&iter); !wikisort_iter_finished(&iter);) { \
+				A = wikisort_iter_nextRange(&iter); \
+				B = wikisort_iter_nextRange(&iter); \
+				 \
+				if(NAME##_less(array[B.end - 1], array[A.start])) \
+					IMPL##_rotate(sort, wikisort_range_length(A), wikisort_range_new(A.start, B.end)); \
+				else if(NAME##_less(array[B.start], array[A.end - 1])) { \
+					IMPL##_cache_store(sort, A); \
+					IMPL##_MergeExternal(sort, A, B); \
+				} \
+			} \
+			 \
+			if(!wikisort_iter_nextLevel(&iter)) \
+				break; \
+			continue; \
+		} \
+		 \
+		block_size = wikisort_isqrt(wikisort_iter_length(&iter)); \
+		buffer_size = wikisort_iter_length(&iter) / block_size + 1; \
+		 \
+		pull[0].from = pull[0].to = pull[0].count = 0; pull[0].range = wikisort_range_new(0, 0); \
+		pull[1].from = pull[1].to = pull[1].count = 0; pull[1].range = wikisort_range_new(0, 0); \
+		 \
+		buffer1 = wikisort_range_new(0, 0); \
+		buffer2 = wikisort_range_new(0, 0); \
+		 \
+		/* find two internal buffers of size 'buffer_size' each */ \
+		find = buffer_size + buffer_size; \
+		find_separately = false; \
+		 \
+		if(block_size <= sort->cache_size) \
+			find = buffer_size; \
+		else if(find > wikisort_iter_length(&iter)) { \
+			find = buffer_size; \
+			find_separately = true; \
+		} \
+		 \
+		for(wikisort_iter_begin(&iter); !wikisort_iter_finished(&iter);) { \
+			A = wikisort_iter_nextRange(&iter); \
+			B = wikisort_iter_nextRange(&iter); \
+			 \
+			/* check A for the number of unique values we need to fill an internal buffer */ \
+			for(last = A.start, count = 1; count < find; last = index, count++) { \
+				index = NAME##_FindLastForward(array, array[last], wikisort_range_new(last + 1, A.end), find - count); \
+				if(index == A.end) \
+					break; \
+			} \
+			index = last; \
+			 \
+			if(count >= buffer_size) { \
+				pull[pull_index].range = wikisort_range_new(A.start, B.end); \
+				pull[pull_index].count = count; \
+				pull[pull_index].from = index; \
+				pull[pull_index].to = A.start; \
+				pull_index = 1; \
+				 \
+				if(count == buffer_size + buffer_size) { \
+					buffer1 = wikisort_range_new(A.start, A.start + buffer_size); \
+					buffer2 = wikisort_range_new(A.start + buffer_size, A.start + count); \
+					break; \
+				} \
+				else if(find == buffer_size + buffer_size) { \
+					buffer1 = wikisort_range_new(A.start, A.start + count); \
+					find = buffer_size; \
+				} \
+				else if(block_size <= sort->cache_size) { \
+					buffer1 = wikisort_range_new(A.start, A.start + count); \
+					break; \
+				} \
+				else if(find_separately) { \
+					buffer1 = wikisort_range_new(A.start, A.start + count); \
+					find_separately = false; \
+				} \
+				else { \
+					buffer2 = wikisort_range_new(A.start, A.start + count); \
+					break; \
+				} \
+			} \
+			else if(pull_index == 0 && count > wikisort_range_length(buffer1)) { \
+				buffer1 = wikisort_range_new(A.start, A.start + count); \
+				pull[pull_index].range = wikisort_range_new(A.start, B.end); \
+				pull[pull_index].count = count; \
+				pull[pull_index].from = index; \
+				pull[pull_index].to = A.start; \
+			} \
+			 \
+			/* check B for the number of unique values we need to fill an internal buffer */ \
+			for(last = B.end - 1, count = 1; count < find; last = index - 1, count++) { \
+				index = NAME##_FindFirstBackward(array, array[last], wikisort_range_new(B.start, last), find - count); \
+				if(index == B.start) \
+					break; \
+			} \
+			index = last; \
+			 \
+			if(count >= buffer_size) { \
+				pull[pull_index].range = wikisort_range_new(A.start, B.end); \
+				pull[pull_index].count = count; \
+				pull[pull_index].from = index; \
+				pull[pull_index].to = B.end; \
+				pull_index = 1; \
+				 \
+				if(count == buffer_size + buffer_size) { \
+					buffer1 = wikisort_range_new(B.end - count, B.end - buffer_size); \
+					buffer2 = wikisort_range_new(B.end - buffer_size, B.end); \
+					break; \
+				} \
+				else if(find == buffer_size + buffer_size) { \
+					buffer1 = wikisort_range_new(B.end - count, B.end); \
+					find = buffer_size; \
+				} \
+				else if(block_size <= sort->cache_size) { \
+					buffer1 = wikisort_range_new(B.end - count, B.end); \
+					break; \
+				} \
+				else if(find_separately) { \
+					buffer1 = wikisort_range_new(B.end - count, B.end); \
+					find_separately = false; \
+				} \
+				else { \
+					if(pull[0].range.start == A.start) \
+						pull[0].range.end -= pull[1].count; \
+					buffer2 = wikisort_range_new(B.end - count, B.end); \
+					break; \
+				} \
+			} \
+			else if(pull_index == 0 && count > wikisort_range_length(buffer1)) { \
+				buffer1 = wikisort_range_new(B.end - count, B.end); \
+				pull[pull_index].range = wikisort_range_new(A.start, B.end); \
+				pull[pull_index].count = count; \
+				pull[pull_index].from = index; \
+				pull[pull_index].to = B.end; \
+			} \
+		} \
+		 \
+		/* pull out the two ranges so we can use them as internal buffers */ \
+		for(pull_index = 0; pull_index < 2; pull_index++) { \
+			wikisort_range_t range; \
+			size_t length = pull[pull_index].count; \
+			 \
+			if(pull[pull_index].to < pull[pull_index].from) { \
+				index = pull[pull_index].from; \
+				for(count = 1; count < length; count++) { \
+					index = NAME##_FindFirstBackward(array, array[index - 1], wikisort_range_new(pull[pull_index].to, pull[pull_index].from - (count - 1)), length - count); \
+					range = wikisort_range_new(index + 1, pull[pull_index].from + 1); \
+					IMPL##_rotate(sort, wikisort_range_length(range) - count, range); \
+					pull[pull_index].from = index + count; \
+				} \
+			} \
+			else if(pull[pull_index].to > pull[pull_index].from) { \
+				index = pull[pull_index].from + 1; \
+				for(count = 1; count < length; count++) { \
+					index = NAME##_FindLastForward(array, array[index], wikisort_range_new(index, pull[pull_index].to), length - count); \
+					range = wikisort_range_new(pull[pull_index].from, index - 1); \
+					IMPL##_rotate(sort, count, range); \
+					pull[pull_index].from = index - 1 - count; \
+				} \
+			} \
+		} \
+		 \
+		/* adjust block_size and buffer_size based on the values we were able to pull out */ \
+		buffer_size = wikisort_range_length(buffer1); \
+		block_size = wikisort_iter_length(&iter) / buffer_size + 1; \
+		 \
+		/* now that the two internal buffers have been created, it's time to merge each A+B combination at this level of the merge sort! */ \
+		for(wikisort_iter_begin(&iter); !wikisort_iter_finished(&iter);) { \
+			A = wikisort_iter_nextRange(&iter); \
+			B = wikisort_iter_nextRange(&iter); \
+			 \
+			/* remove any parts of A or B that are being used by the internal buffers */ \
+			start = A.start; \
+			if(start == pull[0].range.start) { \
+				if(pull[0].from > pull[0].to) { \
+					A.start += pull[0].count; \
+					if(wikisort_range_length(A) == 0) \
+						continue; \
+				} \
+				else if(pull[0].from < pull[0].to) { \
+					B.end -= pull[0].count; \
+					if(wikisort_range_length(B) == 0) \
+						continue; \
+				} \
+			} \
+			if(start == pull[1].range.start) { \
+				if(pull[1].from > pull[1].to) { \
+					A.start += pull[1].count; \
+					if(wikisort_range_length(A) == 0) \
+						continue; \
+				} \
+				else if(pull[1].from < pull[1].to) { \
+					B.end -= pull[1].count; \
+					if(wikisort_range_length(B) == 0) \
+						continue; \
+				} \
+			} \
+			 \
+			if(NAME##_less(array[B.end - 1], array[A.start])) { \
+				/* the two ranges are in reverse order, so a simple rotation should fix it */ \
+				IMPL##_rotate(sort, wikisort_range_length(A), wikisort_range_new(A.start, B.end)); \
+			} \
+			else if(NAME##_less(array[A.end], array[A.end - 1])) { \
+				/* these two ranges weren't already in order, so we'll need to merge them! */ \
+				wikisort_range_t blockA, firstA, lastA, lastB, blockB; \
+				size_t indexA, findA; \
+				 \
+				/* break the remainder of A into blocks. firstA is the uneven-sized first A block */ \
+				blockA = wikisort_range_new(A.start, A.end); \
+				firstA = wikisort_range_new(A.start, A.start + wikisort_range_length(blockA) % block_size); \
+				 \
+				/* swap the first value of each A block with the value in buffer1 */ \
+				for(indexA = buffer1.start, index = firstA.end; index < blockA.end; indexA++, index += block_size) \
+					IMPL##_swap_aa(sort, indexA, index); \
+				 \
+				/* start rolling the A blocks through the B blocks! */ \
+				lastA = firstA; \
+				lastB = wikisort_range_new(0, 0); \
+				blockB = wikisort_range_new(B.start, B.start + wikisort_min(block_size, wikisort_range_length(B))); \
+				blockA.start += wikisort_range_length(firstA); \
+				indexA = buffer1.start; \
+				 \
+				if(wikisort_range_length(lastA) <= sort->cache_size) \
+					IMPL##_cache_store(sort, lastA); \
+				else if(wikisort_range_length(buffer2) > 0) \
+					IMPL##_blockswap_aa(sort, lastA.start, buffer2.start, wikisort_range_length(lastA)); \
+				 \
+				if(wikisort_range_length(blockA) > 0) { \
+					for(;;) { \
+						if((wikisort_range_length(lastB) > 0 && !NAME##_less(array[lastB.end - 1], array[indexA])) || wikisort_range_length(blockB) == 0) { \
+							/* figure out where to split the previous B block, and rotate it at the split */ \
+							size_t B_split = NAME##_BinaryFirst(array, array[indexA], lastB); \
+							size_t B_remaining = lastB.end - B_split; \
+							 \
+							/* swap the minimum A block to the beginning of the rolling A blocks */ \
+							size_t minA = blockA.start; \
+							for(findA = minA + block_size; findA < blockA.end; findA += block_size) \
+								if(NAME##_less(array[findA], array[minA])) \
+									minA = findA; \
+							IMPL##_blockswap_aa(sort, blockA.start, minA, block_size); \
+							 \
+							/* swap the first item of the previous A block back with its original value, which is stored in buffer1 */ \
+							IMPL##_swap_aa(sort, blockA.start, indexA); \
+							indexA++; \
+							 \
+							/* locally merge the previous A block with the B values that follow it */ \
+							if(wikisort_range_length(lastA) <= sort->cache_size) \
+								IMPL##_MergeExternal(sort, lastA, wikisort_range_new(lastA.end, B_split)); \
+							else if(wikisort_range_length(buffer2) > 0) \
+								IMPL##_MergeInternal(sort, lastA, wikisort_range_new(lastA.end, B_split), buffer2); \
+							else \
+								IMPL##_MergeInPlace(sort, lastA, wikisort_range_new(lastA.end, B_split)); \
+							 \
+							if(wikisort_range_length(buffer2) > 0 || block_size <= sort->cache_size) { \
+								/* copy the previous A block into the cache or buffer2, since that's where we need it to be when we go to merge it anyway */ \
+								if(block_size <= sort->cache_size) \
+									IMPL##_cache_store(sort, wikisort_range_new(blockA.start, blockA.start + block_size)); \
+								else \
+									IMPL##_blockswap_aa(sort, blockA.start, buffer2.start, block_size); \
+								 \
+								/* this is equivalent to rotating, but faster */ \
+								IMPL##_blockswap_aa(sort, B_split, blockA.start + block_size - B_remaining, B_remaining); \
+							} \
+							else { \
+								/* we are unable to use the 'buffer2' trick to speed up the rotation operation since buffer2 doesn't exist, so perform a normal rotation */ \
+								IMPL##_rotate(sort, blockA.start - B_split, wikisort_range_new(B_split, blockA.start + block_size)); \
+							} \
+							 \
+							/* update the range for the remaining A blocks, and the range remaining from the B block after it was split */ \
+							lastA = wikisort_range_new(blockA.start - B_remaining, blockA.start - B_remaining + block_size); \
+							lastB = wikisort_range_new(lastA.end, lastA.end + B_remaining); \
+							 \
+							/* if there are no more A blocks remaining, this step is finished! */ \
+							blockA.start += block_size; \
+							if(wikisort_range_length(blockA) == 0) \
+								break; \
+						} \
+						else if(wikisort_range_length(blockB) < block_size) { \
+							/* move the last B block, which is unevenly sized, to before the remaining A blocks, by using a rotation */ \
+							IMPL##_rotate(sort, blockB.start - blockA.start, wikisort_range_new(blockA.start, blockB.end)); \
+							 \
+							lastB = wikisort_range_new(blockA.start, blockA.start + wikisort_range_length(blockB)); \
+							blockA.start += wikisort_range_length(blockB); \
+							blockA.end += wikisort_range_length(blockB); \
+							blockB.end = blockB.start; \
+						} \
+						else { \
+							/* roll the leftmost A block to the end by swapping it with the next B block */ \
+							IMPL##_blockswap_aa(sort, blockA.start, blockB.start, block_size); \
+							lastB = wikisort_range_new(blockA.start, blockA.start + block_size); \
+							 \
+							blockA.start += block_size; \
+							blockA.end += block_size; \
+							blockB.start += block_size; \
+							 \
+							if(blockB.end > B.end - block_size) \
+								blockB.end = B.end; \
+							else \
+								blockB.end += block_size; \
+						} \
+					} \
+				} \
+				 \
+				/* merge the last A block with the remaining B values */ \
+				if(wikisort_range_length(lastA) <= sort->cache_size) \
+					IMPL##_MergeExternal(sort, lastA, wikisort_range_new(lastA.end, B.end)); \
+				else if(wikisort_range_length(buffer2) > 0) \
+					IMPL##_MergeInternal(sort, lastA, wikisort_range_new(lastA.end, B.end), buffer2); \
+				else \
+					IMPL##_MergeInPlace(sort, lastA, wikisort_range_new(lastA.end, B.end)); \
+			} \
+		} \
+		 \
+		/* insertion sort the second buffer, then redistribute the buffers back into the array using the opposite process used for creating the buffer */ \
+		IMPL##_InsertionSort(sort, buffer2); \
+		 \
+		for(pull_index = 0; pull_index < 2; pull_index++) { \
+			size_t amount, unique = pull[pull_index].count * 2; \
+			if(pull[pull_index].from > pull[pull_index].to) { \
+				/* the values were pulled out to the left, so redistribute them back to the right */ \
+				wikisort_range_t buffer = wikisort_range_new(pull[pull_index].range.start, pull[pull_index].range.start + pull[pull_index].count); \
+				while(wikisort_range_length(buffer) > 0) { \
+					index = NAME##_FindFirstForward(array, array[buffer.start], wikisort_range_new(buffer.end, pull[pull_index].range.end), unique); \
+					amount = index - buffer.end; \
+					IMPL##_rotate(sort, wikisort_range_length(buffer), wikisort_range_new(buffer.start, index)); \
+					buffer.start += (amount + 1); \
+					buffer.end += amount; \
+					unique -= 2; \
+				} \
+			} \
+			else if(pull[pull_index].from < pull[pull_index].to) { \
+				/* the values were pulled out to the right, so redistribute them back to the left */ \
+				wikisort_range_t buffer = wikisort_range_new(pull[pull_index].range.end - pull[pull_index].count, pull[pull_index].range.end); \
+				while(wikisort_range_length(buffer) > 0) { \
+					index = NAME##_FindLastBackward(array, array[buffer.end - 1], wikisort_range_new(pull[pull_index].range.start, buffer.start), unique); \
+					amount = buffer.start - index; \
+					IMPL##_rotate(sort, amount, wikisort_range_new(index, buffer.end)); \
+					buffer.start -= amount; \
+					buffer.end -= (amount + 1); \
+					unique -= 2; \
+				} \
+			} \
+		} \
+		 \
+		/* double the size of each A and B subarray that will be merged in the next level */ \
+		if(!wikisort_iter_nextLevel(&iter)) \
+			break; \
+	} \
+}
+
+/* the public entry points */
+#define WIKISORT_DEFINE_ENTRY_(NAME, TYPE) \
+void NAME( \
+		TYPE *base, \
+		size_t size) \
+{ \
+	TYPE cache[WIKISORT_IMPL_CACHE_SIZE(TYPE)]; \
+	struct NAME##_sort sort; \
+	sort.array = base; \
+	sort.size = size; \
+	sort.map = NULL; \
+	sort.cache = cache; \
+	sort.cachemap = NULL; \
+	sort.cache_size = WIKISORT_IMPL_CACHE_SIZE(TYPE); \
+	NAME##_untraced_runsort(&sort); \
+} \
+\
+void NAME##_trace( \
+		TYPE *base, \
+		size_t size, \
+		size_t *map) /* size: 'size' */ \
+{ \
+	TYPE cache[WIKISORT_IMPL_CACHE_SIZE(TYPE)]; \
+	size_t cachemap[WIKISORT_IMPL_CACHE_SIZE(TYPE)]; \
+	struct NAME##_sort sort; \
+	sort.array = base; \
+	sort.size = size; \
+	sort.map = map; \
+	sort.cache = cache; \
+	sort.cachemap = cachemap; \
+	sort.cache_size = WIKISORT_IMPL_CACHE_SIZE(TYPE); \
+	for(size_t i = 0; i < size; i++) \
+		map[i] = i; \
+	NAME##_traced_runsort(&sort); \
+}
+
+#define WIKISORT_DEFINE(NAME, TYPE, LESS) \
+	WIKISORT_DEFINE_COMMON_(NAME, TYPE, LESS) \
+	WIKISORT_DEFINE_SORT_(NAME, NAME##_untraced, TYPE, 0) \
+	WIKISORT_DEFINE_SORT_(NAME, NAME##_traced, TYPE, 1) \
+	WIKISORT_DEFINE_ENTRY_(NAME, TYPE)
+
+#endif